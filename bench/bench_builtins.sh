@@ -0,0 +1,32 @@
+#!/bin/sh
+# Compares how many commands per second sish gets through when they are builtins (run inside the shell)
+# against the same commands run as programs (spawned and exec'd).
+# Usage: bench/bench_builtins.sh [path to sish] [commands per run]
+SISH=${1:-./sish.out}
+COUNT=${2:-20000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+# Runs COUNT copies of a command through sish in batch mode, and prints a JSON line with the rate
+run() {
+    name=$1
+    shift
+    i=0
+    : > "$SCRIPT"
+    while [ $i -lt "$COUNT" ]; do
+        echo "$*" >> "$SCRIPT"
+        i=$((i + 1))
+    done
+    start=$(date +%s.%N)
+    "$SISH" "$SCRIPT" > /dev/null
+    end=$(date +%s.%N)
+    echo "$name $start $end" | awk -v count="$COUNT" '{
+        seconds = $3 - $2
+        printf "{\"benchmark\": \"%s\", \"commands\": %d, \"seconds\": %.6f, \"commands_per_sec\": %.0f}\n", $1, count, seconds, count / seconds
+    }'
+}
+
+run builtin_true true
+run exec_true /bin/true
+run builtin_echo echo hello world
+run exec_echo /bin/echo hello world
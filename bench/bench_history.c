@@ -0,0 +1,49 @@
+// Benchmark for history replay. Fills the history with commands, then replays every entry the way "history N" does,
+// and measures how many replayed commands per second the shell gets through
+// Usage: bench_history.out [entries] [replays of the whole history]
+#define SISH_NO_MAIN
+#include "../sish.c"
+
+// Returns the current time in seconds, from a clock that can't jump around while we measure
+double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    int entries = argc > 1 ? atoi(argv[1]) : 1000;
+    int replays = argc > 2 ? atoi(argv[2]) : 5;
+    static char* commands[] = {"true", "echo replayed line", "/bin/true", "printf %s%d x 1"};
+    int command_count = sizeof(commands) / sizeof(commands[0]);
+    int should_continue = 1, saved_stdout, i, j;
+    double start, elapsed;
+    Error replay_result;
+
+    // A batch shell keeps its history in memory only, which is all that's needed here
+    setenv("SISH_HISTSIZE", argc > 1 ? argv[1] : "1000", 1);
+    init_shell(0);
+    for (i = 0; i < entries; i++) {
+        add_history(commands[i % command_count]);
+    }
+    // What the replayed commands print isn't what's being measured
+    fflush(stdout);
+    saved_stdout = dup(STDOUT_FILENO);
+    dup2(open("/dev/null", O_WRONLY), STDOUT_FILENO);
+    start = now_seconds();
+    for (j = 0; j < replays; j++) {
+        for (i = 0; i < history_length(); i++) {
+            replay_result = handle_input(history_entry(i), &should_continue);
+            if (!replay_result.is_ok) {
+                fprintf(stderr, "Error (%d): %s\n", replay_result.error_code, replay_result.error_string);
+                return 1;
+            }
+        }
+    }
+    elapsed = now_seconds() - start;
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    printf("{\"benchmark\": \"history_replay\", \"commands\": %d, \"seconds\": %.6f, \"commands_per_sec\": %.0f}\n",
+        entries * replays, elapsed, entries * replays / elapsed);
+    return 0;
+}
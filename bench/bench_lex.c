@@ -0,0 +1,68 @@
+// Micro-benchmark for the lexer. Builds very long command lines and measures how many tokens per second lex_line gets through
+// Usage: bench_lex.out [tokens per line] [repetitions]
+#define SISH_NO_MAIN
+#include "../sish.c"
+#include <time.h>
+
+// Returns the current time in seconds, from a clock that can't jump around while we measure
+double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Builds a line of roughly token_count tokens, mixing plain words, quoted words, escapes and pipes
+char* build_line(int token_count) {
+    static char* pieces[] = {"grep", "-v", "'single quoted'", "\"double \\\"quoted\\\"\"", "escaped\\ space", "|", "--flag=value"};
+    int piece_count = sizeof(pieces) / sizeof(pieces[0]);
+    size_t length = 0, capacity = 64;
+    char* line = malloc(capacity);
+    int i;
+
+    // Always start with a word, so the pipes never leave a command empty
+    strcpy(line, "cat");
+    length = 3;
+    for (i = 1; i < token_count; i++) {
+        char* piece = pieces[i % piece_count];
+        size_t piece_length = strlen(piece);
+        while (length + piece_length + 2 >= capacity) {
+            capacity *= 2;
+            line = realloc(line, capacity);
+        }
+        line[length++] = ' ';
+        memcpy(line + length, piece, piece_length);
+        length += piece_length;
+    }
+    // Never finish on a pipe
+    strcpy(line + length, " end");
+    return line;
+}
+
+int main(int argc, char** argv) {
+    int token_count = argc > 1 ? atoi(argv[1]) : 1000000;
+    int repetitions = argc > 2 ? atoi(argv[2]) : 20;
+    char* line = build_line(token_count);
+    size_t tokens = 0;
+    double start, elapsed;
+    Error lex_result;
+    ParsedLine* parsed;
+    int i;
+
+    start = now_seconds();
+    for (i = 0; i < repetitions; i++) {
+        lex_result = lex_line(line);
+        if (!lex_result.is_ok) {
+            printf("Error (%d): %s\n", lex_result.error_code, lex_result.error_string);
+            return 1;
+        }
+        parsed = *(ParsedLine**)lex_result.value_ptr;
+        // Pipes are tokens too, even though they don't end up as words
+        tokens += parsed->word_count + parsed->command_count - 1;
+        free_line(parsed);
+    }
+    elapsed = now_seconds() - start;
+    printf("{\"benchmark\": \"lex\", \"line_bytes\": %zu, \"tokens\": %zu, \"seconds\": %.6f, \"tokens_per_sec\": %.0f, \"mb_per_sec\": %.2f}\n",
+        strlen(line), tokens, elapsed, tokens / elapsed, strlen(line) * (double)repetitions / elapsed / 1e6);
+    free(line);
+    return 0;
+}
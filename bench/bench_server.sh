@@ -0,0 +1,62 @@
+#!/bin/sh
+# Compares short requests run by starting a fresh sish for each one against the same requests sent to a warm
+# sish server, both with a client process per request and with every request down one connection. The concurrent run
+# has CLIENTS connections at once. Prints one JSON line per benchmark.
+# Usage: bench/bench_server.sh [path to sish] [requests per run] [concurrent clients]
+SISH=${1:-./sish.out}
+COUNT=${2:-2000}
+CLIENTS=${3:-8}
+SOCKET=$(mktemp -u)
+SCRIPT=$(mktemp)
+"$SISH" --server "$SOCKET" 2> /dev/null &
+SERVER=$!
+trap 'kill $SERVER; rm -f "$SOCKET" "$SCRIPT"' EXIT
+while [ ! -S "$SOCKET" ]; do sleep 0.1; done
+
+# Prints a JSON line with how many requests per second a run got through
+report() {
+    echo "$1 $2 $3 $4" | awk '{
+        seconds = $4 - $3
+        printf "{\"benchmark\": \"%s\", \"requests\": %d, \"seconds\": %.6f, \"requests_per_sec\": %.0f}\n", $1, $2, seconds, $2 / seconds
+    }'
+}
+
+REQUEST="cd /tmp && echo request > /dev/null"
+i=0
+: > "$SCRIPT"
+while [ $i -lt "$COUNT" ]; do
+    echo "$REQUEST" >> "$SCRIPT"
+    i=$((i + 1))
+done
+
+start=$(date +%s.%N)
+i=0
+while [ $i -lt "$COUNT" ]; do
+    "$SISH" -c "$REQUEST"
+    i=$((i + 1))
+done
+report fresh_shell "$COUNT" "$start" "$(date +%s.%N)"
+
+start=$(date +%s.%N)
+i=0
+while [ $i -lt "$COUNT" ]; do
+    "$SISH" --connect "$SOCKET" -c "$REQUEST"
+    i=$((i + 1))
+done
+report server_client_per_request "$COUNT" "$start" "$(date +%s.%N)"
+
+start=$(date +%s.%N)
+"$SISH" --connect "$SOCKET" < "$SCRIPT"
+report server_one_connection "$COUNT" "$start" "$(date +%s.%N)"
+
+# The clients run in a subshell of their own, so its wait is for them and not the server
+start=$(date +%s.%N)
+(
+    i=0
+    while [ $i -lt "$CLIENTS" ]; do
+        "$SISH" --connect "$SOCKET" < "$SCRIPT" &
+        i=$((i + 1))
+    done
+    wait
+)
+report server_concurrent "$((COUNT * CLIENTS))" "$start" "$(date +%s.%N)"
@@ -0,0 +1,99 @@
+#!/bin/sh
+# Throughput benchmarks for sish as a whole: lots of trivial commands, very long argument lists, deep pipelines
+# and bulk data through pipes. Prints one JSON line per benchmark, so runs can be diffed or fed to other tools.
+# Spawn latency percentiles come from sish's own launch histogram (see --stats=json).
+# Usage: bench/bench_shell.sh [path to sish] [commands per run] [megabytes through the pipes]
+SISH=${1:-./sish.out}
+COUNT=${2:-5000}
+MEGABYTES=${3:-1024}
+SCRIPT=$(mktemp)
+STATS=$(mktemp)
+SISH_CACHE_DIR=$(mktemp -d)
+export SISH_CACHE_DIR
+trap 'rm -f "$SCRIPT" "$STATS"; rm -rf "$SISH_CACHE_DIR"' EXIT
+
+# Writes COUNT copies of a line to the script
+repeat() {
+    i=0
+    : > "$SCRIPT"
+    while [ $i -lt "$COUNT" ]; do
+        echo "$*" >> "$SCRIPT"
+        i=$((i + 1))
+    done
+}
+
+# Runs the script through sish and prints a JSON line with how many lines (or stages) it got through per second,
+# along with the launch latency percentiles sish recorded while doing it
+run() {
+    name=$1
+    units=$2
+    start=$(date +%s.%N)
+    "$SISH" --stats=json "$SCRIPT" > /dev/null 2> "$STATS"
+    end=$(date +%s.%N)
+    grep '"phase": "launch"' "$STATS" | awk -v name="$name" -v count="$COUNT" -v units="$units" -v start="$start" -v end="$end" '{
+        gsub(/[{},"]/, "")
+        for (i = 1; i < NF; i++) {
+            value[$i] = $(i + 1)
+        }
+        seconds = end - start
+        printf "{\"benchmark\": \"%s\", \"commands\": %d, \"seconds\": %.6f, \"commands_per_sec\": %.0f, \"processes_per_sec\": %.0f, ",
+            name, count, seconds, count / seconds, count * units / seconds
+        printf "\"spawn_p50_ns\": %d, \"spawn_p90_ns\": %d, \"spawn_p99_ns\": %d, \"spawn_max_ns\": %d}\n",
+            value["p50_ns:"], value["p90_ns:"], value["p99_ns:"], value["max_ns:"]
+    }'
+}
+
+# Pushes MEGABYTES of data through a pipeline and prints a JSON line with the rate
+throughput() {
+    name=$1
+    shift
+    echo "$*" > "$SCRIPT"
+    start=$(date +%s.%N)
+    "$SISH" "$SCRIPT" > /dev/null
+    end=$(date +%s.%N)
+    echo "$name $start $end" | awk -v megabytes="$MEGABYTES" '{
+        seconds = $3 - $2
+        printf "{\"benchmark\": \"%s\", \"megabytes\": %d, \"seconds\": %.6f, \"mb_per_sec\": %.1f}\n", $1, megabytes, seconds, megabytes / seconds
+    }'
+}
+
+repeat /bin/true
+run trivial 1
+
+# A thousand arguments per command, so lexing and building argv dominate
+ARGS=$(i=0; while [ $i -lt 1000 ]; do printf ' argument-%d' $i; i=$((i + 1)); done)
+repeat /bin/true "$ARGS"
+run long_arguments 1
+
+# Twelve processes a line, so a tenth as many lines keeps the run about as long as the others
+COUNT=$((COUNT / 10))
+repeat /bin/echo x "| /bin/cat | /bin/cat | /bin/cat | /bin/cat | /bin/cat | /bin/cat | /bin/cat | /bin/cat | /bin/cat | /bin/cat | /bin/cat"
+run pipeline_12_stages 12
+
+# The same ten commands as one list a line, which is lexed once and never goes back to the read loop in between
+repeat /bin/true "; /bin/true && /bin/true; /bin/false || /bin/true; /bin/true; /bin/true && /bin/true; /bin/true; /bin/true"
+run list_10_commands 10
+
+# A variable set and expanded on every line, and a per-command assignment, so the symbol table is on the hot path.
+# Two processes a line: the assignment runs in the shell
+repeat "T=/bin/true; A=\$T B=x \$T \$A \"\$B\"; \$T"
+run variables 2
+
+# A three stage pipeline, then the same one through the output cache, which only runs it for the first line
+# and replays what it printed for every other one
+repeat "/bin/echo x | /bin/cat | /bin/cat"
+run pipeline_3_stages 3
+repeat "cached -n /bin/echo x | /bin/cat | /bin/cat"
+run cached_pipeline_3_stages 3
+
+# The same pipeline under the spawn governor, with a cap on running children and an rlimit, which costs the fork
+# launcher instead of posix_spawn and a look at the job table before every line
+repeat "/bin/echo x | /bin/cat | /bin/cat"
+sed -i '1i governor -j 4 -n 1024' "$SCRIPT"
+run governed_pipeline_3_stages 3
+
+throughput pipe_builtin_cat "head -c ${MEGABYTES}M /dev/zero | cat | cat | cat > /dev/null"
+throughput pipe_exec_cat "head -c ${MEGABYTES}M /dev/zero | /bin/cat | /bin/cat | /bin/cat > /dev/null"
+
+# The same pipeline with 1 MiB pipes (the most an unprivileged user gets by default) and every stage pinned to a CPU
+throughput pipe_exec_cat_placed "placement -p 1M -c spread; head -c ${MEGABYTES}M /dev/zero | /bin/cat | /bin/cat | /bin/cat > /dev/null"
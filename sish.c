@@ -1,19 +1,153 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <fnmatch.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+// termios.h names its echo flag ECHO, which is the echo builtin's CommandType here, so the flag gets another name
+enum { TERMINAL_ECHO = ECHO };
+#undef ECHO
 #define MAX_HISTORY_SIZE 100
+#define COMMAND_CACHE_BUCKETS 256
+#define HISTORY_LINE_START '\001'
+#define READ_BUFFER_SIZE (256 * 1024)
+#define BUILTIN_SLOTS 128
+// The most a single splice, sendfile or copy_file_range is asked to move. The kernel moves less whenever it wants to
+#define TRANSFER_CHUNK (1 << 30)
+// Latency histograms split every power of two of nanoseconds into 2^HISTOGRAM_SUB_BITS equal buckets
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+// The audit log's queue holds this many bytes of JSON lines, and its writer looks for new ones this often (in ms)
+#define AUDIT_QUEUE_SIZE (1024 * 1024)
+#define AUDIT_WAKE_MS 200
+// Pipelines of up to this many stages are run without allocating anything for them
+#define PIPELINE_LOCAL_STAGES 16
+// How many parsed lines are kept for reuse (SISH_PARSE_CACHE can change it), and the buckets they're found through
+#define PARSE_CACHE_SIZE 256
+#define PARSE_CACHE_BUCKETS 512
+
+#define COMMAND_INDEX_DIRECTORIES 64
+#define COMPLETION_LIST_LIMIT 100
+
+#define DIRECTORY_CACHE_SIZE 32
+#define DIRECTORY_CACHE_BYTES (64 * 1024 * 1024)
+#define GETDENTS_BUFFER_SIZE (256 * 1024)
+// The server reads a worker's output this many bytes at a time. It stops reading a session's workers while that session
+// has SERVER_OUTPUT_LIMIT bytes waiting to go to its client, and stops reading from a client that has sent
+// SERVER_INPUT_LIMIT bytes of lines that haven't run yet
+#define SERVER_READ_CHUNK (64 * 1024)
+#define SERVER_OUTPUT_LIMIT (1024 * 1024)
+#define SERVER_INPUT_LIMIT (1024 * 1024)
+// The symbol table starts with this many slots, and doubles whenever it gets three quarters full
+#define VARIABLE_TABLE_START 64
+// The output cache's index has this many slots, and entries are evicted once three quarters of them are taken or the
+// entries add up to more than OUTPUT_CACHE_BYTES (or SISH_CACHE_SIZE). The magic numbers change whenever a format does
+#define OUTPUT_CACHE_SLOTS 4096
+#define OUTPUT_CACHE_BYTES (256LL * 1024 * 1024)
+#define OUTPUT_CACHE_MAGIC 0x73697368636931ULL
+#define CACHE_ENTRY_MAGIC 0x73697368636531ULL
+// The governor remembers what this many of the last jobs it gave cgroups to used
+#define ACCOUNT_HISTORY 16
+
+// Defines the type of command read from the console. Everything but CONSOLE is a builtin, run by the shell itself,
+// and is also the index of that builtin's row in the builtins table.
+// ASSIGN has no name, so it can't be typed: the lexer picks it for commands that are nothing but NAME=VALUE words.
+// CACHE_RELAY has no name either. It's only ever started by run_cached
+typedef enum CommandType {
+    CONSOLE,
+    EXIT,
+    CD,
+    HISTORY,
+    LAUNCHER,
+    HASH,
+    ECHO,
+    PWD,
+    TRUE,
+    FALSE,
+    PRINTF,
+    EXPORT,
+    TYPE,
+    JOBS,
+    FG,
+    BG,
+    WAIT,
+    PARALLEL,
+    CAT,
+    TEE,
+    TIME,
+    STATS,
+    PLACEMENT,
+    GOVERNOR,
+    CACHED,
+    UNSET,
+    ASSIGN,
+    CACHE_RELAY,
+    COMMAND_TYPE_COUNT,
+} CommandType;
 
 // Wrapper struct for a shell command, mainly for piping.
 // Should contain a command "chunk", as well as appropriate stdin and stdout pipes
 // If at the beginning, should not have a stdin pipe. If at the end, should not have a stdout pipe
+// A missing pipe is stored as -1. pid is filled in once the stage has been forked, and status once it has been reaped
+// path is where the program was found on PATH, and is only valid once the stage has been launched
+// builtin is the command's CommandType, worked out once by the lexer
+// stdout_read_end is the other end of the stdout pipe. It belongs to the next stage, so this stage must never hold on to it
+// stderr is -1 unless the stage's errors are meant to go somewhere other than the shell's
+// input_file, output_file and error_file are the files the stage's <, > (or >>) and 2> (or 2>>) redirects name, or NULL.
+// They're opened right before the stage is launched, in place of any pipe the stage would have used
+// patterns goes along with command: patterns[i] is command[i] as a glob pattern (see expand_words) if it has any
+// unquoted *, ? or [ in it or any $ expansions, and NULL otherwise. patterns itself is NULL if the line has neither.
+// input_pattern, output_pattern and error_pattern are the same for the redirects' file names
+// assignments are the NAME=VALUE words in front of a command, which only go in that command's environment.
+// patterns has room for them too, right before command's. environment is the envp the stage is launched with,
+// which is filled in when the pipeline is started (see expand_words)
 
 typedef struct ShellCommand {
     char** command;
-    int stdin, stdout;
+    int word_count;
+    CommandType builtin;
+    char* path;
+    char** patterns;
+    char** assignments;
+    int assignment_count;
+    char** environment;
+    char* input_file, *output_file, *error_file;
+    char* input_pattern, *output_pattern, *error_pattern;
+    int output_append, error_append;
+    int stdin, stdout, stderr;
+    int stdout_read_end;
+    pid_t pid;
+    int status;
 } ShellCommand;
 
 // Certain values in the Option and Error structs do not need to be initialized depending on the "is" state.
@@ -40,13 +174,456 @@ typedef struct Error {
 // If we want to describe "There is nothing" we should use Option
 // If we want to describe "There should be something" we should use Error
 
-// Defines the type of command read from the console
-typedef enum CommandType {
-    CONSOLE,
-    EXIT,
-    CD,
-    HISTORY,
-} CommandType;
+// One block of memory handed out by an Arena. Blocks are chained so that an arena can keep growing if it has to
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used, capacity;
+    max_align_t memory[];
+} ArenaBlock;
+
+// A bump allocator. Everything belonging to one command line is allocated from the same arena,
+// so none of it is freed individually: the whole line goes away at once with free_arena
+typedef struct Arena {
+    ArenaBlock* head;
+} Arena;
+
+// How a pipeline in a list depends on the one before it. After a ; or a & (or at the start of a line) it always runs,
+// after && only if the one before succeeded, and after || only if it failed
+typedef enum ListOperator {
+    LIST_ALWAYS,
+    LIST_AND,
+    LIST_OR,
+} ListOperator;
+
+// One pipeline of a line. commands points at its stages among the line's commands, and text is its own part of the line,
+// for showing in the job table. is_background is set by a & after it, and is_timed by a leading time (which isn't one of the words)
+// is_cached is set by a leading cached, whose options (without the cached) are cache_words, along with their cache_patterns
+typedef struct Pipeline {
+    ShellCommand* commands;
+    int command_count;
+    char* text;
+    int is_background;
+    int is_timed;
+    int is_cached;
+    char** cache_words;
+    char** cache_patterns;
+    int cache_word_count;
+    ListOperator run_if;
+} Pipeline;
+
+// A command line after it has been lexed. It lives entirely inside its own arena.
+// words holds every stage's arguments back to back, each stage terminated by NULL so it can be handed to exec as is,
+// e.g. "ls -l | wc" becomes {"ls", "-l", NULL, "wc", NULL}. commands[i].command points at the start of stage i.
+// A line is a list of pipelines separated by ;, &, && and ||, which are in pipelines in the order they run.
+// text is a copy of the line as it was typed
+// Once lexed, a line is never changed, so a line that comes up again can be run again straight from the parse cache.
+// users counts who's running it right now, and the rest is the cache's (see find_parsed_line)
+typedef struct ParsedLine {
+    Arena arena;
+    char** words;
+    int word_count;
+    ShellCommand* commands;
+    int command_count;
+    Pipeline* pipelines;
+    int pipeline_count;
+    char* text;
+    int users;
+    int is_cached;
+    unsigned long hash;
+    struct ParsedLine* newer, *older, *bucket_next;
+} ParsedLine;
+
+// Where a whole pipeline reads from and writes to, for callers that want it somewhere other than the shell's own
+// stdin, stdout and stderr (-1 keeps the shell's). The caller keeps ownership of these: every stage gets its own copy
+typedef struct PipelineIO {
+    int stdin, stdout, stderr;
+} PipelineIO;
+
+// Where each process of a job is at, as last reported by the wait family
+typedef enum ProcessState {
+    PROCESS_RUNNING,
+    PROCESS_STOPPED,
+    PROCESS_DONE,
+} ProcessState;
+
+// A pipeline the shell has started and hasn't finished reaping yet. Every pipeline is a job while it runs,
+// in the foreground or not, so that whoever reaps a child (see reap_children) can always tell whose child it was.
+// pids, states and statuses have one entry per stage. Stages that never started (builtins run in the shell,
+// commands that weren't found) are PROCESS_DONE from the beginning. pgid is 0 without job control
+// argv_json is every stage's words as a JSON array of arrays, only kept while the audit log is on,
+// and NULL if it didn't fit in memory
+// usages and finished say what each stage used and when it was reaped (or when it ran, for builtins run in the shell),
+// and names is each stage's command name, so the job can report on itself once the line it came from is gone.
+// cgroup is the job's own cgroup if the governor gave it one. A helper is a job the shell runs for its own purposes
+// (cached's relay), which the governor leaves alone. is_interrupted is set once any of its stages is killed by ^C,
+// which a program that just exits with 130 never is
+typedef struct Job {
+    int id;
+    pid_t pgid;
+    pid_t* pids;
+    ProcessState* states;
+    int* statuses;
+    struct rusage* usages;
+    struct timespec* finished;
+    char** names;
+    struct timespec started;
+    int process_count;
+    char* text;
+    char* argv_json;
+    int is_background;
+    int is_timed;
+    char* cgroup;
+    int is_helper;
+    int is_interrupted;
+} Job;
+
+// The shell's history. Entries live in a ring buffer of capacity slots, starting at start, so adding an entry
+// and evicting the oldest one are both O(1). Each entry is stored exactly once.
+// If there is a history file, it is mmap'd privately when the shell starts, but not read. The newest entries
+// of it are only found (by scanning backwards from the end) the first time the history is actually looked at,
+// so even a huge history file costs nothing at startup. Entries found this way point straight into the mapping,
+// with their newlines overwritten by NULs, which copies only the pages they are on
+// Every entry also has a sequence number, which only ever goes up as entries are added: entry i is number first_seq + i.
+// For searching, the history keeps a trigram index: for every three character sequence, the numbers of the entries
+// containing it. A search only has to check the entries on the shortest list among its pattern's trigrams.
+// Entries are also indexed with a start of line marker in front, so that prefix searches can find "starts with" directly.
+// The index is built the first time it's needed, and from then on add_history keeps it up to date
+typedef struct History {
+    char** entries;
+    int capacity, start, count;
+    long long first_seq;
+    int file_fd;
+    char* file_map;
+    size_t file_size;
+    int file_loaded;
+    struct TrigramPostings* index;
+    int index_slots, index_used, index_built;
+} History;
+
+// The sequence numbers of the history entries containing one trigram, oldest first.
+// Numbers below the history's first_seq belong to evicted entries. They're skipped, and dropped when the list next grows.
+// A trigram of 0 marks an empty slot, which can't clash with a real trigram as entries never contain NULs
+typedef struct TrigramPostings {
+    unsigned int trigram;
+    long long* seqs;
+    int count, capacity;
+} TrigramPostings;
+
+// Reads lines out of a file descriptor in big chunks, instead of one system call (or worse, one terminal round trip) per line.
+// Lines are handed out in place: the newline is replaced with a NUL, and the line stays valid until the next read_line.
+// A reader with fd -1 reads lines out of whatever is already in its buffer, which is how -c strings are read
+typedef struct LineReader {
+    int fd;
+    char* buffer;
+    size_t start, end, capacity;
+    int at_eof;
+} LineReader;
+
+// One client of a sish server (see run_server). To its client, a session is a shell of its own, with its own directory,
+// history and $?. Its lines run one at a time, each in a worker forked from the server, so every line starts warm with
+// whatever the server has cached. input is what the client has sent that hasn't run yet, and output is the frames
+// waiting to be sent back (output_start bytes in). worker is the pid of the worker running the session's line, or 0
+// once it's been reaped. stdout_fd and stderr_fd are the read ends of its output pipes and report_fd the pipe it sends
+// its directory back on, each -1 once it's done with. A line is running for as long as report_fd isn't -1.
+// Everything else a line changes (variables, and the settings of builtins like governor) is saved by the worker in
+// the memory file state_fd, and kept as state (state_length bytes, NULL until the first line) for the next worker
+typedef struct Session {
+    int socket;
+    char* cwd;
+    History history;
+    int status;
+    char* input;
+    size_t input_length, input_capacity;
+    int input_is_closed;
+    char* output;
+    size_t output_start, output_length, output_capacity;
+    pid_t worker;
+    int worker_status;
+    int stdout_fd, stderr_fd, report_fd;
+    int pipes_are_watched;
+    int is_exiting;
+    int state_fd;
+    char* state;
+    size_t state_length;
+} Session;
+
+// What a server's epoll event is for. Each event's data is a session's slot times four plus one of these.
+// EVENT_SERVER is the listening socket in slot 0 and the SIGCHLD pipe in slot 1
+typedef enum ServerEvent {
+    EVENT_CLIENT,
+    EVENT_STDOUT,
+    EVENT_STDERR,
+    EVENT_SERVER,
+} ServerEvent;
+
+// The line being typed at an interactive prompt, see edit_line. buffer always has room for a NUL after its length bytes.
+// cursor is where in buffer the next key goes, and offset is the first byte that fits on screen when the line is too long for it.
+// history_index is the history entry being shown (history_length() for the line being typed), and typed keeps that line
+// while the history is being browsed
+typedef struct LineEditor {
+    char* prompt;
+    char* buffer;
+    size_t length, capacity;
+    size_t cursor, offset;
+    int history_index;
+    char* typed;
+} LineEditor;
+
+// A list of malloc'd names: the names a word could be completed to, or the paths a glob matched
+typedef struct NameList {
+    char** matches;
+    int count, capacity;
+} NameList;
+
+// A builtin gets the words of its command, sets the exit status it wants reported, and can stop the shell through should_continue.
+// Returning an error means the shell itself can't go on, exactly like errors from the rest of the shell
+typedef Error (*BuiltinFunction)(int word_count, char** words, int* status, int* should_continue);
+
+// One row of the builtins table
+typedef struct Builtin {
+    char* name;
+    BuiltinFunction run;
+} Builtin;
+// The table itself is filled in further down, once the builtins have been declared
+extern Builtin builtins[COMMAND_TYPE_COUNT];
+
+// One entry of the PATH lookup cache, mapping a command name to where it was found.
+// The mtime of the directory it was found in is kept so that entries can be dropped once that directory changes
+typedef struct CachedCommand {
+    char* name;
+    char* path;
+    struct timespec directory_mtime;
+    int hits;
+    struct CachedCommand* next;
+} CachedCommand;
+
+// One node of the command index's trie. The nodes below a node are in its child list, kept in order of their letters,
+// so the name a node stands for is the letters on the way down to it. directories has bit i set when the index's
+// directory i has a program by that name. Nodes whose programs have all gone are left in place, to be reused
+typedef struct CommandTrieNode {
+    char letter;
+    unsigned long long directories;
+    struct CommandTrieNode* child, *sibling;
+} CommandTrieNode;
+
+// Every program on PATH, for completing command names. Reading every PATH directory on every Tab is far too slow
+// with big bin directories, so the directories are read once, the first time a command name is completed, and from
+// then on inotify says what was added to or removed from them. watches has each directory's inotify watch, or -1 if
+// it couldn't be watched, in which case its mtime is checked instead and any change means reading everything again.
+// Only the first COMMAND_INDEX_DIRECTORIES absolute directories of PATH are indexed. path is the PATH it was built for
+typedef struct CommandIndex {
+    CommandTrieNode* root;
+    char* path;
+    char* directories[COMMAND_INDEX_DIRECTORIES];
+    int watches[COMMAND_INDEX_DIRECTORIES];
+    struct timespec mtimes[COMMAND_INDEX_DIRECTORIES];
+    int directory_count;
+    int inotify_fd;
+    int is_built, is_stale;
+} CommandIndex;
+
+// Every entry of one directory, as getdents64 last gave them for globbing. Each entry is its d_type byte followed by
+// its name and a NUL, back to back in names. Listings are found by the directory's device and inode rather than its
+// path, so cd doesn't confuse them, and are only good while the directory's mtime stays the same. A listing read within
+// a second of its directory changing is racy: something could change it again without the mtime showing it, so it's
+// never kept. users and is_cached work like a ParsedLine's, so a listing can be evicted while a glob is still using it
+typedef struct DirectoryListing {
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    char* names;
+    size_t size;
+    int count;
+    int users;
+    int is_cached;
+    struct DirectoryListing* newer, *older;
+} DirectoryListing;
+
+// A shell variable. entry is the whole "NAME=VALUE" in one allocation, so it can go straight into an envp,
+// and value points just past its '='. unset leaves a tombstone behind (entry is NULL but is_used stays set),
+// so variables further along the same probe sequence can still be found
+typedef struct Variable {
+    char* entry;
+    char* value;
+    size_t name_length;
+    unsigned long hash;
+    int is_exported;
+    int is_used;
+} Variable;
+
+// Every shell variable, in an open addressing hash table: a name lives in the first free slot at or after
+// its hash, wrapping around. used counts tombstones too, since they make probe sequences longer just the same.
+// environment is the envp every program the shell runs gets: the entries of the exported variables.
+// It's only rebuilt when an exported variable changes, so launching a program never copies the environment
+typedef struct SymbolTable {
+    Variable* slots;
+    int capacity, used, count;
+    char** environment;
+    int environment_is_stale;
+} SymbolTable;
+
+// One entry of the output cache's index. size is the size of the entry's file, or 0 for a slot that was never used and
+// -1 for one whose entry was evicted (which, like a Variable tombstone, keeps later entries on its probe sequence findable).
+// last_used is the index's clock when the entry was last stored or replayed, for evicting the least recently used first
+typedef struct OutputCacheEntry {
+    unsigned long long key[2];
+    long long size;
+    long long last_used;
+} OutputCacheEntry;
+
+// The output cache's index, which is a file in the cache directory mmap'd shared, so every shell using the same
+// directory sees the same entries and counts. Whoever changes it holds an flock on it. Entries are found by open
+// addressing on their key. hits and misses count every lookup made by any shell, and bytes is the size of every entry
+typedef struct OutputCacheIndex {
+    unsigned long long magic;
+    long long hits, misses, bytes, clock;
+    int count, tombstones;
+    OutputCacheEntry entries[OUTPUT_CACHE_SLOTS];
+} OutputCacheIndex;
+
+// What's at the start of every entry of the output cache. The pipeline's output follows it, then what it wrote to stderr.
+// Entries are files named after their key in hex, written under a temporary name and renamed into place once whole
+typedef struct CacheEntryHeader {
+    unsigned long long magic;
+    long long status;
+    long long output_length, error_length;
+} CacheEntryHeader;
+
+// The output cache, opened the first time a cached pipeline runs: its directory, its index (NULL until it's open) and
+// the size entries are kept within. hits and misses are only this shell's, for stats
+typedef struct OutputCache {
+    char* directory;
+    int index_fd;
+    OutputCacheIndex* index;
+    long long limit;
+    long long hits, misses;
+} OutputCache;
+
+// What the relay run_cached starts needs to know, which it gets by being forked with it already filled in.
+// The relay's stdin is a copy of output_read, the read end of the pipeline's stdout, and it reads the pipeline's stderr
+// from error_read. It closes the shell's write ends as soon as it starts, so that they close for good once the pipeline
+// is done with them. Whatever comes through goes on to the shell's stdout and stderr, and into output_record and
+// error_record as long as both together stay within limit
+typedef struct CacheRelay {
+    int output_read, error_read;
+    int output_write, error_write;
+    int output_record, error_record;
+    long long limit;
+} CacheRelay;
+
+// Which CPUs the stages of pipelines are pinned to. OFF leaves them to the scheduler. SPREAD uses every CPU the shell
+// may run on, one hyperthread of each core before any second ones, so stages get a core to themselves for as long as
+// there are cores to go round. NODE uses the CPUs of one NUMA node, and LIST the CPUs it was given
+typedef enum AffinityPolicy {
+    AFFINITY_OFF,
+    AFFINITY_SPREAD,
+    AFFINITY_NODE,
+    AFFINITY_LIST,
+} AffinityPolicy;
+
+// Where the stages of a pipeline run, and what connects them. pipe_size is what every pipe between two stages is grown
+// to (0 keeps the kernel's default). Stages are pinned to cpus in turn, carrying on from next_cpu where the pipeline
+// before left off, so that neighbouring stages (and pipelines started together, like parallel's) land on different CPUs.
+// node is the NUMA node of AFFINITY_NODE
+typedef struct Placement {
+    int pipe_size;
+    AffinityPolicy policy;
+    int node;
+    int* cpus;
+    int cpu_count;
+    int next_cpu;
+} Placement;
+
+// What a job's cgroup said it used, once the job was done: CPU time in microseconds (all of it, then user and system,
+// then how long cpu.max held it back), the most memory it had at once and how many of its processes the OOM killer took.
+// Anything the kernel doesn't keep track of (memory.peak needs Linux 5.19, and both need their controller) is -1
+typedef struct JobAccount {
+    char* text;
+    int status;
+    long long usage_usec, user_usec, system_usec, throttled_usec;
+    long long memory_peak, oom_kills;
+} JobAccount;
+
+// The spawn governor, see builtin_governor. max_running caps how many of the shell's children run at once (0 is no cap),
+// and queued and queued_ns count the pipelines that had to wait for that and how long they waited in all.
+// cpu_seconds, address_space and open_files are the rlimits every program a stage runs gets (0 for none).
+// With cgroup_base set, every pipeline gets a cgroup of its own under it, limited by memory_max (bytes) and cpu_percent
+// (of one CPU) if they're set. procs_fd is the cgroup.procs of the pipeline being launched, for its forked stages to
+// move themselves into. accounts holds what the last ACCOUNT_HISTORY jobs with cgroups used, oldest at next_account
+typedef struct Governor {
+    int max_running;
+    long long queued, queued_ns;
+    long long cpu_seconds, address_space, open_files;
+    char* cgroup_base;
+    long long memory_max;
+    int cpu_percent;
+    int procs_fd;
+    long long cgroup_serial;
+    JobAccount accounts[ACCOUNT_HISTORY];
+    int next_account;
+} Governor;
+
+// One run of parallel's command. Its output is held in memory files until every run before it has been printed
+typedef struct ParallelTask {
+    char* arg;
+    Job* job;
+    int output_fd, error_fd;
+    int status;
+    int is_finished;
+} ParallelTask;
+
+// The parts of running a line that the shell times, see record_latency.
+// LEX is lexing, SETUP is making the job, pipes and redirects, LAUNCH is forking or spawning one stage,
+// BUILTIN is running a builtin inside the shell and WAIT is waiting for a foreground job.
+// TOTAL is the whole of handle_input, and OVERHEAD is TOTAL without the BUILTIN and WAIT time of the line's own pipeline,
+// which is what sish itself costs each line
+typedef enum Phase {
+    PHASE_LEX,
+    PHASE_SETUP,
+    PHASE_LAUNCH,
+    PHASE_BUILTIN,
+    PHASE_WAIT,
+    PHASE_OVERHEAD,
+    PHASE_TOTAL,
+    PHASE_COUNT,
+} Phase;
+
+// A latency histogram in the style of an HDR histogram: log-linear buckets of nanoseconds, so it takes a fixed amount
+// of memory and recording is a couple of instructions, yet every bucket is within 1/16 (about 6%) of the values in it.
+// Values below HISTOGRAM_SUB_BUCKETS get a bucket each. After that, the value with its top bit at position e lands in
+// one of the HISTOGRAM_SUB_BUCKETS buckets for e, picked by the HISTOGRAM_SUB_BITS bits right below that top bit
+typedef struct Histogram {
+    long long counts[HISTOGRAM_BUCKETS];
+    long long count;
+    long long min, max;
+    double sum;
+} Histogram;
+
+// The audit log: a JSON line for every job sish finishes, written to a file by a thread of its own so the shell never
+// waits on the disk. Its queue is a ring of bytes with one producer (the shell) and one consumer (the writer thread).
+// The shell copies whole lines in at head, and the writer writes out everything from tail to head in one go, so the
+// batching comes for free and neither side takes a lock. head and tail only ever grow. Position n is at n % AUDIT_QUEUE_SIZE.
+// If the queue is ever full, lines are dropped (and counted) rather than making the shell wait
+typedef struct AuditLog {
+    char* queue;
+    _Atomic size_t head, tail;
+    _Atomic int is_stopping;
+    long long dropped;
+    int fd, wake_fd;
+    char* path;
+    off_t size, max_size;
+    double fsync_interval;
+    pthread_t writer;
+} AuditLog;
+
+// Defines how external programs are started.
+// FORK copies the shell with fork() and then calls execvp() in the child. It is the fallback that always works.
+// SPAWN uses posix_spawnp(), which glibc implements with clone(CLONE_VM | CLONE_VFORK), so the shell's page
+// tables are never copied and launching stays cheap no matter how big the shell's address space has grown.
+typedef enum Launcher {
+    LAUNCH_FORK,
+    LAUNCH_SPAWN,
+} Launcher;
 
 char* command_to_string(CommandType cmd);
 
@@ -115,14 +692,8 @@ char* command_to_string(CommandType cmd) {
     if (cmd == CONSOLE) {
         return "Console";
     } else
-    if (cmd == EXIT) {
-        return "Exit";
-    } else
-    if (cmd == CD) {
-        return "CD";
-    } else
-    if (cmd == HISTORY) {
-        return "History";
+    if (cmd > CONSOLE && cmd < COMMAND_TYPE_COUNT) {
+        return builtins[cmd].name;
     } else {
         // Not supposed to reach this branch
         return "I'm not exactly sure how you did this.";
@@ -163,445 +734,8157 @@ Error new_err(int error_code, char* error_string) {
 
 // Header functions for the shell code.
 Error sish();
+Error run_batch(LineReader* reader);
+Error init_file_reader(LineReader* reader, int fd);
+Error init_string_reader(LineReader* reader, char* text);
+Option read_line(LineReader* reader);
+Error run_server(char* socket_path);
+void accept_sessions();
+void read_session_input(int slot);
+void forward_worker_output(int slot, ServerEvent kind);
+void reap_workers();
+void advance_session(int slot);
+Error start_worker(int slot, char* line);
+void save_session_state(int fd);
+void restore_session_state(char* state, size_t length);
+void read_session_state(Session* session);
+void watch_session(int slot);
+int flush_session(Session* session);
+char* reserve_output(Session* session, size_t size);
+void finish_frame(Session* session, char type, size_t length);
+int queue_frame(Session* session, char type, char* data, size_t length);
+void close_session(int slot);
+int connect_server(char* socket_path, char* text);
+ssize_t edit_line(char* prompt, char** line, size_t* line_size);
+void refresh_line(LineEditor* editor);
+int insert_text(LineEditor* editor, char* text, size_t length);
+void delete_text(LineEditor* editor, size_t from, size_t to);
+size_t previous_character(LineEditor* editor, size_t position);
+size_t next_character(LineEditor* editor, size_t position);
+void browse_history(LineEditor* editor, int direction);
+void complete_word(LineEditor* editor);
+void list_completions(NameList* completions);
+void complete_commands(char* prefix, NameList* completions);
+void complete_files(char* word, NameList* completions);
+void add_name(NameList* list, char* name);
+void free_names(NameList* list);
+int compare_strings(const void* a, const void* b);
 Error handle_input(char* input_str, int* should_continue);
-Error read_from_user(char* input_str, int* token_amt);
-void cleanup_words(char** words, int token_amount);
+Error lex_line(char* input_str);
+char* append_pattern(char* pattern, char c, int is_quoted);
+size_t lex_expansion(char* p, char** out, char** pattern, int is_quoted);
+size_t name_length(char* text);
+void split_assignments(ShellCommand* shcmd);
+void free_line(ParsedLine* line);
+Error find_parsed_line(char* input_str);
+void release_parsed_line(ParsedLine* line);
+void unlink_parsed_line(ParsedLine* line);
+void display_parse_cache(FILE* out, int as_json);
+void* arena_alloc(Arena* arena, size_t size);
+int arena_reserve(Arena* arena, size_t size);
+void free_arena(Arena* arena);
 CommandType parse(char* command);
-Error command(char** words, int word_count);
-char** delimit_by_pipes(char** words, int word_count, int* offset_counter, int* has_ended);
-Error run_and_wait(ShellCommand shcmd, int should_in, int should_out);
+void init_builtin_table();
+unsigned int builtin_slot(char* name, unsigned int seed);
+Error run_builtin(ShellCommand* shcmd, int* should_continue);
+Error command(Pipeline* pipeline, int* should_continue);
+Error start_pipeline(Pipeline* pipeline, PipelineIO* io, int* should_continue);
+int runs_in_shell(Pipeline* pipeline, ShellCommand* command);
+void close_stage_fds(ShellCommand* shcmd);
+int open_redirects(ShellCommand* shcmd);
+void reset_child_signals();
+void fill_job_control_signals(sigset_t* signals);
+Error launch_stage(ShellCommand* shcmd, pid_t pgid);
+Error fork_stage(ShellCommand* shcmd, pid_t pgid);
+Error spawn_stage(ShellCommand* shcmd, pid_t pgid);
+char* launcher_to_string(Launcher launch_method);
+Error set_launcher(char* name);
+unsigned long hash_string(char* str);
+unsigned long hash_bytes(char* bytes, size_t length);
+void init_variables();
+Variable* find_variable(char* name, size_t length);
+Variable* set_variable(char* name, size_t length, char* value);
+void unset_variable(char* name);
+int grow_variables();
+char* get_variable(char* name);
+char** build_environment();
+Error resolve_command(char* name);
+Error find_on_path(char* name, char* path_variable);
+int directory_mtime(char* file_path, struct timespec* mtime);
+void clear_command_cache();
+void display_command_cache();
+void update_command_index();
+void build_command_index(char* path_variable);
+void free_command_index();
+void index_command(int directory, char* name);
+CommandTrieNode* find_trie_node(CommandTrieNode** level, char* name, int should_create);
+void collect_commands(CommandTrieNode* node, char* name, int depth, NameList* completions);
+void free_trie(CommandTrieNode* node);
+Error expand_words(ShellCommand* shcmd, Arena* arena);
+void expand_word(char* pattern, NameList* fields, int is_split);
+void add_field(NameList* fields, char* field, int should_glob);
+char* expand_single_word(char* pattern, Arena* arena);
+char* variable_value(char* name, size_t length, char* number);
+void glob_pattern(char* pattern, NameList* matches);
+void glob_directory(char* path, size_t path_length, char* pattern, NameList* matches);
+int has_glob_characters(char* text);
+DirectoryListing* find_directory_listing(char* path);
+DirectoryListing* read_directory(char* path, struct stat* directory_info);
+void release_directory_listing(DirectoryListing* listing);
+void unlink_directory_listing(DirectoryListing* listing);
+void display_directory_cache(FILE* out, int as_json);
+int decode_wait_status(int wait_status);
+Error create_job(Pipeline* pipeline, ShellCommand* commands);
+void free_job(Job* job);
+Job* find_job(char* job_spec);
+int job_is_done(Job* job);
+int job_is_stopped(Job* job);
+void record_child_status(pid_t pid, int wait_status, struct rusage* usage);
+void handle_sigchld(int signal_number);
+void reap_children();
+void wait_for_job(Job* job);
+int await_job(Job* job, int in_foreground);
+void catch_interrupts(struct sigaction* saved_action);
+void handle_interrupt(int signal_number);
+void signal_job(Job* job, int signal_number);
+void notify_jobs();
+int job_wants_report(Job* job);
+double job_real_seconds(Job* job);
+void report_job(Job* job);
+void print_usage_times(char* indent, double real, struct rusage* usage);
+double elapsed_seconds(struct timespec* from, struct timespec* to);
+double timeval_seconds(struct timeval* time);
+long long now_ns();
+void record_latency(Phase phase, long long nanoseconds);
+int histogram_bucket(unsigned long long value);
+long long histogram_bucket_value(int bucket);
+long long histogram_percentile(Histogram* histogram, double percentile);
+void display_stats(FILE* out, int as_json);
+char* format_ns(long long nanoseconds, char* buffer);
+void init_shell(int interactive);
 Error cd(char *dir);
+Error builtin_exit(int word_count, char** words, int* status, int* should_continue);
+Error builtin_cd(int word_count, char** words, int* status, int* should_continue);
+Error builtin_history(int word_count, char** words, int* status, int* should_continue);
+Error builtin_launcher(int word_count, char** words, int* status, int* should_continue);
+Error builtin_hash(int word_count, char** words, int* status, int* should_continue);
+Error builtin_echo(int word_count, char** words, int* status, int* should_continue);
+Error builtin_pwd(int word_count, char** words, int* status, int* should_continue);
+Error builtin_true(int word_count, char** words, int* status, int* should_continue);
+Error builtin_false(int word_count, char** words, int* status, int* should_continue);
+Error builtin_printf(int word_count, char** words, int* status, int* should_continue);
+Error builtin_export(int word_count, char** words, int* status, int* should_continue);
+Error builtin_type(int word_count, char** words, int* status, int* should_continue);
+Error builtin_jobs(int word_count, char** words, int* status, int* should_continue);
+Error builtin_fg(int word_count, char** words, int* status, int* should_continue);
+Error builtin_bg(int word_count, char** words, int* status, int* should_continue);
+Error builtin_wait(int word_count, char** words, int* status, int* should_continue);
+Error builtin_parallel(int word_count, char** words, int* status, int* should_continue);
+Error build_parallel_line(char** command_words, int command_count, char* arg);
+Error build_subshell_line(char* text);
+void append_text(char** buffer, size_t* length, size_t* capacity, char* text, size_t text_length);
+void append_quoted(char** buffer, size_t* length, size_t* capacity, char* text);
+Error start_parallel_task(ParallelTask* task, char** command_words, int command_count, int null_fd);
+void finish_parallel_task(ParallelTask* task);
+void flush_parallel_task(ParallelTask* task);
+void close_parallel_output(ParallelTask* task);
+int count_cores();
+Error builtin_placement(int word_count, char** words, int* status, int* should_continue);
+Error set_pipe_size(char* text);
+Error set_cpu_policy(char* text);
+int parse_cpu_list(char* text, cpu_set_t* cpus);
+int read_cpu_list(char* path, cpu_set_t* cpus);
+void place_stage(pid_t pid);
+void display_placement();
+long long parse_size(char* text);
+Error builtin_governor(int word_count, char** words, int* status, int* should_continue);
+Error set_governor_option(char option, char* value);
+Error enable_cgroups();
+int write_cgroup_file(char* directory, char* file, char* text);
+long long read_cgroup_value(char* directory, char* file, char* key);
+int count_running_children();
+int wait_for_children(int needed);
+int create_job_cgroup(Job* job);
+void apply_rlimits();
+void read_job_account(char* cgroup, JobAccount* account);
+void account_job(Job* job);
+void display_governor();
+void print_job_account(char* label, JobAccount* account);
+void display_job_accounts();
+Error builtin_cat(int word_count, char** words, int* status, int* should_continue);
+Error builtin_tee(int word_count, char** words, int* status, int* should_continue);
+int transfer_fd(int from_fd, int to_fd);
+int tee_by_splice(int from_fd, int* to_fds, int to_count);
+int splice_all(int from_fd, int to_fd, size_t length);
+int write_all(int fd, char* buffer, size_t length);
+Error builtin_time(int word_count, char** words, int* status, int* should_continue);
+Error builtin_stats(int word_count, char** words, int* status, int* should_continue);
+Error builtin_unset(int word_count, char** words, int* status, int* should_continue);
+Error builtin_assign(int word_count, char** words, int* status, int* should_continue);
+Error builtin_cached(int word_count, char** words, int* status, int* should_continue);
+Error builtin_cache_relay(int word_count, char** words, int* status, int* should_continue);
+Error run_cached(Pipeline* pipeline, int* should_continue);
+void close_cache_relay();
+int pipeline_redirects_output(Pipeline* pipeline);
+int make_cache_key(Pipeline* pipeline, unsigned long long* key);
+void hash_cache_bytes(unsigned long long* key, char* bytes, size_t length);
+void hash_cache_string(unsigned long long* key, char kind, char* text);
+int hash_cache_file(unsigned long long* key, char* path, int is_content);
+int open_output_cache();
+int make_directories(char* path);
+OutputCacheEntry* find_cache_entry(unsigned long long* key, int should_create);
+void cache_entry_path(unsigned long long* key, char* path);
+int replay_cache_entry(unsigned long long* key);
+int send_cache_region(int from_fd, int to_fd, char* mapping, off_t offset, size_t length);
+void store_cache_entry(unsigned long long* key, int status, int output_fd, int error_fd);
+void evict_cache_entries();
+void compact_cache_index();
+void clear_output_cache();
+void display_output_cache(FILE* out, int as_json);
+Error init_audit_log(char* path);
+void stop_audit_log();
+void audit_job(Job* job);
+void push_audit_line(char* text, size_t length);
+void* write_audit_log(void* unused);
+void rotate_audit_log();
+size_t audit_lines_within(size_t tail, size_t available, size_t limit);
+void append_json_string(char** buffer, size_t* length, size_t* capacity, char* text);
+Error init_history(History* target, int capacity, char* file_path);
+void load_history_file(History* target);
+int history_length();
+char* history_entry(int index);
+void free_history_entry(History* target, char* entry);
 void clear_history();
+void free_history(History* target);
 void add_history(char* commandInput);
 void display_history();
+void build_history_index(History* target);
+void index_history_entry(History* target, char* entry, long long seq);
+void add_posting(History* target, unsigned int trigram, long long seq);
+TrigramPostings* find_postings(History* target, unsigned int trigram, int should_create);
+void reset_history_index(History* target);
+unsigned int make_trigram(char* text);
+void search_history(char* pattern);
+char* find_history_prefix(char* prefix);
+
+// Every builtin, in CommandType order. CONSOLE's row is never run
+Builtin builtins[COMMAND_TYPE_COUNT] = {
+    {"", NULL},
+    {"exit", builtin_exit},
+    {"cd", builtin_cd},
+    {"history", builtin_history},
+    {"launcher", builtin_launcher},
+    {"hash", builtin_hash},
+    {"echo", builtin_echo},
+    {"pwd", builtin_pwd},
+    {"true", builtin_true},
+    {"false", builtin_false},
+    {"printf", builtin_printf},
+    {"export", builtin_export},
+    {"type", builtin_type},
+    {"jobs", builtin_jobs},
+    {"fg", builtin_fg},
+    {"bg", builtin_bg},
+    {"wait", builtin_wait},
+    {"parallel", builtin_parallel},
+    {"cat", builtin_cat},
+    {"tee", builtin_tee},
+    {"time", builtin_time},
+    {"stats", builtin_stats},
+    {"placement", builtin_placement},
+    {"governor", builtin_governor},
+    {"cached", builtin_cached},
+    {"unset", builtin_unset},
+    {"", builtin_assign},
+    {"", builtin_cache_relay},
+};
+
+// A perfect hash table over the builtins' names: builtin_slot(name, builtin_seed) gives every builtin a slot of its own,
+// so telling whether a word is a builtin takes one hash and at most one strcmp. The seed is found by init_builtin_table
+CommandType builtin_table[BUILTIN_SLOTS];
+unsigned int builtin_seed = 0;
+
+// Every job the shell has going, indexed by job number - 1. Free numbers are NULL, and the lowest one is reused first.
+// current_job is the number fg and bg use when they aren't given one
+Job** jobs = NULL;
+int job_slots = 0;
+int current_job = 0;
+
+// The SIGCHLD handler writes a byte here, so the shell can tell cheaply whether there's anything to reap
+int sigchld_pipe[2] = {-1, -1};
+// Set when ^C is pressed while the shell waits without handing the terminal to anyone, see catch_interrupts
+volatile sig_atomic_t wait_interrupted = 0;
 
 // Holds all commands entered by the user
-char* history[MAX_HISTORY_SIZE];
-int history_count = 0;
+History shell_history;
+History* history = &shell_history;
+
+// Exit status of the last pipeline that was run, reported the same way a POSIX shell does (last stage wins)
+int last_exit_status = 0;
+// Whether the last pipeline that was waited for was ^C'd (see Job), which stops the rest of its list
+int last_job_interrupted = 0;
+// Set when sish is attached to a terminal. An interactive shell ignores the keyboard's signals itself
+int is_interactive = 0;
+// Foreground jobs that take at least this many seconds report what they used like time does. Negative turns this off
+double report_threshold = -1;
+// Set when each pipeline gets its own process group, which it is handed the terminal for while it runs in the foreground.
+// This is on for interactive shells, except while something (like parallel) needs its children to share the shell's group
+int job_control = 0;
+// Latency histograms for each Phase, which the stats builtin shows and --stats prints at exit
+Histogram phase_histograms[PHASE_COUNT];
+char* phase_names[PHASE_COUNT] = {"lex", "setup", "launch", "builtin", "wait", "overhead", "total"};
+// How long the line being handled has spent running builtins and waiting for its pipeline, which isn't overhead
+long long line_work_ns = 0;
+// The audit log, which is on when SISH_AUDIT_LOG names a file. audit_cwd is the shell's directory, kept for its lines
+AuditLog audit;
+int audit_enabled = 0;
+char* audit_cwd = NULL;
+// Set by --stats (1) or --stats=json (2), to print the histograms when the shell exits
+int print_stats_at_exit = 0;
+// How external programs are started. Can be changed at runtime with the launcher command or the SISH_LAUNCHER variable
+Launcher launcher = LAUNCH_SPAWN;
+
+// Lines that have already been lexed, by the hash of their text, in most recently used order from parse_cache_newest.
+// Lines past parse_cache_capacity are dropped from the oldest end. The hit and miss counts are shown by stats
+ParsedLine* parse_cache[PARSE_CACHE_BUCKETS];
+ParsedLine* parse_cache_newest = NULL;
+ParsedLine* parse_cache_oldest = NULL;
+int parse_cache_count = 0;
+int parse_cache_capacity = PARSE_CACHE_SIZE;
+long long parse_cache_hits = 0, parse_cache_misses = 0;
+
+// Holds where each command name was found on PATH, so PATH only has to be searched the first time a name is used.
+// command_cache_path is the value of PATH the cache was filled with. If PATH changes, the whole cache is thrown out
+CachedCommand* command_cache[COMMAND_CACHE_BUCKETS];
+char* command_cache_path = NULL;
+// Every program on PATH, for completing command names. It's only built the first time it's needed
+CommandIndex command_index;
+// Directories globs have listed, in most recently used order from directory_cache_newest. Past DIRECTORY_CACHE_SIZE
+// listings or DIRECTORY_CACHE_BYTES of names, the oldest are dropped. The hit and miss counts are shown by stats
+DirectoryListing* directory_cache_newest = NULL;
+DirectoryListing* directory_cache_oldest = NULL;
+int directory_cache_count = 0;
+size_t directory_cache_bytes = 0;
+long long directory_cache_hits = 0, directory_cache_misses = 0;
+// The shell's variables, which start out as a copy of the environment sish was started with
+SymbolTable shell_variables;
+// A server's sessions, indexed by slot (free slots are NULL), and the sockets and epoll instance it runs on.
+// Workers start audit logs of their own at server_audit_path, since the server itself never has a writer thread
+Session** sessions = NULL;
+int session_slots = 0;
+int server_socket = -1;
+int server_epoll_fd = -1;
+char* server_cwd = NULL;
+char* server_audit_path = NULL;
+// The spawn governor's settings and what it's seen, see governor
+Governor governor = {0, 0, 0, 0, 0, 0, NULL, 0, 0, -1, 0, {{NULL, 0, 0, 0, 0, 0, 0, 0}}, 0};
+// How pipelines are laid out, see placement
+Placement placement = {0, AFFINITY_OFF, -1, NULL, 0, 0};
+// The output cache of the cached builtin, and what its relay is working with while one is running
+OutputCache output_cache = {NULL, -1, NULL, OUTPUT_CACHE_BYTES, 0, 0};
+CacheRelay cache_relay = {-1, -1, -1, -1, -1, -1, 0};
 
 // Entry point for the program
-int main() {
-    Error program_result = sish();
+// Benchmarks include this file directly to get at the shell's internals, and define SISH_NO_MAIN to bring their own main
+#ifndef SISH_NO_MAIN
+// With no arguments, sish reads commands from stdin: interactively if stdin is a terminal, as a batch otherwise.
+// "sish script.sh" runs the commands in script.sh, and "sish -c 'commands'" runs the commands given to it.
+// Batches don't print a prompt or touch the history, and stop at the end of their input.
+// "sish --server SOCKET" serves sessions on a Unix socket instead (see run_server), and "sish --connect SOCKET"
+// runs its stdin (or "-c 'commands'") on one.
+// The shell exits with the status of the last command it ran
+int main(int argc, char** argv) {
+    Error program_result;
+    LineReader reader;
+    int script_fd;
+
+    // --stats goes before everything else, and prints where the shell spent its time once it's done.
+    // --stats=json prints the same as JSON, for scripts (like the benchmarks) to read
+    if (argc > 1 && (strcmp(argv[1], "--stats") == 0 || strcmp(argv[1], "--stats=json") == 0)) {
+        print_stats_at_exit = argv[1][7] == '=' ? 2 : 1;
+        argv++;
+        argc--;
+    }
+    if (argc > 1 && (strcmp(argv[1], "--server") == 0 || strcmp(argv[1], "--connect") == 0)) {
+        if (argc < 3) {
+            printf("sish: %s needs a socket path\n", argv[1]);
+            return 2;
+        }
+        // A client has no use for any of the shell's state, so it doesn't set any up
+        if (strcmp(argv[1], "--connect") == 0) {
+            return connect_server(argv[2], (argc > 4 && strcmp(argv[3], "-c") == 0) ? argv[4] : NULL);
+        }
+        init_shell(0);
+        program_result = run_server(argv[2]);
+    } else
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            printf("sish: -c needs a command string\n");
+            return 2;
+        }
+        init_shell(0);
+        program_result = init_string_reader(&reader, argv[2]);
+        if (program_result.is_ok) {
+            program_result = run_batch(&reader);
+        }
+    } else
+    if (argc > 1) {
+        script_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (script_fd == -1) {
+            printf("sish: cannot open %s: %s\n", argv[1], strerror(errno));
+            return 127;
+        }
+        init_shell(0);
+        program_result = init_file_reader(&reader, script_fd);
+        if (program_result.is_ok) {
+            program_result = run_batch(&reader);
+        }
+    } else
+    if (!isatty(STDIN_FILENO)) {
+        init_shell(0);
+        program_result = init_file_reader(&reader, STDIN_FILENO);
+        if (program_result.is_ok) {
+            program_result = run_batch(&reader);
+        }
+    } else {
+        init_shell(1);
+        program_result = sish();
+    }
+    stop_audit_log();
+    if (print_stats_at_exit) {
+        display_stats(stderr, print_stats_at_exit == 2);
+    }
     if (program_result.is_ok) {
         // Since we're ok, we just do nothing.
     } else {
         printf("Error (%d): %s\n", program_result.error_code, program_result.error_string);
+        return 255;
+    }
+    return last_exit_status;
+}
+#endif
+
+// Sets up the signal state and history the shell needs before any commands are run.
+// Only an interactive shell does job control (its own process group per pipeline) and saves its history
+void init_shell(int interactive) {
+    char* launcher_name = getenv("SISH_LAUNCHER");
+    char* history_size = getenv("SISH_HISTSIZE");
+    char* history_file = getenv("SISH_HISTFILE");
+    char* report_time = getenv("SISH_REPORTTIME");
+    char* audit_path = getenv("SISH_AUDIT_LOG");
+    char* parse_cache_size = getenv("SISH_PARSE_CACHE");
+    char* pipe_size = getenv("SISH_PIPE_SIZE");
+    char* cpu_policy = getenv("SISH_CPUS");
+    char* max_children = getenv("SISH_MAX_CHILDREN");
+    Error audit_result;
+    char* home = getenv("HOME");
+    char* default_history_file = NULL;
+    int capacity = MAX_HISTORY_SIZE;
+    Error history_result;
+
+    init_builtin_table();
+    init_variables();
+    // The history keeps SISH_HISTSIZE entries (MAX_HISTORY_SIZE by default), and is saved to SISH_HISTFILE,
+    // which defaults to ~/.sish_history. Setting SISH_HISTFILE to nothing turns saving off
+    if (history_size != NULL && atoi(history_size) > 0) {
+        capacity = atoi(history_size);
+    }
+    if (!interactive) {
+        history_file = NULL;
+    } else
+    if (history_file == NULL && home != NULL) {
+        default_history_file = malloc(strlen(home) + sizeof("/.sish_history"));
+        if (default_history_file != NULL) {
+            strcpy(default_history_file, home);
+            strcat(default_history_file, "/.sish_history");
+        }
+        history_file = default_history_file;
+    }
+    history_result = init_history(history, capacity, history_file);
+    if (!history_result.is_ok) {
+        printf("History is not being saved: %s\n", history_result.error_string);
+    }
+    free(default_history_file);
+
+    if (launcher_name != NULL && !set_launcher(launcher_name).is_ok) {
+        printf("Unknown launcher in SISH_LAUNCHER: %s\n", launcher_name);
+    }
+    // SISH_REPORTTIME starts off time -a, like REPORTTIME in zsh
+    if (report_time != NULL && *report_time != '\0') {
+        report_threshold = atof(report_time);
+    }
+    // SISH_PARSE_CACHE is how many parsed lines are kept for reuse. 0 turns the cache off
+    if (parse_cache_size != NULL && *parse_cache_size != '\0' && atoi(parse_cache_size) >= 0) {
+        parse_cache_capacity = atoi(parse_cache_size);
+    }
+    // SISH_PIPE_SIZE and SISH_CPUS start off placement -p and placement -c
+    if (pipe_size != NULL && *pipe_size != '\0' && !set_pipe_size(pipe_size).is_ok) {
+        printf("Bad pipe size in SISH_PIPE_SIZE: %s\n", pipe_size);
+    }
+    if (cpu_policy != NULL && *cpu_policy != '\0' && !set_cpu_policy(cpu_policy).is_ok) {
+        printf("Bad CPUs in SISH_CPUS: %s\n", cpu_policy);
+    }
+    // SISH_MAX_CHILDREN starts off governor -j
+    if (max_children != NULL && *max_children != '\0' && !set_governor_option('j', max_children).is_ok) {
+        printf("Bad cap in SISH_MAX_CHILDREN: %s\n", max_children);
+    }
+    if (audit_path != NULL && *audit_path != '\0') {
+        audit_result = init_audit_log(audit_path);
+        if (!audit_result.is_ok) {
+            printf("Commands are not being audited: %s\n", audit_result.error_string);
+        }
+    }
+    // Children are reaped as they finish through reap_children, which only has anything to do once SIGCHLD has been seen
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == 0) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = handle_sigchld;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGCHLD, &action, NULL);
+    }
+    is_interactive = interactive;
+    job_control = interactive;
+    if (is_interactive) {
+        // Pipelines run in their own process group and own the terminal while they run.
+        // Taking the terminal back afterwards would otherwise stop the shell with SIGTTOU,
+        // and ^C, ^\\ and ^Z are meant for the pipeline, never the shell. Children put all of these back to normal
+        signal(SIGTTOU, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
     }
-    return 0;
 }
 
 // Error<Blank>
 // Runs the shell, prompting for input from the user, processing it, and running the relevant commands
 Error sish() {
-    char* input_str, *command_input;
+    char* input_str = NULL, *recalled;
     size_t line_size = 0;
+    ssize_t line_length;
     Error handle_input_result;
 
     int should_continue = 1;
     while (should_continue) {
-        line_size = 0;
-        // Prompt the user for input
-        printf("sish> ");
-        getline(&input_str, &line_size, stdin);
-        // Add the command to history
-        command_input = malloc(sizeof(char) * line_size);
-        strcpy(command_input, input_str);
-        add_history(command_input);
+        // Tell the user about background jobs that finished or stopped since the last prompt
+        reap_children();
+        notify_jobs();
+        // Prompt the user for input. edit_line reuses input_str from one line to the next, like getline
+        line_length = edit_line("sish> ", &input_str, &line_size);
+        if (line_length == -1) {
+            // There's nothing left to read, so there's nothing left to do
+            break;
+        }
+        if (line_length > 0 && input_str[line_length - 1] == '\n') {
+            input_str[line_length - 1] = '\0';
+        }
+        // "!prefix" runs the newest command starting with prefix, and "!!" the newest command of all
+        if (input_str[0] == '!' && input_str[1] != '\0' && input_str[1] != ' ') {
+            recalled = find_history_prefix(input_str[1] == '!' ? "" : input_str + 1);
+            if (recalled == NULL) {
+                printf("%s: event not found\n", input_str);
+                continue;
+            }
+            // The entry may get evicted by add_history below, so we run our own copy of it
+            recalled = strdup(recalled);
+            if (recalled == NULL) {
+                continue;
+            }
+            free(input_str);
+            input_str = recalled;
+            line_size = strlen(recalled) + 1;
+            printf("%s\n", input_str);
+        }
+        // Add the command to history. add_history makes its own copy
+        add_history(input_str);
         // Handle the command
         handle_input_result = handle_input(input_str, &should_continue);
-        // Cleanup and return errors
-        free(input_str);
+        // Return errors
         if (!handle_input_result.is_ok) {
+            free(input_str);
             return handle_input_result;
         }
     }
+    free(input_str);
     return new_ok(BLANK);
 }
 
 // Error<BLANK>
-Error handle_input(char* input_str, int* should_continue) {
-    Error words_result;
-    Error command_result;
-    Error cd_result;
-    char** words;
-    int i, j, command_offset;
-    int word_count;
-    CommandType cmd;
+// Runs every line of a batch, without prompting or recording history, until the input runs out or exit is run
+Error run_batch(LineReader* reader) {
+    Option line;
+    Error handle_input_result;
+    int should_continue = 1;
+
+    while (should_continue) {
+        line = read_line(reader);
+        if (!line.is_some) {
+            break;
+        }
+        handle_input_result = handle_input((char*)line.value_ptr, &should_continue);
+        if (!handle_input_result.is_ok) {
+            free(reader->buffer);
+            return handle_input_result;
+        }
+        // Background jobs shouldn't be left as zombies until the batch is over
+        reap_children();
+        notify_jobs();
+    }
+    free(reader->buffer);
+    return new_ok(BLANK);
+}
 
-    // Convert the string to individual words
-    words_result = read_from_user(input_str, &word_count);
-    // Confirm that words is "ok"
-    if (!words_result.is_ok) {
-        return words_result;
+// Error<BLANK>
+// Sets up a reader for the lines of the file descriptor fd
+Error init_file_reader(LineReader* reader, int fd) {
+    reader->fd = fd;
+    reader->start = 0;
+    reader->end = 0;
+    reader->at_eof = 0;
+    reader->capacity = READ_BUFFER_SIZE;
+    reader->buffer = malloc(reader->capacity);
+    if (reader->buffer == NULL) {
+        return new_err(0, "Read buffer failed to allocate");
     }
-    // If no text has been entered, don't execute the rest of the code. Simply continue to the next loop.
-    if (word_count == 0) {
-        return new_ok(BLANK);
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// Sets up a reader for the lines of text. The reader works on its own copy of text
+Error init_string_reader(LineReader* reader, char* text) {
+    reader->fd = -1;
+    reader->start = 0;
+    reader->end = strlen(text);
+    reader->at_eof = 1;
+    reader->capacity = reader->end + 1;
+    reader->buffer = malloc(reader->capacity);
+    if (reader->buffer == NULL) {
+        return new_err(0, "Read buffer failed to allocate");
     }
-    // Words has been confirmed as "ok" and has a length greater than 0. We can safely unwrap it now.
-    words = *(char***)words_result.value_ptr;
-    // Parse the first word of the input to idenify the type of command
-    cmd = parse(words[0]);
+    memcpy(reader->buffer, text, reader->end);
+    return new_ok(BLANK);
+}
 
-    // EXIT command
-    if (cmd == EXIT) {
-        // Tell the sish command to stop looping
-        *should_continue = 0;
-    } else
-    if (cmd == CONSOLE) { 
-        // Run the command and handle the relevant error
-        command_result = command(words, word_count);
-        if (command_result.is_ok) {
-        } else {
-            if (command_result.error_code == 255) {
-                printf("Something went wrong with the child process. Please try again.\n");
-            } else
-            if (command_result.error_code == 254) {
-                printf("Command not found. Please try again.\n");
-            } else
-            if (command_result.error_code == 1) {
-                // A recoverable error has occured in the child process, so we do nothing.
-            } else {
-                // We cannot guarantee that the shell can keep going
-                cleanup_words(words, word_count);
-                return command_result;
-            }
+// Option<char*>
+// Returns the next line, without its newline, or None once there are no lines left.
+// A read error is treated the same as the end of the input
+Option read_line(LineReader* reader) {
+    char* newline, *grown;
+    char* line;
+    ssize_t read_result;
+
+    while (1) {
+        newline = memchr(reader->buffer + reader->start, '\n', reader->end - reader->start);
+        if (newline != NULL) {
+            *newline = '\0';
+            line = reader->buffer + reader->start;
+            reader->start = newline - reader->buffer + 1;
+            return new_some((void*)line);
         }
-    } else
-    // CD command
-    if (cmd == CD) {
-        if (word_count == 1) {
-            // If no directory is provided, change to the user's home directory
-            char *home = getenv("HOME");
-            cd_result = cd(home);
-        } else {
-            cd_result = cd(words[1]);
+        if (reader->at_eof) {
+            // The last line doesn't have to end in a newline. There's always room for its NUL, see below
+            if (reader->start == reader->end) {
+                return new_none();
+            }
+            reader->buffer[reader->end] = '\0';
+            line = reader->buffer + reader->start;
+            reader->start = reader->end;
+            return new_some((void*)line);
         }
-        if (!cd_result.is_ok) {
-            if (cd_result.error_code != 0) {
-                cleanup_words(words, word_count);
-                return cd_result;
-            } else {
-                // In this case, we know this is a directory not found error, which is recoverable
-                printf("Directory not found.\n");
+        // Keep the unfinished line and make room after it, always leaving a byte spare for a NUL
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+        if (reader->end + 1 >= reader->capacity) {
+            grown = realloc(reader->buffer, reader->capacity * 2);
+            if (grown == NULL) {
+                reader->at_eof = 1;
+                continue;
             }
+            reader->buffer = grown;
+            reader->capacity *= 2;
         }
-    } else
-    // HiSTORY command
-    if (cmd == HISTORY) {
-        if (word_count == 1) {
-            // Occurs if the input is simply "history"
-            // In this case, we list all entries in history
-            display_history();
-        } else
-        if (strcmp(words[1], "-c") == 0) {
-            // Occurs if the input is simply "history -c"
-            // In this case, we clear the history
-            clear_history();
+        read_result = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end - 1);
+        if (read_result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (read_result <= 0) {
+            reader->at_eof = 1;
         } else {
-            // Occurs if the input is "history X", but we don't yet know what X is
-            // We need to try and convert the second argument to an integer
-            // Otherwise, there is invalid input and we need to return an error
-            char *endptr;
-            command_offset = strtol(words[1], &endptr, 10);
-            if (*endptr != '\0') {
-                // If this is the case, then the conversion failed
-                printf("Not a valid history index (not a number)");
-            } else {
-                // Offset is a valid number. We need to do boundary checking
-                if (command_offset < 0) {
-                    printf("Not a valid history index (must be greater than 0)");
-                } else
-                if (command_offset >= history_count) {
-                    printf("Not a valid history index (must exist in the history)");
-                } else
-                {
-                    // This is a valid index, so we can just call it
-                    cleanup_words(words, word_count);
-                    return handle_input(history[command_offset], should_continue);
-                }
-            }
+            reader->end += read_result;
         }
-
-    } else {
-        printf("NOT YET IMPLEMENTED: %s\n", command_to_string(cmd));
     }
-    // We no longer need the command, so we should free its memory
-    cleanup_words(words, word_count);
-    return new_ok(BLANK);
 }
 
-// Error<char**>
-Error read_from_user(char* input_str, int* token_amt) {
-    char** words;
-    char* dup_input_str = NULL, *string_storage = NULL;
-    char* token;
-    char* savetoken;
-    size_t line_size = 0;
-    int i, j;
-
-    // strtok_r destroys input_str, even if we "redirect" it, so we'll need to duplicate it for the first tokenization loop.
-    dup_input_str = strdup(input_str);
-    // The string will need to be tokenized.
-    // First, we count the amount of tokens that exist so we can allocate the correct amount of space.
-    for (i = 0, string_storage = dup_input_str; ; i++, string_storage = NULL) {
-        token = strtok_r(string_storage, " \n", &savetoken);
-        if (token == NULL) {
-            break;
-        }
+// Error<BLANK>
+// Runs sish as a server on the Unix socket at socket_path until it's killed. Every client that connects gets a session
+// (see Session). A client sends command lines, and for each one gets back frames of what the line wrote to stdout ('o')
+// and stderr ('e') as it's written, then a frame with the line's exit status in decimal ('s'). A frame is its type byte,
+// its payload's length as four bytes (most significant first), then the payload. Blank lines get no frames at all.
+// A line is only done once everything it started has closed its output, so a background job holds its session up.
+// Everything happens on one epoll loop: the listening socket, the clients, the workers' pipes and the SIGCHLD pipe
+Error run_server(char* socket_path) {
+    struct sockaddr_un address;
+    struct epoll_event event, events[64];
+    int event_count, probe, slot, i, bind_result;
+    mode_t saved_umask;
+    ServerEvent kind;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        return new_err(0, "Socket path is too long");
     }
-    free(dup_input_str);
-    // i now holds the amount of tokens in the command
-    *token_amt = i;
-    words = (char**) malloc(sizeof(char*) * i);
-    if (words == NULL) {
-        return new_err(0, "Words failed to allocate");
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    // A socket file nobody answers on is left over from a server that's gone, so it's replaced
+    probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe != -1 && connect(probe, (struct sockaddr*)&address, sizeof(address)) == 0) {
+        close(probe);
+        return new_err(0, "Another server is already listening on that socket");
     }
-    // Now we can store each relevant token at the relevant position.
-    for (i = 0, string_storage = input_str; ; i++, string_storage = NULL) {
-        token = strtok_r(string_storage, " \n", &savetoken);
-        if (token == NULL) {
-            break;
-        }
-        for (j = 0; token[j] != '\0'; j++) {}
-        words[i] = (char*) malloc(sizeof(char) * j);
-        strcpy(words[i], token);
+    if (probe != -1) {
+        close(probe);
+    }
+    unlink(socket_path);
+    // Whoever can connect can run commands as the server's user, so the socket is only ever the user's own to open.
+    // It's made that way (rather than chmod'ed after) so there's no moment it isn't
+    server_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    saved_umask = umask(0177);
+    bind_result = server_socket == -1 ? -1 : bind(server_socket, (struct sockaddr*)&address, sizeof(address));
+    umask(saved_umask);
+    if (bind_result == -1 || listen(server_socket, SOMAXCONN) == -1) {
+        return new_err(errno, "Server socket could not be opened");
     }
+    server_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server_epoll_fd == -1) {
+        return new_err(errno, "Server epoll could not be created");
+    }
+    event.events = EPOLLIN;
+    event.data.u64 = EVENT_SERVER;
+    epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, server_socket, &event);
+    event.data.u64 = 4 + EVENT_SERVER;
+    epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, sigchld_pipe[0], &event);
+    server_cwd = getcwd(NULL, 0);
+    // Workers are forked from the server, which is only safe while it has one thread. So instead of the server
+    // writing an audit log, each worker writes its own to the same file
+    if (audit_enabled) {
+        server_audit_path = strdup(audit.path);
+        stop_audit_log();
+    }
+    fprintf(stderr, "sish: serving on %s\n", socket_path);
 
-    // We don't free memory, as freeing it will be the job of handle_input
-    // Since no errors have occured, we simply return the words
-    return new_ok((void*)&words);
+    while (1) {
+        event_count = epoll_wait(server_epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+        if (event_count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (event_count == -1) {
+            return new_err(errno, "Server epoll failed");
+        }
+        for (i = 0; i < event_count; i++) {
+            slot = events[i].data.u64 >> 2;
+            kind = events[i].data.u64 & 3;
+            if (kind == EVENT_SERVER) {
+                if (slot == 0) {
+                    accept_sessions();
+                } else {
+                    reap_workers();
+                }
+                continue;
+            }
+            // The session may have been closed by an earlier event in this batch
+            if (slot >= session_slots || sessions[slot] == NULL) {
+                continue;
+            }
+            if (kind != EVENT_CLIENT) {
+                forward_worker_output(slot, kind);
+            } else
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_session(slot);
+                continue;
+            } else
+            if (events[i].events & EPOLLIN) {
+                read_session_input(slot);
+            }
+            if (sessions[slot] != NULL) {
+                advance_session(slot);
+            }
+        }
+    }
 }
 
-// This cleans up each word in an array of words. Convinence function for deallocating the result of read_from_user
-void cleanup_words(char** words, int token_amount) {
-    int i;
-    for (i = 0; i < token_amount; i++) {
-        free(words[i]);
+// Takes every client waiting to connect, giving each a session that starts in the server's directory.
+// Only clients running as the server's own user get one, whatever the socket's permissions have been changed to
+void accept_sessions() {
+    struct epoll_event event;
+    struct ucred credentials;
+    socklen_t credentials_length;
+    Session* session, **grown;
+    int client, slot, i;
+
+    while ((client = accept4(server_socket, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1) {
+        credentials_length = sizeof(credentials);
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_length) == -1
+            || credentials.uid != geteuid()) {
+            close(client);
+            continue;
+        }
+        for (slot = 0; slot < session_slots && sessions[slot] != NULL; slot++) {}
+        if (slot == session_slots) {
+            grown = realloc(sessions, sizeof(Session*) * (session_slots == 0 ? 16 : session_slots * 2));
+            if (grown == NULL) {
+                close(client);
+                continue;
+            }
+            sessions = grown;
+            session_slots = session_slots == 0 ? 16 : session_slots * 2;
+            for (i = slot; i < session_slots; i++) {
+                sessions[i] = NULL;
+            }
+        }
+        session = calloc(1, sizeof(Session));
+        if (session == NULL || !init_history(&session->history, history->capacity, NULL).is_ok) {
+            free(session);
+            close(client);
+            continue;
+        }
+        session->socket = client;
+        session->cwd = strdup(server_cwd != NULL ? server_cwd : "/");
+        session->stdout_fd = -1;
+        session->stderr_fd = -1;
+        session->report_fd = -1;
+        session->state_fd = -1;
+        sessions[slot] = session;
+        event.events = EPOLLIN;
+        event.data.u64 = (unsigned long long)slot << 2 | EVENT_CLIENT;
+        epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, client, &event);
     }
-    free(words);
 }
 
-// Parse the first argument to see if it's exit, cd, history, or a unix program
-CommandType parse(char* command) {
-    if (strcmp("exit", command) == 0) {
-        return EXIT;
+// Reads whatever a client has sent. A client that's done sending has its session finish the lines it already sent
+void read_session_input(int slot) {
+    Session* session = sessions[slot];
+    size_t capacity;
+    ssize_t got;
+    char* grown;
+
+    if (session->input_capacity - session->input_length < 4096) {
+        capacity = session->input_capacity == 0 ? 8192 : session->input_capacity * 2;
+        grown = realloc(session->input, capacity);
+        if (grown == NULL) {
+            return;
+        }
+        session->input = grown;
+        session->input_capacity = capacity;
+    }
+    // Always leaving a byte spare, for the NUL after a last line without a newline
+    got = recv(session->socket, session->input + session->input_length,
+        session->input_capacity - session->input_length - 1, MSG_DONTWAIT);
+    if (got > 0) {
+        session->input_length += got;
     } else
-    if (strcmp("cd", command) == 0) {
-        return CD;
+    if (got == 0) {
+        session->input_is_closed = 1;
     } else
-    if (strcmp("history", command) == 0) {
-        return HISTORY;
-    } else {
-        return CONSOLE;
+    if (errno != EAGAIN && errno != EINTR) {
+        close_session(slot);
     }
 }
 
-// Error<BLANK>
-// Process one or multiple commands. Supports piping
-Error command(char** words, int word_count) {
-    int chunk_count;
-    char** chunk;
-    ShellCommand* commands;
-    Error run_result;
-    int offset_counter = 0, has_ended = 0;
-    int i;
-    int pipe_store[2], pipe_result;
-
-    // Get the amount of chunks that exist.
-    while (has_ended == 0) {
-        chunk = delimit_by_pipes(words, word_count, &offset_counter, &has_ended);
-        free(chunk);
-        chunk_count++;
-    }
-    
-    // Allocate space for the commands
-    commands = malloc(sizeof(ShellCommand) * chunk_count);
-    // Fill each command with the relevant chunk
-    for (i = 0, offset_counter = 0; i < chunk_count; i++) {
-        commands[i].command = delimit_by_pipes(words, word_count, &offset_counter, &has_ended);
-    }
-    // Setting up the pipes will be tricky. We should set up n - 1 pipes, and assign them properly.
-    // The great thing about looping this way is that, if we only have one command, we don't construct any pipes
-    for (i = 0; i < (chunk_count - 1); i++) {
-        pipe_result = pipe(pipe_store);
-        // Piping could go wrong. If it does, we can't actually recover, so we should return the error
-        if (pipe_result == -1) {
-            // We need to clean up then return the error
-            for (i = 0; i < chunk_count; i++) {
-                free(commands[i].command);
+// Passes along whatever a session's worker has written to its stdout or stderr, as one frame
+void forward_worker_output(int slot, ServerEvent kind) {
+    Session* session = sessions[slot];
+    int* fd = (kind == EVENT_STDOUT) ? &session->stdout_fd : &session->stderr_fd;
+    char* frame;
+    ssize_t got;
+
+    if (*fd == -1) {
+        return;
+    }
+    frame = reserve_output(session, 5 + SERVER_READ_CHUNK);
+    if (frame == NULL) {
+        return;
+    }
+    got = read(*fd, frame + 5, SERVER_READ_CHUNK);
+    if (got > 0) {
+        finish_frame(session, kind == EVENT_STDOUT ? 'o' : 'e', got);
+    } else
+    if (got == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+// Reaps every worker that has exited, and moves its session along
+void reap_workers() {
+    char drain[64];
+    pid_t pid;
+    int wait_status, slot;
+
+    while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {}
+    // Workers of sessions that were closed while they ran still get reaped here, they just don't belong to anyone
+    while ((pid = waitpid(-1, &wait_status, WNOHANG)) > 0) {
+        for (slot = 0; slot < session_slots; slot++) {
+            if (sessions[slot] != NULL && sessions[slot]->worker == pid) {
+                sessions[slot]->worker = 0;
+                sessions[slot]->worker_status = decode_wait_status(wait_status);
+                advance_session(slot);
+                break;
             }
-            free(commands);
-            return new_err(0, "Pipe failure in command function");
         }
-        // At this point, pipe_store[0] is a read, and pipe_store[1] is a write. We need to store them appropriately
-        commands[i].stdout = pipe_store[1];
-        commands[i + 1].stdin = pipe_store[0];
     }
-    // Now we need to call each command
-    for (i = 0; i < chunk_count; i++) {
-        int should_in = 0, should_out = 0;
-        if (i == 0) {
-            should_in = -1;
-        }
-        if (i == (chunk_count - 1)) {
-            should_out = -1;
-        }
-        run_result = run_and_wait(commands[i], should_in, should_out);
-        // Running could go wrong. If it does, we can't actually recover, so we should return the error
-        if (!run_result.is_ok) {
-            // We need to clean up then return the error
-            for (i = 0; i < chunk_count; i++) {
-                free(commands[i].command);
+}
+
+// Moves a session along after something happened to it. Once its worker has exited and all of the worker's output
+// has been read, the line's status is sent back and the session's directory becomes the worker's. Then the next line
+// is started, if the client has sent one. A session whose client is done (or ran exit) is closed once its output is sent
+void advance_session(int slot) {
+    Session* session = sessions[slot];
+    char report[PATH_MAX + 16], number[16];
+    char* line, *newline, *cwd;
+    size_t line_length;
+    ssize_t got;
+    Error worker_result;
+
+    if (session->report_fd != -1 && session->worker == 0 && session->stdout_fd == -1 && session->stderr_fd == -1) {
+        // The report is whether the shell should carry on, a space and the directory the line finished in
+        got = read(session->report_fd, report, sizeof(report) - 1);
+        close(session->report_fd);
+        session->report_fd = -1;
+        if (got > 2) {
+            report[got] = '\0';
+            session->is_exiting = (report[0] == '0');
+            cwd = strdup(report + 2);
+            if (cwd != NULL) {
+                free(session->cwd);
+                session->cwd = cwd;
             }
-            free(commands);
-            return run_result;
         }
+        read_session_state(session);
+        session->status = session->worker_status;
+        snprintf(number, sizeof(number), "%d", session->status);
+        queue_frame(session, 's', number, strlen(number));
     }
-    for (i = 0; i < chunk_count; i++) {
-        free(commands[i].command);
-    }
-    free(commands);
-    return new_ok(BLANK);
-}
-
-// Delimits an array of words by pipe characters, returning a single chunk at a time.
-// word_counter should begin at 0. has_ended outputs a value and thus anything can be passed in
-char** delimit_by_pipes(char** words, int word_count, int* offset_counter, int* has_ended) {
-    int chunk_size;
-    int offset;
-    int compare_result;
-    int hit_pipe = -1;
-    char** chunk;
-
-    // Loop through each word in words until we hit a pipe or the end of the words.
-    // We do this to count up how many words begin in each chunk
-    for (offset = *offset_counter; offset < word_count; offset++) {
-        int compare_result = strcmp(words[offset], "|");
-        if (compare_result == 0) {
-            // We have encountered a pipe
-            chunk_size = offset - *offset_counter;
-            hit_pipe = 0;
-            *has_ended = 0;
+    while (session->report_fd == -1 && !session->is_exiting) {
+        newline = memchr(session->input, '\n', session->input_length);
+        if (newline == NULL && !(session->input_is_closed && session->input_length > 0)) {
             break;
         }
-        // If we have not encountered a pipe, just continue searching for the next one
+        line = session->input;
+        line_length = newline != NULL ? (size_t)(newline - line) : session->input_length;
+        line[line_length] = '\0';
+        if (line_length > 0 && line[line_length - 1] == '\r') {
+            line[line_length - 1] = '\0';
+        }
+        if (line[strspn(line, " \t")] != '\0') {
+            worker_result = start_worker(slot, line);
+            if (!worker_result.is_ok) {
+                snprintf(report, sizeof(report), "sish: %s\n", worker_result.error_string);
+                queue_frame(session, 'e', report, strlen(report));
+                queue_frame(session, 's', "255", 3);
+            }
+        }
+        line_length += (newline != NULL);
+        memmove(session->input, session->input + line_length, session->input_length - line_length);
+        session->input_length -= line_length;
     }
-    if (hit_pipe == -1) {
-        // We have reached the end of the commands without hitting a pipe, therefore we need to simply return a chunk containing all words
-        // from offset_counter to end of the commands
-        chunk_size = word_count - *offset_counter;
-        *has_ended = -1;
+    if (flush_session(session) == -1) {
+        close_session(slot);
+        return;
     }
-    
-    // Create a new chunk and fill it with the relevant words
-    // Because this is a malloc call, it's the caller's responsibility to free the chunk after it's used
-    chunk = malloc(sizeof(char*) * (chunk_size + 1));
-    for (offset = 0; offset < chunk_size; offset++) {
-        chunk[offset] = words[offset + *offset_counter];
+    if (session->report_fd == -1 && session->output_length == 0
+        && (session->is_exiting || (session->input_is_closed && session->input_length == 0))) {
+        close_session(slot);
+        return;
     }
-    chunk[chunk_size] = NULL;
-
-    // Update the offset counter for the next iteration of this function
-    *offset_counter = *offset_counter + chunk_size + 1;
-    return chunk;
+    watch_session(slot);
 }
 
 // Error<BLANK>
-// Forks and runs a single unix program with pipes
-Error run_and_wait(ShellCommand shcmd, int should_in, int should_out) {
-    /*
-    The pipes for forked processes is handled by the command function, as it shouldn't be the individual
-    program's responsibility. This means we have to go off of should_in and should_out and open/close
-    the pipes accordingly. We can't do this in the command function, since the piping will only work correctly
-    once we have forked the unix process, hence why the responsibility for closing is offloaded here, but
-    the responsibility for what should be closed is handled by command
-    The general rule is:
-        If the program is the first one, do not close input (as it has no input pipe and would crash)
-        If the program is the last one, do not close output (same as above: no output pipe)
-    */
+// Forks a worker to run line for a session. The worker is the server as it was right before the fork, put in the
+// session's directory, with the session's history, $?, variables and settings, and with its stdout and stderr going
+// back to the server
+Error start_worker(int slot, char* line) {
+    Session* session = sessions[slot];
+    int stdout_pipe[2], stderr_pipe[2], report_pipe[2];
+    int should_continue = 1, null_fd, i;
+    char* cwd;
+    pid_t pid;
+    Error handle_input_result;
 
-    int child_exit_status;
-    int execvp_result;
-    // Fork the process. The child will execute the unix program
-    pid_t fork_result = fork();
-    if (fork_result == -1) {
-        return new_err(errno, "Fork failure");
+    if (pipe2(stdout_pipe, O_CLOEXEC) == -1) {
+        return new_err(errno, "Worker pipe failure");
     }
-    if (fork_result == 0) {
-        // We are the child process
-        // If we are the first command, do not override the input pipe
-        if (should_in == 0) {
-            dup2(shcmd.stdin, STDIN_FILENO);
-            close(shcmd.stdin);
+    if (pipe2(stderr_pipe, O_CLOEXEC) == -1) {
+        close(stdout_pipe[0]);
+        close(stdout_pipe[1]);
+        return new_err(errno, "Worker pipe failure");
+    }
+    if (pipe2(report_pipe, O_CLOEXEC) == -1) {
+        close(stdout_pipe[0]);
+        close(stdout_pipe[1]);
+        close(stderr_pipe[0]);
+        close(stderr_pipe[1]);
+        return new_err(errno, "Worker pipe failure");
+    }
+    history = &session->history;
+    add_history(line);
+    history = &shell_history;
+    last_exit_status = session->status;
+    // If there's no memory file, the session just keeps the state it had before this line
+    session->state_fd = memfd_create("session-state", MFD_CLOEXEC);
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0) {
+        // The worker gets a process group of its own, so everything it starts can be hung up on with it
+        setpgid(0, 0);
+        close(server_socket);
+        close(server_epoll_fd);
+        for (i = 0; i < session_slots; i++) {
+            if (sessions[i] == NULL) {
+                continue;
+            }
+            close(sessions[i]->socket);
+            if (sessions[i]->stdout_fd != -1) {
+                close(sessions[i]->stdout_fd);
+            }
+            if (sessions[i]->stderr_fd != -1) {
+                close(sessions[i]->stderr_fd);
+            }
+            if (sessions[i]->report_fd != -1) {
+                close(sessions[i]->report_fd);
+            }
+            if (sessions[i]->state_fd != -1 && i != slot) {
+                close(sessions[i]->state_fd);
+            }
         }
-        // If we are the last command, do not override the output pipe
-        if (should_out == 0) {
-            dup2(shcmd.stdout, STDOUT_FILENO);
-            close(shcmd.stdout);
+        close(stdout_pipe[0]);
+        close(stderr_pipe[0]);
+        close(report_pipe[0]);
+        dup2(stdout_pipe[1], STDOUT_FILENO);
+        dup2(stderr_pipe[1], STDERR_FILENO);
+        close(stdout_pipe[1]);
+        close(stderr_pipe[1]);
+        null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
         }
-        execvp_result = execvp(shcmd.command[0], shcmd.command);
-        if (execvp_result == -1) {
-            exit(-2);
+        // The SIGCHLD pipe is the server's, so the worker needs one of its own for the children it starts
+        close(sigchld_pipe[0]);
+        close(sigchld_pipe[1]);
+        pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK);
+        history = &session->history;
+        if (chdir(session->cwd) == -1) {
+            fprintf(stderr, "sish: cannot go to %s: %s\n", session->cwd, strerror(errno));
         }
-        exit(-2);
-    } else {
-        // We are the parent process
-        // If we are the first command, do not attempt to close the input pipe
-        if (should_in == 0) {
-            close(shcmd.stdin);
+        if (server_audit_path != NULL) {
+            init_audit_log(server_audit_path);
         }
-        // If we are the last command, do not attempt to close the output pipe
-        if (should_out == 0) {
-            close(shcmd.stdout);
+        if (session->state != NULL) {
+            restore_session_state(session->state, session->state_length);
         }
-        // Wait for the child to complete the process. Read the status: if it's not 0, there was an error
-        wait(&child_exit_status);
-        if (WIFEXITED(child_exit_status)) {
-            int es = WEXITSTATUS(child_exit_status);
-            if (es != 0) {
-                return new_err(es, "Child exit error");
-            }
+        handle_input_result = handle_input(line, &should_continue);
+        if (!handle_input_result.is_ok) {
+            printf("Error (%d): %s\n", handle_input_result.error_code, handle_input_result.error_string);
+            last_exit_status = 255;
+        }
+        fflush(stdout);
+        fflush(stderr);
+        cwd = getcwd(NULL, 0);
+        dprintf(report_pipe[1], "%d %s", should_continue, cwd != NULL ? cwd : session->cwd);
+        if (session->state_fd != -1) {
+            save_session_state(session->state_fd);
         }
+        stop_audit_log();
+        _exit(last_exit_status);
     }
-    return new_ok(BLANK);
-}
-
-// uses chdir() system call to execute cd command, if invalid it will return the error
-Error cd(char *dir) {
-    if (chdir(dir) == -1) {
-        return new_err(0, "Directory not found.");
+    close(stdout_pipe[1]);
+    close(stderr_pipe[1]);
+    close(report_pipe[1]);
+    if (pid == -1) {
+        close(stdout_pipe[0]);
+        close(stderr_pipe[0]);
+        close(report_pipe[0]);
+        if (session->state_fd != -1) {
+            close(session->state_fd);
+            session->state_fd = -1;
+        }
+        return new_err(errno, "Worker fork failure");
     }
+    // Only the server's ends are non-blocking. The worker's are its stdout and stderr, which programs expect to block
+    fcntl(stdout_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(stderr_pipe[0], F_SETFL, O_NONBLOCK);
+    session->worker = pid;
+    session->stdout_fd = stdout_pipe[0];
+    session->stderr_fd = stderr_pipe[0];
+    session->report_fd = report_pipe[0];
+    session->pipes_are_watched = 0;
     return new_ok(BLANK);
 }
 
-// appends commands to the array and increments the count
-// if the count exceeds the history size, it will remove oldest command
-void add_history(char* commandInput) {
+// Saves the shell state a worker's line left behind to fd, for the session's next worker (see restore_session_state):
+// every variable, then the settings of the builtins that change how lines run. Each is a NUL-terminated record
+// whose first character says what it is. Jobs, stats and the rest of what's kept in the worker go with it
+void save_session_state(int fd) {
+    FILE* out = fdopen(fd, "w");
     int i;
-    if (history_count >= MAX_HISTORY_SIZE) {
-        free(history[0]);  // free the oldest command
-        for (i = 1; i < MAX_HISTORY_SIZE; i++) {
-            history[i-1] = history[i];  // shift all commands to the left
+
+    if (out == NULL) {
+        return;
+    }
+    for (i = 0; i < shell_variables.capacity; i++) {
+        if (shell_variables.slots[i].entry != NULL) {
+            fprintf(out, "%c%s%c", shell_variables.slots[i].is_exported ? 'x' : '=', shell_variables.slots[i].entry, 0);
+        }
+    }
+    fprintf(out, "l%s%c", launcher_to_string(launcher), 0);
+    fprintf(out, "t%.17g%c", report_threshold, 0);
+    fprintf(out, "G%d %lld %lld %lld %lld %d%c", governor.max_running, governor.cpu_seconds, governor.address_space,
+        governor.open_files, governor.memory_max, governor.cpu_percent, 0);
+    if (governor.cgroup_base != NULL) {
+        fprintf(out, "B%s%c", governor.cgroup_base, 0);
+    }
+    fprintf(out, "P%d%c", placement.pipe_size, 0);
+    // The CPUs are saved the way placement -c takes them, so the next worker works them out the same way
+    if (placement.policy == AFFINITY_OFF) {
+        fprintf(out, "Coff%c", 0);
+    } else
+    if (placement.policy == AFFINITY_SPREAD) {
+        fprintf(out, "Cspread%c", 0);
+    } else
+    if (placement.policy == AFFINITY_NODE) {
+        fprintf(out, "Cnode%d%c", placement.node, 0);
+    } else {
+        fprintf(out, "C");
+        for (i = 0; i < placement.cpu_count; i++) {
+            fprintf(out, i == 0 ? "%d" : ",%d", placement.cpus[i]);
         }
-    history_count--;
+        fprintf(out, "%c", 0);
     }
-    history[history_count++] = strdup(commandInput);  // append the new command
+    fclose(out);
 }
 
-// displays the history
-void display_history() {
-    int i;
-    for (i = 0; i < history_count; i++) {
-        printf("(%d): %s", i, history[i]);
+// Puts back the shell state a session's last worker saved (see save_session_state), in the worker about to run the
+// session's next line. Until then the worker has the server's, which is what every session starts out with
+void restore_session_state(char* state, size_t length) {
+    Variable* slots, *variable;
+    char* record;
+    size_t name;
+
+    if (length == 0 || state[length - 1] != '\0') {
+        return;
+    }
+    slots = calloc(VARIABLE_TABLE_START, sizeof(Variable));
+    if (slots == NULL) {
+        return;
+    }
+    // The server's variables are dropped rather than freed. The worker is a copy of the server, and only runs one line
+    shell_variables.slots = slots;
+    shell_variables.capacity = VARIABLE_TABLE_START;
+    shell_variables.used = 0;
+    shell_variables.count = 0;
+    shell_variables.environment = NULL;
+    shell_variables.environment_is_stale = 1;
+    for (record = state; record < state + length; record += strlen(record) + 1) {
+        if (record[0] == 'x' || record[0] == '=') {
+            name = name_length(record + 1);
+            variable = set_variable(record + 1, name, record + 1 + name + 1);
+            if (variable != NULL) {
+                variable->is_exported = (record[0] == 'x');
+            }
+        } else
+        if (record[0] == 'l') {
+            set_launcher(record + 1);
+        } else
+        if (record[0] == 't') {
+            report_threshold = atof(record + 1);
+        } else
+        if (record[0] == 'G') {
+            sscanf(record + 1, "%d %lld %lld %lld %lld %d", &governor.max_running, &governor.cpu_seconds,
+                &governor.address_space, &governor.open_files, &governor.memory_max, &governor.cpu_percent);
+        } else
+        if (record[0] == 'B') {
+            free(governor.cgroup_base);
+            governor.cgroup_base = strdup(record + 1);
+        } else
+        if (record[0] == 'P') {
+            placement.pipe_size = atoi(record + 1);
+        } else
+        if (record[0] == 'C') {
+            set_cpu_policy(record + 1);
+        }
+    }
+}
+
+// Takes the state a session's worker saved once it's exited. A worker that didn't get as far as saving any
+// (because it was killed, say) leaves the session with the state it had before
+void read_session_state(Session* session) {
+    struct stat info;
+    char* state;
+
+    if (session->state_fd == -1) {
+        return;
+    }
+    if (fstat(session->state_fd, &info) == 0 && info.st_size > 0) {
+        state = malloc(info.st_size);
+        if (state != NULL && pread(session->state_fd, state, info.st_size, 0) == info.st_size) {
+            free(session->state);
+            session->state = state;
+            session->state_length = info.st_size;
+        } else {
+            free(state);
+        }
+    }
+    close(session->state_fd);
+    session->state_fd = -1;
+}
+
+// Tells epoll what a session is waiting for: more lines while it doesn't have too many waiting, room to send while it has
+// output waiting, and its worker's output while there isn't too much of that waiting already
+void watch_session(int slot) {
+    Session* session = sessions[slot];
+    struct epoll_event event;
+    int should_watch_pipes = session->output_length < SERVER_OUTPUT_LIMIT;
+    int* fds[2] = {&session->stdout_fd, &session->stderr_fd};
+    int i;
+
+    // A line longer than the limit still has to be read in full before it can run
+    event.events = 0;
+    if (!session->input_is_closed && (session->input_length < SERVER_INPUT_LIMIT
+        || memchr(session->input, '\n', session->input_length) == NULL)) {
+        event.events |= EPOLLIN;
+    }
+    if (session->output_length > 0) {
+        event.events |= EPOLLOUT;
+    }
+    event.data.u64 = (unsigned long long)slot << 2 | EVENT_CLIENT;
+    epoll_ctl(server_epoll_fd, EPOLL_CTL_MOD, session->socket, &event);
+    if (should_watch_pipes == session->pipes_are_watched) {
+        return;
+    }
+    // Pipes are taken out of epoll rather than just ignored, since one whose worker has exited would report EPOLLHUP forever
+    for (i = 0; i < 2; i++) {
+        if (*fds[i] == -1) {
+            continue;
+        }
+        event.events = EPOLLIN;
+        event.data.u64 = (unsigned long long)slot << 2 | (i == 0 ? EVENT_STDOUT : EVENT_STDERR);
+        epoll_ctl(server_epoll_fd, should_watch_pipes ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, *fds[i], &event);
+    }
+    session->pipes_are_watched = should_watch_pipes;
+}
+
+// Sends as much of a session's output as the client will take without blocking.
+// Returns -1 if the client has gone away
+int flush_session(Session* session) {
+    ssize_t sent;
+
+    while (session->output_length > 0) {
+        sent = send(session->socket, session->output + session->output_start, session->output_length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent == -1) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        session->output_start += sent;
+        session->output_length -= sent;
+    }
+    session->output_start = 0;
+    return 0;
+}
+
+// Makes room for size more bytes at the end of a session's output, and returns where they go (or NULL if there's no memory)
+char* reserve_output(Session* session, size_t size) {
+    size_t capacity = session->output_capacity;
+    char* grown;
+
+    if (session->output_start > 0 && session->output_start + session->output_length + size > capacity) {
+        memmove(session->output, session->output + session->output_start, session->output_length);
+        session->output_start = 0;
+    }
+    while (session->output_length + size > capacity) {
+        capacity = capacity == 0 ? SERVER_READ_CHUNK * 2 : capacity * 2;
+    }
+    if (capacity != session->output_capacity) {
+        grown = realloc(session->output, capacity);
+        if (grown == NULL) {
+            return NULL;
+        }
+        session->output = grown;
+        session->output_capacity = capacity;
+    }
+    return session->output + session->output_start + session->output_length;
+}
+
+// Turns the length bytes after the room reserve_output made for a frame's header into a frame of type
+void finish_frame(Session* session, char type, size_t length) {
+    unsigned char* header = (unsigned char*)session->output + session->output_start + session->output_length;
+    header[0] = type;
+    header[1] = length >> 24;
+    header[2] = length >> 16;
+    header[3] = length >> 8;
+    header[4] = length;
+    session->output_length += 5 + length;
+}
+
+// Adds a frame to a session's output. Returns 0 if there was no memory for it
+int queue_frame(Session* session, char type, char* data, size_t length) {
+    char* frame = reserve_output(session, 5 + length);
+    if (frame == NULL) {
+        return 0;
+    }
+    memcpy(frame + 5, data, length);
+    finish_frame(session, type, length);
+    return 1;
+}
+
+// Ends a session. If it still has a line running, the line's whole process group is hung up on
+void close_session(int slot) {
+    Session* session = sessions[slot];
+
+    if (session->worker != 0) {
+        kill(-session->worker, SIGHUP);
+    }
+    close(session->socket);
+    if (session->stdout_fd != -1) {
+        close(session->stdout_fd);
+    }
+    if (session->stderr_fd != -1) {
+        close(session->stderr_fd);
+    }
+    if (session->report_fd != -1) {
+        close(session->report_fd);
+    }
+    if (session->state_fd != -1) {
+        close(session->state_fd);
+    }
+    free(session->state);
+    free_history(&session->history);
+    free(session->input);
+    free(session->output);
+    free(session->cwd);
+    free(session);
+    sessions[slot] = NULL;
+}
+
+// Runs commands on the sish server at socket_path (see run_server) and returns the status of the last line it ran.
+// The commands are text if it isn't NULL, and otherwise whatever comes in on stdin, passed along as it arrives.
+// What they write comes out on this process's stdout and stderr as the server sends it back
+int connect_server(char* socket_path, char* text) {
+    struct sockaddr_un address;
+    struct pollfd fds[2];
+    char* frames, chunk[SERVER_READ_CHUNK], number[16];
+    size_t length = 0, capacity = 2 * SERVER_READ_CHUNK, frame_length;
+    ssize_t got;
+    int client, status = 0, is_sending = 1;
+    unsigned char* header;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "sish: socket path is too long\n");
+        return 2;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    client = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client == -1 || connect(client, (struct sockaddr*)&address, sizeof(address)) == -1) {
+        fprintf(stderr, "sish: cannot connect to %s: %s\n", socket_path, strerror(errno));
+        return 2;
+    }
+    frames = malloc(capacity);
+    if (frames == NULL) {
+        return 2;
+    }
+    if (text != NULL) {
+        write_all(client, text, strlen(text));
+        write_all(client, "\n", 1);
+        shutdown(client, SHUT_WR);
+        is_sending = 0;
+    }
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = client;
+    fds[1].events = POLLIN;
+    while (1) {
+        // poll skips negative fds, which is how stdin stops being read
+        fds[0].fd = is_sending ? STDIN_FILENO : -1;
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (is_sending && (fds[0].revents & (POLLIN | POLLHUP))) {
+            got = read(STDIN_FILENO, chunk, sizeof(chunk));
+            if (got > 0) {
+                write_all(client, chunk, got);
+            } else {
+                shutdown(client, SHUT_WR);
+                is_sending = 0;
+            }
+        }
+        if (!(fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        if (capacity - length < SERVER_READ_CHUNK) {
+            capacity *= 2;
+            header = realloc(frames, capacity);
+            if (header == NULL) {
+                break;
+            }
+            frames = (char*)header;
+        }
+        got = read(client, frames + length, capacity - length);
+        if (got <= 0) {
+            break;
+        }
+        length += got;
+        // Hand out every whole frame, and keep whatever's left of a frame that's still coming
+        while (length >= 5) {
+            header = (unsigned char*)frames;
+            frame_length = ((size_t)header[1] << 24) | ((size_t)header[2] << 16) | ((size_t)header[3] << 8) | header[4];
+            if (length < 5 + frame_length) {
+                break;
+            }
+            if (header[0] == 'o') {
+                write_all(STDOUT_FILENO, frames + 5, frame_length);
+            } else
+            if (header[0] == 'e') {
+                write_all(STDERR_FILENO, frames + 5, frame_length);
+            } else
+            if (header[0] == 's') {
+                got = frame_length < sizeof(number) ? frame_length : sizeof(number) - 1;
+                memcpy(number, frames + 5, got);
+                number[got] = '\0';
+                status = atoi(number);
+            }
+            memmove(frames, frames + 5 + frame_length, length - 5 - frame_length);
+            length -= 5 + frame_length;
+        }
+    }
+    free(frames);
+    close(client);
+    return status;
+}
+
+// Works like getline, but lets the user edit the line as it's typed: moving around it, recalling history with the
+// up and down arrows and completing command and file names with Tab. It prints the prompt itself.
+// The terminal is only in raw mode while a line is being typed, so whatever runs the line gets the terminal as usual.
+// Returns the length of the line (including its newline, like getline), or -1 once there's nothing left to read.
+// If the terminal can't be put in raw mode, this is just the prompt and a getline
+ssize_t edit_line(char* prompt, char** line, size_t* line_size) {
+    LineEditor editor;
+    struct termios original, raw;
+    unsigned char c, sequence[3];
+    size_t word_end;
+    ssize_t line_length = -2;
+
+    fflush(stdout);
+    if (tcgetattr(STDIN_FILENO, &original) == -1) {
+        printf("%s", prompt);
+        return getline(line, line_size, stdin);
+    }
+    // Keys arrive one at a time and aren't echoed. ^C and ^Z come through as keys too, instead of signals
+    raw = original;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(TERMINAL_ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) == -1) {
+        printf("%s", prompt);
+        return getline(line, line_size, stdin);
+    }
+    editor.prompt = prompt;
+    editor.buffer = *line;
+    editor.capacity = *line_size;
+    editor.length = 0;
+    editor.cursor = 0;
+    editor.offset = 0;
+    editor.history_index = history_length();
+    editor.typed = NULL;
+    if (editor.capacity < 128) {
+        editor.buffer = realloc(editor.buffer, 128);
+        editor.capacity = editor.buffer == NULL ? 0 : 128;
+    }
+    if (editor.buffer == NULL) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &original);
+        *line = NULL;
+        *line_size = 0;
+        return -1;
+    }
+    editor.buffer[0] = '\0';
+    refresh_line(&editor);
+
+    // -2 means the line isn't finished yet
+    while (line_length == -2) {
+        if (read(STDIN_FILENO, &c, 1) != 1) {
+            // The terminal went away. Whatever was typed so far is still a line, like getline would see it
+            line_length = editor.length > 0 ? (ssize_t)editor.length : -1;
+            break;
+        }
+        if (c == '\r' || c == '\n') {
+            editor.cursor = editor.length;
+            refresh_line(&editor);
+            write_all(STDOUT_FILENO, "\n", 1);
+            if (insert_text(&editor, "\n", 1)) {
+                line_length = editor.length;
+            }
+        } else
+        if (c == 3) {
+            // ^C throws the line away and starts a new one
+            write_all(STDOUT_FILENO, "^C\n", 3);
+            delete_text(&editor, 0, editor.length);
+            editor.history_index = history_length();
+            refresh_line(&editor);
+        } else
+        if (c == 4) {
+            // ^D on an empty line is the end of input, otherwise it deletes the character under the cursor
+            if (editor.length == 0) {
+                write_all(STDOUT_FILENO, "\n", 1);
+                line_length = -1;
+            } else {
+                delete_text(&editor, editor.cursor, next_character(&editor, editor.cursor));
+            }
+        } else
+        if (c == 127 || c == 8) {
+            delete_text(&editor, previous_character(&editor, editor.cursor), editor.cursor);
+        } else
+        if (c == '\t') {
+            complete_word(&editor);
+        } else
+        if (c == 1) {
+            editor.cursor = 0;
+        } else
+        if (c == 5) {
+            editor.cursor = editor.length;
+        } else
+        if (c == 2) {
+            editor.cursor = previous_character(&editor, editor.cursor);
+        } else
+        if (c == 6) {
+            editor.cursor = next_character(&editor, editor.cursor);
+        } else
+        if (c == 11) {
+            delete_text(&editor, editor.cursor, editor.length);
+        } else
+        if (c == 21) {
+            delete_text(&editor, 0, editor.cursor);
+        } else
+        if (c == 23) {
+            // ^W deletes the word before the cursor, along with the blanks after it
+            word_end = editor.cursor;
+            while (editor.cursor > 0 && editor.buffer[editor.cursor - 1] == ' ') {
+                editor.cursor--;
+            }
+            while (editor.cursor > 0 && editor.buffer[editor.cursor - 1] != ' ') {
+                editor.cursor--;
+            }
+            delete_text(&editor, editor.cursor, word_end);
+        } else
+        if (c == 12) {
+            write_all(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+        } else
+        if (c == 16) {
+            browse_history(&editor, -1);
+        } else
+        if (c == 14) {
+            browse_history(&editor, 1);
+        } else
+        if (c == 27) {
+            // Arrow keys and friends are escape sequences: ESC [ A, ESC [ 3 ~, ESC O H and so on
+            if (read(STDIN_FILENO, sequence, 1) != 1 || read(STDIN_FILENO, sequence + 1, 1) != 1) {
+                continue;
+            }
+            if (sequence[0] == '[' && sequence[1] >= '0' && sequence[1] <= '9') {
+                if (read(STDIN_FILENO, sequence + 2, 1) != 1 || sequence[2] != '~') {
+                    continue;
+                }
+                if (sequence[1] == '3') {
+                    delete_text(&editor, editor.cursor, next_character(&editor, editor.cursor));
+                } else
+                if (sequence[1] == '1' || sequence[1] == '7') {
+                    editor.cursor = 0;
+                } else
+                if (sequence[1] == '4' || sequence[1] == '8') {
+                    editor.cursor = editor.length;
+                }
+            } else
+            if (sequence[0] == '[' || sequence[0] == 'O') {
+                if (sequence[1] == 'A') {
+                    browse_history(&editor, -1);
+                } else
+                if (sequence[1] == 'B') {
+                    browse_history(&editor, 1);
+                } else
+                if (sequence[1] == 'C') {
+                    editor.cursor = next_character(&editor, editor.cursor);
+                } else
+                if (sequence[1] == 'D') {
+                    editor.cursor = previous_character(&editor, editor.cursor);
+                } else
+                if (sequence[1] == 'H') {
+                    editor.cursor = 0;
+                } else
+                if (sequence[1] == 'F') {
+                    editor.cursor = editor.length;
+                }
+            }
+        } else
+        if (c >= 32) {
+            if (!insert_text(&editor, (char*)&c, 1)) {
+                write_all(STDOUT_FILENO, "\a", 1);
+            }
+        }
+        if (line_length == -2) {
+            refresh_line(&editor);
+        }
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &original);
+    free(editor.typed);
+    *line = editor.buffer;
+    *line_size = editor.capacity;
+    return line_length;
+}
+
+// Redraws the prompt and as much of the line as fits on the terminal, and puts the cursor back where it belongs.
+// A line wider than the terminal scrolls sideways to keep the cursor in view. Everything goes out in one write
+void refresh_line(LineEditor* editor) {
+    static char* output = NULL;
+    static size_t output_capacity = 0;
+    size_t output_length = 0, prompt_width = strlen(editor->prompt), visible, columns_used, end, i;
+    struct winsize window;
+    char move[32];
+
+    // Columns are counted in characters rather than bytes, so UTF-8 text lines up
+    visible = 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_col > 0) {
+        visible = window.ws_col;
+    }
+    visible = visible > prompt_width + 1 ? visible - prompt_width - 1 : 1;
+    if (editor->cursor < editor->offset) {
+        editor->offset = editor->cursor;
+    }
+    for (columns_used = 0, i = editor->offset; i < editor->cursor; i = next_character(editor, i)) {
+        columns_used++;
+    }
+    while (columns_used > visible) {
+        editor->offset = next_character(editor, editor->offset);
+        columns_used--;
+    }
+    for (end = editor->cursor, i = columns_used; end < editor->length && i < visible; end = next_character(editor, end)) {
+        i++;
+    }
+
+    if (output == NULL) {
+        output_capacity = 256;
+        output = malloc(output_capacity);
+    }
+    append_text(&output, &output_length, &output_capacity, "\r", 1);
+    append_text(&output, &output_length, &output_capacity, editor->prompt, prompt_width);
+    append_text(&output, &output_length, &output_capacity, editor->buffer + editor->offset, end - editor->offset);
+    append_text(&output, &output_length, &output_capacity, "\x1b[K\r", 4);
+    if (prompt_width + columns_used > 0) {
+        snprintf(move, sizeof(move), "\x1b[%zuC", prompt_width + columns_used);
+        append_text(&output, &output_length, &output_capacity, move, strlen(move));
+    }
+    if (output != NULL) {
+        write_all(STDOUT_FILENO, output, output_length);
+    }
+}
+
+// Inserts text at the cursor, and moves the cursor past it. Returns 0 if there was no memory for it
+int insert_text(LineEditor* editor, char* text, size_t length) {
+    char* grown;
+    size_t capacity = editor->capacity;
+
+    while (editor->length + length + 1 > capacity) {
+        capacity *= 2;
+    }
+    if (capacity != editor->capacity) {
+        grown = realloc(editor->buffer, capacity);
+        if (grown == NULL) {
+            return 0;
+        }
+        editor->buffer = grown;
+        editor->capacity = capacity;
+    }
+    memmove(editor->buffer + editor->cursor + length, editor->buffer + editor->cursor, editor->length - editor->cursor + 1);
+    memcpy(editor->buffer + editor->cursor, text, length);
+    editor->length += length;
+    editor->cursor += length;
+    return 1;
+}
+
+// Deletes the bytes from from up to (not including) to, and keeps the cursor on the same text if it was after them
+void delete_text(LineEditor* editor, size_t from, size_t to) {
+    if (to <= from) {
+        return;
+    }
+    memmove(editor->buffer + from, editor->buffer + to, editor->length - to + 1);
+    editor->length -= to - from;
+    if (editor->cursor >= to) {
+        editor->cursor -= to - from;
+    } else
+    if (editor->cursor > from) {
+        editor->cursor = from;
+    }
+}
+
+// Returns where the character before position starts, stepping over all of a UTF-8 character at once
+size_t previous_character(LineEditor* editor, size_t position) {
+    if (position == 0) {
+        return 0;
+    }
+    for (position--; position > 0 && (editor->buffer[position] & 0xC0) == 0x80; position--) {
+        // Continuation bytes are the middle of a character
+    }
+    return position;
+}
+
+// Returns where the character after the one at position starts
+size_t next_character(LineEditor* editor, size_t position) {
+    if (position >= editor->length) {
+        return editor->length;
+    }
+    for (position++; position < editor->length && (editor->buffer[position] & 0xC0) == 0x80; position++) {
+        // Continuation bytes are the middle of a character
+    }
+    return position;
+}
+
+// Replaces the line with the history entry direction steps away (-1 is older). Stepping past the newest entry
+// brings back whatever was being typed before the history was browsed
+void browse_history(LineEditor* editor, int direction) {
+    int target = editor->history_index + direction;
+    char* entry;
+
+    if (target < 0 || target > history_length()) {
+        return;
+    }
+    if (editor->history_index == history_length()) {
+        free(editor->typed);
+        editor->typed = strdup(editor->buffer);
+    }
+    editor->history_index = target;
+    entry = target == history_length() ? editor->typed : history_entry(target);
+    delete_text(editor, 0, editor->length);
+    if (entry != NULL) {
+        insert_text(editor, entry, strlen(entry));
+    }
+}
+
+// Completes the word before the cursor. A word where a command name goes is completed from the builtins and the
+// programs on PATH, and anything else (or anything with a slash in it) from file names. A word with only one
+// completion is finished off, with a space after it (or a slash, for a directory). Otherwise it's filled in as far as
+// all its completions agree, and if that doesn't get it any further, they're all listed
+void complete_word(LineEditor* editor) {
+    NameList completions = {NULL, 0, 0};
+    size_t start = 0, i, common, word_length = 0;
+    int in_single = 0, in_double = 0, words_in_stage = 0, after_redirect = 0;
+    char* word, *match, *p;
+    char c;
+
+    // Find where the word starts by splitting the line the same way lex_line does, and whether it's a command name
+    for (i = 0; i < editor->cursor; i++) {
+        c = editor->buffer[i];
+        if (in_single) {
+            in_single = (c != '\'');
+        } else
+        if (in_double) {
+            if (c == '\\' && i + 1 < editor->cursor) {
+                i++;
+            } else {
+                in_double = (c != '"');
+            }
+        } else
+        if (c == '\\') {
+            i++;
+        } else
+        if (c == '\'') {
+            in_single = 1;
+        } else
+        if (c == '"') {
+            in_double = 1;
+        } else
+        if (c == ' ' || c == '\t' || c == '|' || c == '&' || c == ';' || c == '<' || c == '>') {
+            if (i > start) {
+                words_in_stage++;
+                after_redirect = 0;
+            }
+            if (c == '|' || c == '&' || c == ';') {
+                words_in_stage = 0;
+            }
+            if (c == '<' || c == '>') {
+                after_redirect = 1;
+            }
+            start = i + 1;
+        }
+    }
+    // The word as the lexer would see it, without its quotes and backslashes
+    word = malloc(editor->cursor - start + 1);
+    if (word == NULL) {
+        return;
+    }
+    in_single = 0;
+    in_double = 0;
+    for (i = start; i < editor->cursor; i++) {
+        c = editor->buffer[i];
+        if (!in_single && c == '\\' && i + 1 < editor->cursor) {
+            word[word_length++] = editor->buffer[++i];
+        } else
+        if (!in_double && c == '\'') {
+            in_single = !in_single;
+        } else
+        if (!in_single && c == '"') {
+            in_double = !in_double;
+        } else {
+            word[word_length++] = c;
+        }
+    }
+    word[word_length] = '\0';
+
+    if (words_in_stage == 0 && !after_redirect && strchr(word, '/') == NULL) {
+        complete_commands(word, &completions);
+    } else {
+        complete_files(word, &completions);
+    }
+    if (completions.count == 0) {
+        write_all(STDOUT_FILENO, "\a", 1);
+        free(word);
+        return;
+    }
+    // Every match starts with the word, so whatever they all share past that can be filled in
+    match = completions.matches[0];
+    common = strlen(match);
+    for (i = 1; i < (size_t)completions.count; i++) {
+        for (p = completions.matches[i]; (size_t)(p - completions.matches[i]) < common && *p == match[p - completions.matches[i]]; p++) {
+            // Still the same
+        }
+        common = p - completions.matches[i];
+    }
+    if (completions.count > 1 && common == word_length) {
+        list_completions(&completions);
+    } else {
+        // The word is put back backslash-escaped, whatever quoting it had before
+        delete_text(editor, start, editor->cursor);
+        for (i = 0; i < common; i++) {
+            if (strchr(" \t\\'\"|&<>;$`*?[]#()~", match[i]) != NULL) {
+                insert_text(editor, "\\", 1);
+            }
+            insert_text(editor, match + i, 1);
+        }
+        if (completions.count == 1 && common > 0 && match[common - 1] != '/') {
+            insert_text(editor, " ", 1);
+        }
+    }
+    free(word);
+    free_names(&completions);
+}
+
+// Lists a word's completions below the line, in columns, and then draws the line again underneath.
+// Files are listed without the directory they're all in. There's no point printing hundreds of completions,
+// so past COMPLETION_LIST_LIMIT only the count is shown
+void list_completions(NameList* completions) {
+    struct winsize window;
+    int i, width = 0, columns, terminal_width = 80;
+    size_t skip = 0;
+    char* last_slash;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_col > 0) {
+        terminal_width = window.ws_col;
+    }
+    printf("\n");
+    if (completions->count > COMPLETION_LIST_LIMIT) {
+        printf("%d possibilities, type more to narrow them down\n", completions->count);
+    } else {
+        // Every match is in the same directory, so the first one says how much of them that is.
+        // A slash on the very end only marks a directory, and doesn't count
+        last_slash = NULL;
+        if (completions->matches[0][0] != '\0') {
+            last_slash = memrchr(completions->matches[0], '/', strlen(completions->matches[0]) - 1);
+        }
+        if (last_slash != NULL) {
+            skip = last_slash - completions->matches[0] + 1;
+        }
+        for (i = 0; i < completions->count; i++) {
+            if ((int)(strlen(completions->matches[i]) - skip) + 2 > width) {
+                width = strlen(completions->matches[i]) - skip + 2;
+            }
+        }
+        columns = terminal_width / width > 0 ? terminal_width / width : 1;
+        for (i = 0; i < completions->count; i++) {
+            printf("%-*s", width, completions->matches[i] + skip);
+            if (i % columns == columns - 1 || i == completions->count - 1) {
+                printf("\n");
+            }
+        }
+    }
+    fflush(stdout);
+}
+
+// Finds every builtin and program on PATH whose name starts with prefix
+void complete_commands(char* prefix, NameList* completions) {
+    char name[NAME_MAX + 1];
+    size_t prefix_length = strlen(prefix);
+    CommandTrieNode* node;
+    int i, kept;
+
+    // Builtins without a name (like the one assignments run as) can't be typed, so they're never completions
+    for (i = 1; i < COMMAND_TYPE_COUNT; i++) {
+        if (builtins[i].name[0] != '\0' && strncmp(builtins[i].name, prefix, prefix_length) == 0) {
+            add_name(completions, builtins[i].name);
+        }
+    }
+    update_command_index();
+    if (prefix_length == 0) {
+        collect_commands(command_index.root, name, 0, completions);
+    } else
+    if (prefix_length < sizeof(name) - 1) {
+        node = find_trie_node(&command_index.root, prefix, 0);
+        if (node != NULL) {
+            strcpy(name, prefix);
+            if (node->directories != 0) {
+                add_name(completions, name);
+            }
+            collect_commands(node->child, name, prefix_length, completions);
+        }
+    }
+    // Builtins like echo are often on PATH too, and so are programs found in more than one directory of it
+    qsort(completions->matches, completions->count, sizeof(char*), compare_strings);
+    for (kept = 0, i = 0; i < completions->count; i++) {
+        if (kept > 0 && strcmp(completions->matches[kept - 1], completions->matches[i]) == 0) {
+            free(completions->matches[i]);
+        } else {
+            completions->matches[kept++] = completions->matches[i];
+        }
+    }
+    completions->count = kept;
+}
+
+// Finds every file whose path starts with word. Directories get a slash on the end, and hidden files
+// only turn up if what's being completed starts with a dot
+void complete_files(char* word, NameList* completions) {
+    char* last_slash = strrchr(word, '/'), *prefix, *directory, *match;
+    size_t directory_length, prefix_length, name_length;
+    DIR* dir;
+    struct dirent* entry;
+    struct stat file_info;
+    int is_directory;
+
+    if (last_slash == NULL) {
+        directory = strdup(".");
+        prefix = word;
+        directory_length = 0;
+    } else {
+        directory_length = last_slash - word + 1;
+        directory = last_slash == word ? strdup("/") : strndup(word, last_slash - word);
+        prefix = last_slash + 1;
+    }
+    if (directory == NULL) {
+        return;
+    }
+    prefix_length = strlen(prefix);
+    dir = opendir(directory);
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, prefix_length) != 0 || strcmp(entry->d_name, ".") == 0
+            || strcmp(entry->d_name, "..") == 0 || (entry->d_name[0] == '.' && prefix[0] != '.')) {
+            continue;
+        }
+        // Symlinks (and file systems that don't fill in d_type) need a stat to tell if they lead to a directory
+        is_directory = entry->d_type == DT_DIR;
+        if ((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+            && fstatat(dirfd(dir), entry->d_name, &file_info, 0) == 0) {
+            is_directory = S_ISDIR(file_info.st_mode);
+        }
+        name_length = strlen(entry->d_name);
+        match = malloc(directory_length + name_length + 2);
+        if (match == NULL) {
+            continue;
+        }
+        memcpy(match, word, directory_length);
+        strcpy(match + directory_length, entry->d_name);
+        if (is_directory) {
+            strcat(match, "/");
+        }
+        add_name(completions, match);
+        free(match);
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    free(directory);
+    qsort(completions->matches, completions->count, sizeof(char*), compare_strings);
+}
+
+// Adds a copy of name to a list
+void add_name(NameList* list, char* name) {
+    char** grown;
+    char* copy = strdup(name);
+
+    if (copy == NULL) {
+        return;
+    }
+    if (list->count == list->capacity) {
+        grown = realloc(list->matches, sizeof(char*) * (list->capacity == 0 ? 16 : list->capacity * 2));
+        if (grown == NULL) {
+            free(copy);
+            return;
+        }
+        list->matches = grown;
+        list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+    }
+    list->matches[list->count++] = copy;
+}
+
+// Frees a list of names and everything in it
+void free_names(NameList* list) {
+    int i;
+    for (i = 0; i < list->count; i++) {
+        free(list->matches[i]);
+    }
+    free(list->matches);
+}
+
+// For qsort'ing arrays of strings
+int compare_strings(const void* a, const void* b) {
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+// Error<BLANK>
+// Runs one line, which is lexed once however many pipelines its list has.
+// A line can be run in the middle of another (history replays one), so the outer line's line_work_ns is put back after
+Error handle_input(char* input_str, int* should_continue) {
+    Error line_result;
+    Error command_result = new_ok(BLANK);
+    ParsedLine* line;
+    Pipeline* pipeline;
+    long long started = now_ns(), lexed, total, outer_work_ns = line_work_ns;
+    int i;
+
+    line_work_ns = 0;
+    // Convert the string to individual words, unless the same line was run recently and its words are still around
+    line_result = find_parsed_line(input_str);
+    lexed = now_ns();
+    record_latency(PHASE_LEX, lexed - started);
+    // Confirm that the line is "ok". A line that doesn't lex (an unclosed quote, say) is the user's mistake, not ours
+    if (!line_result.is_ok) {
+        line_work_ns = outer_work_ns;
+        if (line_result.error_code == 1) {
+            printf("%s\n", line_result.error_string);
+            // Same status other shells give a syntax error, so -c scripts and && notice it
+            last_exit_status = 2;
+            return new_ok(BLANK);
+        }
+        return line_result;
+    }
+    line = *(ParsedLine**)line_result.value_ptr;
+    // If no text has been entered, don't execute the rest of the code. Simply continue to the next loop.
+    // (A line of nothing but redirects still has a command to run, see lex_line)
+    if (line->pipeline_count == 0) {
+        release_parsed_line(line);
+        line_work_ns = outer_work_ns;
+        return new_ok(BLANK);
+    }
+    // Run each pipeline of the list in turn and handle the relevant error. Builtins are run by command too.
+    // && and || skip a pipeline depending on the status of the last one that ran, which a skipped one leaves alone
+    for (i = 0; i < line->pipeline_count && *should_continue; i++) {
+        pipeline = &line->pipelines[i];
+        if ((pipeline->run_if == LIST_AND && last_exit_status != 0) || (pipeline->run_if == LIST_OR && last_exit_status == 0)) {
+            continue;
+        }
+        last_job_interrupted = 0;
+        command_result = command(pipeline, should_continue);
+        if (!command_result.is_ok) {
+            break;
+        }
+        // A failing program is recoverable, so we only need to tell the user about the special cases
+        if (*(int*)command_result.value_ptr == 255) {
+            printf("Something went wrong with the child process. Please try again.\n");
+        } else
+        if (*(int*)command_result.value_ptr == 254) {
+            printf("Command not found. Please try again.\n");
+        }
+        // ^C stops the whole list, not just the pipeline it reached. A program that exits with 130 by itself doesn't
+        if (job_control && !pipeline->is_background && last_job_interrupted) {
+            break;
+        }
+    }
+    release_parsed_line(line);
+    total = now_ns() - started;
+    record_latency(PHASE_TOTAL, total);
+    record_latency(PHASE_OVERHEAD, total - line_work_ns);
+    line_work_ns = outer_work_ns;
+    // We cannot guarantee that the shell can keep going
+    return command_result.is_ok ? new_ok(BLANK) : command_result;
+}
+
+// Error<ParsedLine*>
+// Lexes a command line in a single pass, straight into one arena sized for the worst case, so a line costs one allocation.
+// Words are split on unquoted blanks, and unquoted pipes split the line into commands (with or without spaces around them).
+// Inside single quotes everything is literal. Inside double quotes a backslash only escapes " \\ $ and `.
+// Elsewhere a backslash makes the next character literal. Unquoted ;, &, && and || split the line into a list of pipelines,
+// and a & after a pipeline runs it in the background.
+// The input string is never modified.
+// Fails with error code 1 for lines the user needs to fix, and 0 if memory ran out
+Error lex_line(char* input_str) {
+    static ParsedLine* line;
+    Arena arena;
+    size_t length, token_bound = 0, separator_count = 0;
+    int after_blank = 1;
+    char* p, *close_quote, *out;
+    char c;
+    int slot = 0, stage_start = 0, in_word = 0, reads_nothing;
+    char* syntax_error = NULL;
+    static char syntax_message[64];
+    // The pipeline being lexed: its first command, where its text starts, and whether it depends on the one before.
+    // separator is what ended the last command (NULL at the start of the line)
+    int pipeline_start = 0, stage_is_empty;
+    char* text_start, *text_end, *text_out, *separator = NULL, *previous_separator;
+    ListOperator run_if = LIST_ALWAYS;
+    Pipeline* pipeline;
+    // The redirects of the command being lexed, and where the next word goes if it's the file name of a redirect
+    char* input_file = NULL, *output_file = NULL, *error_file = NULL;
+    int output_append = 0, error_append = 0;
+    char** redirect_target = NULL;
+    char* redirect_error = NULL;
+    // Words with globs or expansions in them get a pattern too, but only lines with glob characters or $ in them
+    // have room for any. pattern_target is where a redirect's file name puts its pattern, if it needs one
+    int has_patterns = 0, word_has_pattern = 0, word_slot = -1;
+    char** patterns = NULL;
+    char* pattern_out = NULL, *pattern_start = NULL;
+    char* input_pattern = NULL, *output_pattern = NULL, *error_pattern = NULL;
+    char** pattern_target = NULL;
+    size_t expansion_length;
+    ShellCommand* shcmd;
+    int i;
+
+    // Before lexing, find out how big everything can possibly get. Every token starts with a non-blank character
+    // right after a blank or a separator, and quoting can only ever merge tokens, so counting those is a safe upper bound.
+    // Every separator can start a new command (and pipeline) at most once
+    for (p = input_str; *p != '\0'; p++) {
+        if (*p == '|' || *p == '&' || *p == ';') {
+            separator_count++;
+            after_blank = 1;
+        } else
+        if (*p == '<' || *p == '>' || *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+            after_blank = 1;
+        } else {
+            token_bound += after_blank;
+            after_blank = 0;
+            has_patterns |= (*p == '*' || *p == '?' || *p == '[' || *p == '$');
+        }
+    }
+    length = p - input_str;
+
+    // The ParsedLine, its commands and pipelines, the word pointers (plus a NULL per command), the words, a copy of the line
+    // and every pipeline's text all come from one block (each of the seven pieces can lose up to one max_align_t to alignment).
+    // With globs or expansions, so do the pattern pointers and the patterns, which can have every character escaped
+    // (and an expansion's pattern is never more than twice as long as the expansion either)
+    arena.head = NULL;
+    if (!arena_reserve(&arena, sizeof(ParsedLine) + (sizeof(ShellCommand) + sizeof(Pipeline)) * (separator_count + 1)
+        + sizeof(char*) * (token_bound + separator_count + 1) + (length + token_bound + 1) + (length + 1)
+        + (length + separator_count + 1) + 7 * sizeof(max_align_t)
+        + (has_patterns ? sizeof(char*) * (token_bound + separator_count + 1) + (2 * length + token_bound + 1) + 2 * sizeof(max_align_t) : 0))) {
+        return new_err(0, "Line failed to allocate");
+    }
+    line = arena_alloc(&arena, sizeof(ParsedLine));
+    line->commands = arena_alloc(&arena, sizeof(ShellCommand) * (separator_count + 1));
+    line->pipelines = arena_alloc(&arena, sizeof(Pipeline) * (separator_count + 1));
+    line->words = arena_alloc(&arena, sizeof(char*) * (token_bound + separator_count + 1));
+    out = arena_alloc(&arena, length + token_bound + 1);
+    line->text = arena_alloc(&arena, length + 1);
+    memcpy(line->text, input_str, length + 1);
+    text_out = arena_alloc(&arena, length + separator_count + 1);
+    if (has_patterns) {
+        patterns = arena_alloc(&arena, sizeof(char*) * (token_bound + separator_count + 1));
+        memset(patterns, 0, sizeof(char*) * (token_bound + separator_count + 1));
+        pattern_out = arena_alloc(&arena, 2 * length + token_bound + 1);
+    }
+    line->word_count = 0;
+    line->command_count = 0;
+    line->pipeline_count = 0;
+    line->users = 0;
+    line->is_cached = 0;
+
+    // words is filled in slot by slot: every word takes a slot, and every finished command takes one more for its NULL.
+    // The file name after a redirect is a word too, but it goes in the redirect instead of taking a slot
+    text_start = input_str;
+    for (p = input_str; syntax_error == NULL; p++) {
+        c = *p;
+        if (c == '<' || c == '>' || (c == '2' && p[1] == '>' && !in_word)) {
+            if (in_word) {
+                *out++ = '\0';
+                in_word = 0;
+                // A word only keeps its pattern if it turned out to have globs or expansions in it
+                if (word_has_pattern) {
+                    *pattern_out++ = '\0';
+                    if (word_slot != -1) {
+                        patterns[word_slot] = pattern_start;
+                    } else {
+                        *pattern_target = pattern_start;
+                    }
+                } else {
+                    pattern_out = pattern_start;
+                }
+            }
+            if (redirect_target != NULL) {
+                break;
+            }
+            if (c == '<') {
+                redirect_target = &input_file;
+                redirect_error = "Syntax error: missing file name after <";
+            } else
+            if (c == '2') {
+                p++;
+                redirect_target = &error_file;
+                error_append = (p[1] == '>');
+                redirect_error = error_append ? "Syntax error: missing file name after 2>>" : "Syntax error: missing file name after 2>";
+                p += error_append;
+            } else {
+                redirect_target = &output_file;
+                output_append = (p[1] == '>');
+                redirect_error = output_append ? "Syntax error: missing file name after >>" : "Syntax error: missing file name after >";
+                p += output_append;
+            }
+            continue;
+        }
+        if (c == '\0' || c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '|' || c == '&' || c == ';') {
+            if (in_word) {
+                *out++ = '\0';
+                in_word = 0;
+                // A word only keeps its pattern if it turned out to have globs or expansions in it
+                if (word_has_pattern) {
+                    *pattern_out++ = '\0';
+                    if (word_slot != -1) {
+                        patterns[word_slot] = pattern_start;
+                    } else {
+                        *pattern_target = pattern_start;
+                    }
+                } else {
+                    pattern_out = pattern_start;
+                }
+            }
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+                continue;
+            }
+            if (redirect_target != NULL) {
+                break;
+            }
+            // Which separator this is. && and || are the only ones two characters long
+            text_end = p;
+            previous_separator = separator;
+            separator = (c == '\0') ? "" : (c == ';') ? ";" : (c == '|') ? (p[1] == '|' ? "||" : "|") : (p[1] == '&' ? "&&" : "&");
+            p += (separator[0] != '\0' && separator[1] != '\0');
+            // A command can be nothing but redirects, like "> file" or "< in > out". Otherwise there has to be a command
+            // before every separator, and after every one but ; and &. A line can be empty, or end in ; or &, though
+            stage_is_empty = (slot == stage_start && input_file == NULL && output_file == NULL && error_file == NULL);
+            if (stage_is_empty) {
+                if (c == '\0' && line->command_count == pipeline_start
+                    && (previous_separator == NULL || strcmp(previous_separator, ";") == 0 || strcmp(previous_separator, "&") == 0)) {
+                    break;
+                }
+                if (c == '\0') {
+                    snprintf(syntax_message, sizeof(syntax_message), "Syntax error: missing command after %s", previous_separator);
+                } else {
+                    snprintf(syntax_message, sizeof(syntax_message), "Syntax error: missing command before %s", separator);
+                }
+                syntax_error = syntax_message;
+                break;
+            }
+            line->commands[line->command_count].command = &line->words[stage_start];
+            line->commands[line->command_count].word_count = slot - stage_start;
+            line->commands[line->command_count].builtin = CONSOLE;
+            line->commands[line->command_count].patterns = patterns != NULL ? &patterns[stage_start] : NULL;
+            line->commands[line->command_count].assignments = NULL;
+            line->commands[line->command_count].assignment_count = 0;
+            line->commands[line->command_count].environment = NULL;
+            line->commands[line->command_count].input_file = input_file;
+            line->commands[line->command_count].output_file = output_file;
+            line->commands[line->command_count].error_file = error_file;
+            line->commands[line->command_count].input_pattern = input_pattern;
+            line->commands[line->command_count].output_pattern = output_pattern;
+            line->commands[line->command_count].error_pattern = error_pattern;
+            line->commands[line->command_count].output_append = output_append;
+            line->commands[line->command_count].error_append = error_append;
+            line->command_count++;
+            line->words[slot++] = NULL;
+            stage_start = slot;
+            input_file = NULL;
+            output_file = NULL;
+            error_file = NULL;
+            input_pattern = NULL;
+            output_pattern = NULL;
+            error_pattern = NULL;
+            // Anything but a pipe ends the pipeline too. Its text is its part of the line, without blanks around it
+            if (strcmp(separator, "|") != 0) {
+                pipeline = &line->pipelines[line->pipeline_count++];
+                pipeline->commands = &line->commands[pipeline_start];
+                pipeline->command_count = line->command_count - pipeline_start;
+                pipeline->is_background = (strcmp(separator, "&") == 0);
+                pipeline->is_timed = 0;
+                pipeline->is_cached = 0;
+                pipeline->cache_words = NULL;
+                pipeline->cache_patterns = NULL;
+                pipeline->cache_word_count = 0;
+                pipeline->run_if = run_if;
+                text_start += strspn(text_start, " \t\n\r");
+                while (text_end > text_start && strchr(" \t\n\r", text_end[-1]) != NULL) {
+                    text_end--;
+                }
+                pipeline->text = text_out;
+                memcpy(text_out, text_start, text_end - text_start);
+                text_out += text_end - text_start;
+                *text_out++ = '\0';
+                text_start = p + 1;
+                pipeline_start = line->command_count;
+                run_if = (strcmp(separator, "&&") == 0) ? LIST_AND : (strcmp(separator, "||") == 0) ? LIST_OR : LIST_ALWAYS;
+            }
+            if (c == '\0') {
+                break;
+            }
+            continue;
+        }
+        if (!in_word) {
+            word_slot = -1;
+            if (redirect_target != NULL) {
+                *redirect_target = out;
+                pattern_target = (redirect_target == &input_file) ? &input_pattern
+                    : (redirect_target == &output_file) ? &output_pattern : &error_pattern;
+                redirect_target = NULL;
+            } else {
+                word_slot = slot;
+                line->words[slot++] = out;
+                line->word_count++;
+            }
+            in_word = 1;
+            word_has_pattern = 0;
+            pattern_start = pattern_out;
+        }
+        if (c == '\\') {
+            // A backslash at the very end of the line has nothing to escape, so it's kept
+            if (p[1] != '\0') {
+                p++;
+            }
+            *out++ = *p;
+            pattern_out = append_pattern(pattern_out, *p, 1);
+        } else
+        if (c == '\'') {
+            close_quote = strchr(p + 1, '\'');
+            if (close_quote == NULL) {
+                syntax_error = "Syntax error: unterminated single quote";
+                break;
+            }
+            memcpy(out, p + 1, close_quote - p - 1);
+            out += close_quote - p - 1;
+            for (p++; p < close_quote; p++) {
+                pattern_out = append_pattern(pattern_out, *p, 1);
+            }
+        } else
+        if (c == '"') {
+            for (p++; *p != '"'; p++) {
+                if (*p == '\0') {
+                    syntax_error = "Syntax error: unterminated double quote";
+                    break;
+                }
+                if (*p == '$' && (expansion_length = lex_expansion(p, &out, &pattern_out, 1)) > 0) {
+                    word_has_pattern = 1;
+                    p += expansion_length - 1;
+                    continue;
+                }
+                if (*p == '\\' && (p[1] == '"' || p[1] == '\\' || p[1] == '$' || p[1] == '`')) {
+                    p++;
+                }
+                *out++ = *p;
+                pattern_out = append_pattern(pattern_out, *p, 1);
+            }
+        } else
+        if (c == '$' && (expansion_length = lex_expansion(p, &out, &pattern_out, 0)) > 0) {
+            word_has_pattern = 1;
+            p += expansion_length - 1;
+        } else {
+            *out++ = c;
+            pattern_out = append_pattern(pattern_out, c, 0);
+            word_has_pattern |= (c == '*' || c == '?' || c == '[');
+        }
+    }
+    // The only way out of the loop above with a redirect still waiting for its file name
+    if (syntax_error == NULL && redirect_target != NULL) {
+        syntax_error = redirect_error;
+    }
+    if (syntax_error != NULL) {
+        free_arena(&arena);
+        return new_err(1, syntax_error);
+    }
+    // Work out which commands are builtins now, while the words are hot.
+    // A command of nothing but redirects copies its input to its output if it has any input, like a cat with no arguments.
+    // Otherwise all it does is open (and create, or empty) its files
+    for (slot = 0; slot < line->command_count; slot++) {
+        if (line->commands[slot].word_count > 0) {
+            split_assignments(&line->commands[slot]);
+        } else
+        if (slot > 0 || line->commands[slot].input_file != NULL) {
+            line->commands[slot].builtin = CAT;
+        } else {
+            line->commands[slot].builtin = TRUE;
+        }
+    }
+    // time at the very start of a pipeline times the whole pipeline, so it's taken off the pipeline instead of being run.
+    // Only a time with nothing after it (or with options, to change its settings) is left for builtin_time
+    for (slot = 0; slot < line->pipeline_count; slot++) {
+        pipeline = &line->pipelines[slot];
+        if (pipeline->commands[0].builtin == TIME && pipeline->commands[0].word_count > 1
+            && pipeline->commands[0].command[1][0] != '-') {
+            pipeline->is_timed = 1;
+            pipeline->commands[0].command++;
+            if (pipeline->commands[0].patterns != NULL) {
+                pipeline->commands[0].patterns++;
+            }
+            pipeline->commands[0].word_count--;
+            line->word_count--;
+            split_assignments(&pipeline->commands[0]);
+        }
+        // cached works the same way (after time, so "time cached ..." times the pipeline however it's run).
+        // Its options are kept on the pipeline for run_cached, and a cached with no pipeline after them is builtin_cached's.
+        // -n is the only one without a value: it gives the first stage /dev/null to read, unless it has a file already
+        if (pipeline->commands[0].builtin == CACHED) {
+            shcmd = &pipeline->commands[0];
+            reads_nothing = 0;
+            for (i = 1; i < shcmd->word_count; i++) {
+                if (strcmp(shcmd->command[i], "--") == 0) {
+                    i++;
+                    break;
+                }
+                if (strcmp(shcmd->command[i], "-n") == 0) {
+                    reads_nothing = 1;
+                    continue;
+                }
+                if (i + 1 >= shcmd->word_count || (strcmp(shcmd->command[i], "-f") != 0
+                    && strcmp(shcmd->command[i], "-m") != 0 && strcmp(shcmd->command[i], "-e") != 0)) {
+                    break;
+                }
+                i++;
+            }
+            if (i < shcmd->word_count && shcmd->command[i][0] != '-') {
+                pipeline->is_cached = 1;
+                pipeline->cache_words = shcmd->command + 1;
+                pipeline->cache_patterns = shcmd->patterns != NULL ? shcmd->patterns + 1 : NULL;
+                pipeline->cache_word_count = i - 1;
+                shcmd->command += i;
+                if (shcmd->patterns != NULL) {
+                    shcmd->patterns += i;
+                }
+                shcmd->word_count -= i;
+                line->word_count -= i;
+                split_assignments(shcmd);
+                if (reads_nothing && shcmd->input_file == NULL && shcmd->input_pattern == NULL) {
+                    shcmd->input_file = "/dev/null";
+                }
+            }
+        }
+    }
+    line->arena = arena;
+    return new_ok((void*)&line);
+}
+
+// Adds one character of a word to the word's glob pattern, and returns where the next one goes.
+// Quoted characters are never glob characters, so the pattern gets them escaped. A $ that gets here was never
+// an expansion (see lex_expansion), so it's always escaped. Lines without globs or expansions have no patterns
+char* append_pattern(char* pattern, char c, int is_quoted) {
+    if (pattern == NULL) {
+        return NULL;
+    }
+    if (c == '$' || (is_quoted && (c == '*' || c == '?' || c == '[' || c == ']' || c == '\\'))) {
+        *pattern++ = '\\';
+    }
+    *pattern++ = c;
+    return pattern;
+}
+
+// Lexes the expansion starting at the $ at p: $NAME, ${NAME}, $? or $$. The word keeps the expansion as it was typed,
+// and the pattern gets "$" followed by 'q' if it's in double quotes or 'u' if it isn't, then the name and a '}'.
+// Nothing is expanded yet, since the value can be different every time the line runs (see expand_words).
+// Returns how many characters the expansion took up, or 0 if this $ doesn't start one and is just a $
+size_t lex_expansion(char* p, char** out, char** pattern, int is_quoted) {
+    char* name = p + 1;
+    size_t length, expansion_length;
+
+    if (*name == '?' || *name == '$') {
+        length = 1;
+        expansion_length = 2;
+    } else
+    if (*name == '{') {
+        name++;
+        length = name_length(name);
+        if (length == 0 && (*name == '?' || *name == '$')) {
+            length = 1;
+        }
+        if (length == 0 || name[length] != '}') {
+            return 0;
+        }
+        expansion_length = length + 3;
+    } else {
+        length = name_length(name);
+        if (length == 0) {
+            return 0;
+        }
+        expansion_length = length + 1;
+    }
+    memcpy(*out, p, expansion_length);
+    *out += expansion_length;
+    *(*pattern)++ = '$';
+    *(*pattern)++ = is_quoted ? 'q' : 'u';
+    memcpy(*pattern, name, length);
+    *pattern += length;
+    *(*pattern)++ = '}';
+    return expansion_length;
+}
+
+// How long the variable name at the start of text is: a letter or underscore, then letters, digits and underscores.
+// 0 means text doesn't start with one
+size_t name_length(char* text) {
+    size_t length = 0;
+    if (!isalpha((unsigned char)text[0]) && text[0] != '_') {
+        return 0;
+    }
+    while (isalnum((unsigned char)text[length]) || text[length] == '_') {
+        length++;
+    }
+    return length;
+}
+
+// Works out which builtin a lexed command is, after taking off the NAME=VALUE words at its start.
+// A command that's nothing but those sets shell variables (it's ASSIGN). Otherwise they're the command's assignments,
+// which it only gets in its environment
+void split_assignments(ShellCommand* shcmd) {
+    int count = 0;
+
+    while (count < shcmd->word_count && name_length(shcmd->command[count]) > 0
+        && shcmd->command[count][name_length(shcmd->command[count])] == '=') {
+        count++;
+    }
+    if (count == shcmd->word_count) {
+        shcmd->builtin = ASSIGN;
+        return;
+    }
+    if (count > 0) {
+        shcmd->assignments = shcmd->command;
+        shcmd->assignment_count = count;
+        shcmd->command += count;
+        shcmd->word_count -= count;
+        if (shcmd->patterns != NULL) {
+            shcmd->patterns += count;
+        }
+    }
+    shcmd->builtin = parse(shcmd->command[0]);
+}
+
+// Frees everything belonging to a lexed line, including the line itself
+void free_line(ParsedLine* line) {
+    Arena arena = line->arena;
+    free_arena(&arena);
+}
+
+// Error<ParsedLine*>
+// Returns the parsed form of a line, from the parse cache if the same line has been lexed recently, or lexed (and cached)
+// now if it hasn't. The caller gives it back with release_parsed_line once it's done running it.
+// The cache is a hash table for finding lines, threaded with a list in the order they were last used. Finding a line
+// moves it to the newest end, and lines fall off the oldest end once there are too many. A line still being run
+// (history can run lines from inside a line) is only freed once it's been given back
+Error find_parsed_line(char* input_str) {
+    static ParsedLine* line;
+    Error line_result;
+    ParsedLine* oldest;
+    ParsedLine** link;
+    unsigned long hash = hash_string(input_str);
+    int bucket = hash & (PARSE_CACHE_BUCKETS - 1);
+
+    for (line = parse_cache[bucket]; line != NULL; line = line->bucket_next) {
+        if (line->hash == hash && strcmp(line->text, input_str) == 0) {
+            break;
+        }
+    }
+    if (line != NULL) {
+        parse_cache_hits++;
+        unlink_parsed_line(line);
+    } else {
+        parse_cache_misses++;
+        line_result = lex_line(input_str);
+        if (!line_result.is_ok) {
+            return line_result;
+        }
+        line = *(ParsedLine**)line_result.value_ptr;
+        line->hash = hash;
+        if (parse_cache_capacity == 0) {
+            line->users = 1;
+            return new_ok((void*)&line);
+        }
+        line->is_cached = 1;
+        line->bucket_next = parse_cache[bucket];
+        parse_cache[bucket] = line;
+        parse_cache_count++;
+    }
+    line->older = parse_cache_newest;
+    line->newer = NULL;
+    if (parse_cache_newest != NULL) {
+        parse_cache_newest->newer = line;
+    }
+    parse_cache_newest = line;
+    if (parse_cache_oldest == NULL) {
+        parse_cache_oldest = line;
+    }
+    line->users++;
+    // Make room, oldest first. Only the line just added can't go, as there's always at least one line allowed
+    while (parse_cache_count > parse_cache_capacity) {
+        oldest = parse_cache_oldest;
+        unlink_parsed_line(oldest);
+        oldest->is_cached = 0;
+        parse_cache_count--;
+        for (link = &parse_cache[oldest->hash & (PARSE_CACHE_BUCKETS - 1)]; *link != NULL; link = &(*link)->bucket_next) {
+            if (*link == oldest) {
+                *link = oldest->bucket_next;
+                break;
+            }
+        }
+        if (oldest->users == 0) {
+            free_line(oldest);
+        }
+    }
+    return new_ok((void*)&line);
+}
+
+// Gives back a line from find_parsed_line. It's freed once nobody is running it, unless the cache still has it
+void release_parsed_line(ParsedLine* line) {
+    line->users--;
+    if (line->users == 0 && !line->is_cached) {
+        free_line(line);
+    }
+}
+
+// Takes a line out of the parse cache's most recently used list (but not out of its hash table)
+void unlink_parsed_line(ParsedLine* line) {
+    if (line->newer != NULL) {
+        line->newer->older = line->older;
+    } else {
+        parse_cache_newest = line->older;
+    }
+    if (line->older != NULL) {
+        line->older->newer = line->newer;
+    } else {
+        parse_cache_oldest = line->newer;
+    }
+    line->newer = NULL;
+    line->older = NULL;
+}
+
+// Prints how well the parse cache is doing, for stats
+void display_parse_cache(FILE* out, int as_json) {
+    if (as_json) {
+        fprintf(out, "{\"cache\": \"parse\", \"hits\": %lld, \"misses\": %lld, \"entries\": %d, \"capacity\": %d}\n",
+            parse_cache_hits, parse_cache_misses, parse_cache_count, parse_cache_capacity);
+        return;
+    }
+    fprintf(out, "parse cache: %lld hits, %lld misses, %d of %d lines kept\n",
+        parse_cache_hits, parse_cache_misses, parse_cache_count, parse_cache_capacity);
+}
+
+// Hands out size bytes from the arena, suitably aligned for anything. Gets a new block if the current one is full
+// Returns NULL if memory ran out
+void* arena_alloc(Arena* arena, size_t size) {
+    void* memory;
+
+    // Keep every allocation aligned by only ever handing out whole max_align_t units
+    size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+    if (arena->head == NULL || arena->head->capacity - arena->head->used < size) {
+        if (!arena_reserve(arena, size)) {
+            return NULL;
+        }
+    }
+    memory = (char*)arena->head->memory + arena->head->used;
+    arena->head->used += size;
+    return memory;
+}
+
+// Starts a new block with room for at least size bytes, so that allocations adding up to size won't need another one.
+// Blocks at least double in size each time. Returns 0 if memory ran out
+int arena_reserve(Arena* arena, size_t size) {
+    ArenaBlock* block;
+    size_t capacity = size;
+
+    if (arena->head != NULL && capacity < arena->head->capacity * 2) {
+        capacity = arena->head->capacity * 2;
+    }
+    block = malloc(sizeof(ArenaBlock) + capacity);
+    if (block == NULL) {
+        return 0;
+    }
+    block->next = arena->head;
+    block->used = 0;
+    block->capacity = capacity;
+    arena->head = block;
+    return 1;
+}
+
+// Frees every block the arena handed memory out of
+void free_arena(Arena* arena) {
+    ArenaBlock* block, *next;
+    for (block = arena->head; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    arena->head = NULL;
+}
+
+// Parse the first argument to see if it's a builtin (exit, cd, history, ...) or a unix program
+CommandType parse(char* command) {
+    CommandType cmd = builtin_table[builtin_slot(command, builtin_seed)];
+    if (cmd != CONSOLE && strcmp(builtins[cmd].name, command) == 0) {
+        return cmd;
+    }
+    return CONSOLE;
+}
+
+// Finds a seed for which every builtin's name lands in a different slot, and fills builtin_table with it.
+// There are few enough builtins in a big enough table that this takes a handful of tries
+void init_builtin_table() {
+    CommandType cmd;
+    unsigned int slot;
+    int has_collision = 1;
+
+    for (builtin_seed = 1; has_collision; builtin_seed++) {
+        memset(builtin_table, 0, sizeof(builtin_table));
+        has_collision = 0;
+        for (cmd = CONSOLE + 1; cmd < COMMAND_TYPE_COUNT; cmd++) {
+            // ASSIGN can't be typed, so it isn't in the table at all
+            if (builtins[cmd].name[0] == '\0') {
+                continue;
+            }
+            slot = builtin_slot(builtins[cmd].name, builtin_seed);
+            if (builtin_table[slot] != CONSOLE) {
+                has_collision = 1;
+                break;
+            }
+            builtin_table[slot] = cmd;
+        }
+    }
+    // The loop went one past the seed that worked
+    builtin_seed--;
+}
+
+// The hash behind builtin_table, mixed with seed so init_builtin_table can look for one without collisions
+unsigned int builtin_slot(char* name, unsigned int seed) {
+    unsigned int hash = seed;
+    for (; *name != '\0'; name++) {
+        hash = hash * 31 + (unsigned char)*name;
+    }
+    hash ^= hash >> 15;
+    hash *= 2246822519U;
+    hash ^= hash >> 13;
+    return hash & (BUILTIN_SLOTS - 1);
+}
+
+// Error<BLANK>
+// Runs a builtin stage inside the shell. Its exit status goes in shcmd->status.
+// If the stage's stdin, stdout or stderr aren't the shell's, the shell's are swapped out for them while it runs
+Error run_builtin(ShellCommand* shcmd, int* should_continue) {
+    Error run_result;
+    int stage_fds[3] = {shcmd->stdin, shcmd->stdout, shcmd->stderr};
+    int saved_fds[3] = {-1, -1, -1};
+    int i;
+
+    fflush(stdout);
+    for (i = 0; i < 3; i++) {
+        if (stage_fds[i] != -1) {
+            saved_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+            dup2(stage_fds[i], i);
+        }
+    }
+    close_stage_fds(shcmd);
+    shcmd->status = 0;
+    run_result = builtins[shcmd->builtin].run(shcmd->word_count, shcmd->command, &shcmd->status, should_continue);
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < 3; i++) {
+        if (saved_fds[i] != -1) {
+            dup2(saved_fds[i], i);
+            close(saved_fds[i]);
+        }
+    }
+    return run_result;
+}
+
+// Error<int>
+// Process one or multiple commands. Supports piping
+// A line ending in & is left running as a background job. Otherwise we wait for it, and the returned int is the
+// exit status of the last stage, which is also stored in last_exit_status.
+// A cached pipeline goes through the output cache, unless it's in the background or writes to files of its own
+Error command(Pipeline* pipeline, int* should_continue) {
+    PipelineIO io = {-1, -1, -1};
+    Error start_result;
+    Job* job;
+    long long waited;
+
+    if (pipeline->is_cached && !pipeline->is_background && !pipeline_redirects_output(pipeline)) {
+        return run_cached(pipeline, should_continue);
+    }
+    start_result = start_pipeline(pipeline, &io, should_continue);
+    if (!start_result.is_ok) {
+        return start_result;
+    }
+    job = *(Job**)start_result.value_ptr;
+    if (!pipeline->is_background) {
+        waited = now_ns();
+        wait_for_job(job);
+        line_work_ns += now_ns() - waited;
+        return new_ok((void*)&last_exit_status);
+    }
+    // Like other shells, say which job number the background job got and what its last process is
+    if (job->pids[job->process_count - 1] != -1) {
+        printf("[%d] %d\n", job->id, (int)job->pids[job->process_count - 1]);
+    } else {
+        printf("[%d]\n", job->id);
+    }
+    current_job = job->id;
+    last_exit_status = 0;
+    return new_ok((void*)&last_exit_status);
+}
+
+// Returns whether the last stage of a pipeline runs right in the shell rather than in a child.
+// A builtin at the end of a foreground pipeline does, so that (for example) cd still works.
+// Anywhere else it has to run alongside the other stages, so it gets forked like a program would.
+// cat and tee can take as long as their input does, so with job control they get a process of their own too,
+// which ^C and ^Z can reach (the shell ignores both)
+int runs_in_shell(Pipeline* pipeline, ShellCommand* command) {
+    return command->builtin != CONSOLE && !pipeline->is_background
+        && !(job_control && (command->builtin == CAT || command->builtin == TEE));
+}
+
+// Error<Job*>
+// Starts every stage of a pipeline and returns the job they belong to, without waiting for any of them.
+// Every stage is forked before any of them is waited on, so the stages of a pipeline stream into each other
+// concurrently instead of one stage having to finish (and fit into a single pipe buffer) before the next one starts.
+// If something goes wrong partway, whatever did start is waited for before the error is returned
+Error start_pipeline(Pipeline* pipeline, PipelineIO* io, int* should_continue) {
+    int chunk_count = pipeline->command_count;
+    ShellCommand local_commands[PIPELINE_LOCAL_STAGES];
+    ShellCommand* commands = local_commands;
+    Error run_result, job_result;
+    // Only what's returned is static. Builtins (like parallel) can start pipelines of their own in the middle of this one
+    static Job* started_job;
+    Job* job;
+    int i, launched_count;
+    int pipe_store[2];
+    pid_t pgid = 0;
+    char* pipe_failure = NULL;
+    struct rusage usage_before;
+    long long started = now_ns(), phase_started, not_setup_ns = 0;
+    // Where the expanded words (and any environments with assignments in them) live until the pipeline has started
+    Arena expansion_arena;
+    int procs_fd = -1, forked_count;
+
+    // The parsed line can be shared (see find_parsed_line), so it's never written to. Everything that happens to
+    // the stages while they run happens to a copy, which only needs allocating for unusually long pipelines
+    if (chunk_count > PIPELINE_LOCAL_STAGES) {
+        commands = malloc(sizeof(ShellCommand) * chunk_count);
+        if (commands == NULL) {
+            return new_err(0, "Pipeline failed to allocate");
+        }
+    }
+    memcpy(commands, pipeline->commands, sizeof(ShellCommand) * chunk_count);
+    // Words are expanded every time the line runs, since variables and what globs match can change from one run
+    // to the next (even within the line, like "X=1; echo $X")
+    expansion_arena.head = NULL;
+    job_result = new_ok(BLANK);
+    for (i = 0; i < chunk_count && job_result.is_ok; i++) {
+        job_result = expand_words(&commands[i], &expansion_arena);
+    }
+    // The job exists before anything is launched, so none of its children can be reaped before it's there to claim them
+    if (job_result.is_ok) {
+        job_result = create_job(pipeline, commands);
+    }
+    if (!job_result.is_ok) {
+        free_arena(&expansion_arena);
+        if (commands != local_commands) {
+            free(commands);
+        }
+        return job_result;
+    }
+    job = *(Job**)job_result.value_ptr;
+    // The governor holds the pipeline back while too many children are running already, and gives it its cgroup.
+    // A lone builtin that runs in the shell has no children for it to govern
+    forked_count = chunk_count - runs_in_shell(pipeline, &commands[chunk_count - 1]);
+    // If ^C gives up on it instead, it fails like a pipeline ^C killed would, without anything being started
+    if (!job->is_helper && forked_count > 0 && governor.max_running > 0 && wait_for_children(forked_count) == -1) {
+        for (i = 0; i < chunk_count; i++) {
+            job->states[i] = PROCESS_DONE;
+            job->statuses[i] = 128 + SIGINT;
+        }
+        job->is_interrupted = 1;
+        free_arena(&expansion_arena);
+        if (commands != local_commands) {
+            free(commands);
+        }
+        started_job = job;
+        return new_ok((void*)&started_job);
+    }
+    if (!job->is_helper && forked_count > 0 && governor.cgroup_base != NULL) {
+        procs_fd = create_job_cgroup(job);
+    }
+    // The lexer already split the line into commands. Nothing is piped until the pipes are made below,
+    // and each stage gets its own copy of whatever the caller wants the pipeline connected to
+    for (i = 0; i < chunk_count; i++) {
+        commands[i].stdin = (i == 0 && io->stdin != -1) ? fcntl(io->stdin, F_DUPFD_CLOEXEC, 3) : -1;
+        commands[i].stdout = (i == chunk_count - 1 && io->stdout != -1) ? fcntl(io->stdout, F_DUPFD_CLOEXEC, 3) : -1;
+        commands[i].stderr = io->stderr != -1 ? fcntl(io->stderr, F_DUPFD_CLOEXEC, 3) : -1;
+        commands[i].stdout_read_end = -1;
+        commands[i].path = NULL;
+        commands[i].pid = -1;
+        commands[i].status = 0;
+    }
+    // Anything the shell printed needs to reach the terminal before the children start writing to it
+    fflush(stdout);
+    // Launch every stage. The pipe feeding stage i + 1 is only made right before stage i is forked, so no child
+    // inherits pipe ends it has no business holding (they're also close-on-exec, for the same reason).
+    // The first stage becomes the leader of the process group that every other stage joins.
+    run_result = new_ok(BLANK);
+    for (launched_count = 0; launched_count < chunk_count; launched_count++) {
+        i = launched_count;
+        if (i < (chunk_count - 1)) {
+            if (pipe2(pipe_store, O_CLOEXEC) == -1) {
+                pipe_failure = "Pipe failure in command function";
+                break;
+            }
+            // A bigger pipe lets the stage before it write (and the stage after it read) more per context switch
+            if (placement.pipe_size > 0) {
+                fcntl(pipe_store[1], F_SETPIPE_SZ, placement.pipe_size);
+            }
+            // At this point, pipe_store[0] is a read, and pipe_store[1] is a write. We need to store them appropriately
+            commands[i].stdout = pipe_store[1];
+            commands[i].stdout_read_end = pipe_store[0];
+            commands[i + 1].stdin = pipe_store[0];
+        }
+        // A stage whose files can't be opened fails like a command that doesn't exist would, and the rest carry on
+        if (open_redirects(&commands[i]) == -1) {
+            close_stage_fds(&commands[i]);
+            job->states[i] = PROCESS_DONE;
+            job->statuses[i] = 1;
+            continue;
+        }
+        // A builtin at the end of a foreground pipeline runs right here in the shell, see runs_in_shell
+        if (i == (chunk_count - 1) && runs_in_shell(pipeline, &commands[i])) {
+            // What the shell uses while the builtin runs is what the builtin used
+            getrusage(RUSAGE_SELF, &usage_before);
+            phase_started = now_ns();
+            run_result = run_builtin(&commands[i], should_continue);
+            phase_started = now_ns() - phase_started;
+            record_latency(PHASE_BUILTIN, phase_started);
+            not_setup_ns += phase_started;
+            line_work_ns += phase_started;
+            getrusage(RUSAGE_SELF, &job->usages[i]);
+            clock_gettime(CLOCK_MONOTONIC, &job->finished[i]);
+            timersub(&job->usages[i].ru_utime, &usage_before.ru_utime, &job->usages[i].ru_utime);
+            timersub(&job->usages[i].ru_stime, &usage_before.ru_stime, &job->usages[i].ru_stime);
+            job->usages[i].ru_nvcsw -= usage_before.ru_nvcsw;
+            job->usages[i].ru_nivcsw -= usage_before.ru_nivcsw;
+        } else {
+            phase_started = now_ns();
+            governor.procs_fd = procs_fd;
+            run_result = launch_stage(&commands[i], pgid);
+            governor.procs_fd = -1;
+            phase_started = now_ns() - phase_started;
+            record_latency(PHASE_LAUNCH, phase_started);
+            not_setup_ns += phase_started;
+            if (commands[i].pid != -1 && placement.policy != AFFINITY_OFF) {
+                place_stage(commands[i].pid);
+            }
+        }
+        job->pids[i] = commands[i].pid;
+        if (commands[i].pid == -1) {
+            job->states[i] = PROCESS_DONE;
+            job->statuses[i] = commands[i].status;
+        }
+        if (!run_result.is_ok) {
+            break;
+        }
+        if (pgid == 0 && commands[i].pid != -1 && job_control) {
+            pgid = commands[i].pid;
+            job->pgid = pgid;
+            // Hand the terminal to a foreground pipeline so that it, and not the shell, receives keyboard signals
+            if (!pipeline->is_background) {
+                tcsetpgrp(STDIN_FILENO, pgid);
+            }
+        }
+    }
+    if (procs_fd != -1) {
+        close(procs_fd);
+    }
+    // If launching stopped early, the stages that never started still hold fds that have to go,
+    // and are as good as failed
+    if (launched_count < chunk_count) {
+        for (i = launched_count + 1; i < chunk_count; i++) {
+            close_stage_fds(&commands[i]);
+            job->states[i] = PROCESS_DONE;
+            job->statuses[i] = 255;
+        }
+        // Whatever was launched still needs to be reaped, even if something went wrong along the way
+        wait_for_job(job);
+        free_arena(&expansion_arena);
+        if (commands != local_commands) {
+            free(commands);
+        }
+        // Piping or forking could go wrong. If it does, we can't actually recover, so we should return the error
+        if (pipe_failure != NULL) {
+            return new_err(0, pipe_failure);
+        }
+        return run_result;
+    }
+    record_latency(PHASE_SETUP, now_ns() - started - not_setup_ns);
+    free_arena(&expansion_arena);
+    if (commands != local_commands) {
+        free(commands);
+    }
+    started_job = job;
+    return new_ok((void*)&started_job);
+}
+
+// Closes the shell's copies of a stage's fds, which the stage has its own copies of once it's started
+void close_stage_fds(ShellCommand* shcmd) {
+    if (shcmd->stdin != -1) {
+        close(shcmd->stdin);
+        shcmd->stdin = -1;
+    }
+    if (shcmd->stdout != -1) {
+        close(shcmd->stdout);
+        shcmd->stdout = -1;
+    }
+    if (shcmd->stderr != -1) {
+        close(shcmd->stderr);
+        shcmd->stderr = -1;
+    }
+}
+
+// Opens the files a stage's redirects name, in place of the pipes (or whatever else) it was going to use.
+// Returns -1, having told the user why, if one of them can't be opened
+int open_redirects(ShellCommand* shcmd) {
+    int fd;
+
+    if (shcmd->input_file != NULL) {
+        fd = open(shcmd->input_file, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            printf("%s: %s\n", shcmd->input_file, strerror(errno));
+            return -1;
+        }
+        if (shcmd->stdin != -1) {
+            close(shcmd->stdin);
+        }
+        shcmd->stdin = fd;
+    }
+    if (shcmd->output_file != NULL) {
+        fd = open(shcmd->output_file, O_WRONLY | O_CREAT | O_CLOEXEC | (shcmd->output_append ? O_APPEND : O_TRUNC), 0666);
+        if (fd == -1) {
+            printf("%s: %s\n", shcmd->output_file, strerror(errno));
+            return -1;
+        }
+        // The next stage just sees its pipe close straight away, like in other shells
+        if (shcmd->stdout != -1) {
+            close(shcmd->stdout);
+        }
+        shcmd->stdout = fd;
+    }
+    if (shcmd->error_file != NULL) {
+        fd = open(shcmd->error_file, O_WRONLY | O_CREAT | O_CLOEXEC | (shcmd->error_append ? O_APPEND : O_TRUNC), 0666);
+        if (fd == -1) {
+            printf("%s: %s\n", shcmd->error_file, strerror(errno));
+            return -1;
+        }
+        if (shcmd->stderr != -1) {
+            close(shcmd->stderr);
+        }
+        shcmd->stderr = fd;
+    }
+    return 0;
+}
+
+// Puts back the signals an interactive shell ignores, in a forked child
+void reset_child_signals() {
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+}
+
+// Fills signals with the signals an interactive shell ignores, for posix_spawn to put back
+void fill_job_control_signals(sigset_t* signals) {
+    sigemptyset(signals);
+    sigaddset(signals, SIGTTOU);
+    sigaddset(signals, SIGTTIN);
+    sigaddset(signals, SIGTSTP);
+    sigaddset(signals, SIGINT);
+    sigaddset(signals, SIGQUIT);
+}
+
+// Error<BLANK>
+// Starts a single unix program of a pipeline into the process group pgid (0 means "start a new group"), without waiting on it
+// If the program can't be started at all, its pid is left as -1 and its status is set like a failed exec would have
+Error launch_stage(ShellCommand* shcmd, pid_t pgid) {
+    Error resolve_result;
+
+    // Builtins have nothing to exec, so they can only be forked
+    if (shcmd->builtin != CONSOLE) {
+        return fork_stage(shcmd, pgid);
+    }
+    resolve_result = resolve_command(shcmd->command[0]);
+    if (!resolve_result.is_ok) {
+        // The command isn't anywhere on PATH, so there's no point forking just to have exec fail
+        close_stage_fds(shcmd);
+        shcmd->status = resolve_result.error_code;
+        return new_ok(BLANK);
+    }
+    shcmd->path = *(char**)resolve_result.value_ptr;
+    // posix_spawn can't set rlimits or move the child into a cgroup, so with the governor doing either, stages are forked
+    if (launcher == LAUNCH_SPAWN && governor.procs_fd == -1
+        && governor.cpu_seconds == 0 && governor.address_space == 0 && governor.open_files == 0) {
+        return spawn_stage(shcmd, pgid);
+    }
+    return fork_stage(shcmd, pgid);
+}
+
+// Error<BLANK>
+// The fork() + execve() launcher
+Error fork_stage(ShellCommand* shcmd, pid_t pgid) {
+    int child_should_continue = 1;
+    /*
+    The pipes for forked processes is handled by the command function, as it shouldn't be the individual
+    program's responsibility. We can't wire them up in the command function, since the piping will only work
+    correctly once we have forked the unix process, hence why the responsibility for dup2-ing and closing is
+    offloaded here, but the responsibility for which pipes exist is handled by command.
+    The general rule is:
+        If the program is the first one, it has no input pipe (stdin is -1) and keeps the shell's input
+        If the program is the last one, it has no output pipe (stdout is -1) and keeps the shell's output
+    Either way, the parent's copies of the pipe ends are closed once the child has them, even if forking failed.
+    */
+
+    pid_t fork_result;
+    // Fork the process. The child will execute the unix program
+    fork_result = fork();
+    if (fork_result == 0) {
+        // We are the child process
+        // Join the pipeline's process group. The parent does the same thing, whichever of the two runs first wins.
+        // Without job control, children stay in the shell's group so that ^C reaches all of them
+        if (job_control) {
+            setpgid(0, pgid);
+        }
+        if (is_interactive) {
+            reset_child_signals();
+        }
+        if (shcmd->stdin != -1) {
+            dup2(shcmd->stdin, STDIN_FILENO);
+            close(shcmd->stdin);
+        }
+        if (shcmd->stdout != -1) {
+            dup2(shcmd->stdout, STDOUT_FILENO);
+            close(shcmd->stdout);
+        }
+        if (shcmd->stderr != -1) {
+            dup2(shcmd->stderr, STDERR_FILENO);
+            close(shcmd->stderr);
+        }
+        // Everything a stage does counts against its pipeline's cgroup, so it moves itself in before doing anything.
+        // One the kernel won't move would run without the limits it was given, so it doesn't run at all
+        if (governor.procs_fd != -1 && write(governor.procs_fd, "0", 1) != 1) {
+            dprintf(STDERR_FILENO, "sish: cannot join the pipeline's cgroup: %s\n", strerror(errno));
+            _exit(126);
+        }
+        if (shcmd->builtin != CONSOLE) {
+            // There is no exec to close the close-on-exec pipe ends, so the one that matters is closed by hand
+            if (shcmd->stdout_read_end != -1) {
+                close(shcmd->stdout_read_end);
+            }
+            if (!builtins[shcmd->builtin].run(shcmd->word_count, shcmd->command, &shcmd->status, &child_should_continue).is_ok) {
+                shcmd->status = 255;
+            }
+            fflush(stdout);
+            _exit(shcmd->status);
+        }
+        apply_rlimits();
+        execve(shcmd->path, shcmd->command, shcmd->environment);
+        // _exit, so the copy of the shell's stdio buffers the child inherited isn't flushed a second time
+        _exit(-2);
+    }
+    // We are the parent process
+    close_stage_fds(shcmd);
+    if (fork_result == -1) {
+        return new_err(errno, "Fork failure");
+    }
+    shcmd->pid = fork_result;
+    if (job_control) {
+        setpgid(fork_result, pgid == 0 ? fork_result : pgid);
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// The posix_spawn() launcher. The same pipe wiring as fork_stage is described to posix_spawnp as file actions,
+// and the process group and signal resets as spawn attributes. Falls back to fork_stage if those can't be built
+Error spawn_stage(ShellCommand* shcmd, pid_t pgid) {
+    posix_spawn_file_actions_t file_actions;
+    posix_spawnattr_t attributes;
+    sigset_t default_signals;
+    short flags = 0;
+    pid_t child_pid;
+    int spawn_result;
+
+    if (posix_spawn_file_actions_init(&file_actions) != 0) {
+        return fork_stage(shcmd, pgid);
+    }
+    if (posix_spawnattr_init(&attributes) != 0) {
+        posix_spawn_file_actions_destroy(&file_actions);
+        return fork_stage(shcmd, pgid);
+    }
+    if (shcmd->stdin != -1) {
+        posix_spawn_file_actions_adddup2(&file_actions, shcmd->stdin, STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&file_actions, shcmd->stdin);
+    }
+    if (shcmd->stdout != -1) {
+        posix_spawn_file_actions_adddup2(&file_actions, shcmd->stdout, STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&file_actions, shcmd->stdout);
+    }
+    if (shcmd->stderr != -1) {
+        posix_spawn_file_actions_adddup2(&file_actions, shcmd->stderr, STDERR_FILENO);
+        posix_spawn_file_actions_addclose(&file_actions, shcmd->stderr);
+    }
+    if (job_control) {
+        posix_spawnattr_setpgroup(&attributes, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    if (is_interactive) {
+        fill_job_control_signals(&default_signals);
+        posix_spawnattr_setsigdefault(&attributes, &default_signals);
+        flags |= POSIX_SPAWN_SETSIGDEF;
+    }
+    posix_spawnattr_setflags(&attributes, flags);
+
+    spawn_result = posix_spawn(&child_pid, shcmd->path, &file_actions, &attributes, shcmd->command, shcmd->environment);
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&file_actions);
+    // The child has its own copies of the pipe ends now (or never will), so the parent's copies can go
+    close_stage_fds(shcmd);
+    if (spawn_result == 0) {
+        shcmd->pid = child_pid;
+        return new_ok(BLANK);
+    }
+    if (spawn_result == EAGAIN || spawn_result == ENOMEM) {
+        return new_err(spawn_result, "Spawn failure");
+    }
+    // Anything else means the program itself couldn't be executed, which the fork launcher reports as exit(-2)
+    shcmd->status = 254;
+    return new_ok(BLANK);
+}
+
+// Converts the launcher to a string, for printing purposes
+char* launcher_to_string(Launcher launch_method) {
+    if (launch_method == LAUNCH_FORK) {
+        return "fork";
+    }
+    return "spawn";
+}
+
+// Error<BLANK>
+// Picks the launcher by name, either "fork" or "spawn"
+Error set_launcher(char* name) {
+    if (strcmp(name, "fork") == 0) {
+        launcher = LAUNCH_FORK;
+    } else
+    if (strcmp(name, "spawn") == 0) {
+        launcher = LAUNCH_SPAWN;
+    } else {
+        return new_err(1, "Unknown launcher");
+    }
+    return new_ok(BLANK);
+}
+
+// Error<Job*>
+// Adds a job for a pipeline to the job table, under the lowest free job number. Its processes all start out running.
+// commands are the line's stages as they're about to be run, with their globs expanded
+Error create_job(Pipeline* pipeline, ShellCommand* commands) {
+    static Job* job;
+    Job** grown;
+    char* name_text;
+    size_t names_size, argv_length, argv_capacity;
+    int i, j, slot;
+
+    for (slot = 0; slot < job_slots && jobs[slot] != NULL; slot++) {}
+    if (slot == job_slots) {
+        grown = realloc(jobs, sizeof(Job*) * (job_slots == 0 ? 16 : job_slots * 2));
+        if (grown == NULL) {
+            return new_err(0, "Job table failed to grow");
+        }
+        jobs = grown;
+        job_slots = job_slots == 0 ? 16 : job_slots * 2;
+        for (i = slot; i < job_slots; i++) {
+            jobs[i] = NULL;
+        }
+    }
+    job = malloc(sizeof(Job));
+    if (job == NULL) {
+        return new_err(0, "Job failed to allocate");
+    }
+    job->id = slot + 1;
+    job->pgid = 0;
+    job->process_count = pipeline->command_count;
+    job->is_background = pipeline->is_background;
+    job->is_timed = pipeline->is_timed;
+    job->cgroup = NULL;
+    job->is_interrupted = 0;
+    job->is_helper = (commands[0].builtin == CACHE_RELAY);
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    // The stage names share one allocation, pointers first and the names after them
+    names_size = sizeof(char*) * job->process_count;
+    for (i = 0; i < job->process_count; i++) {
+        names_size += strlen(commands[i].word_count > 0 ? commands[i].command[0] : "") + 1;
+    }
+    job->pids = malloc(sizeof(pid_t) * job->process_count);
+    job->states = malloc(sizeof(ProcessState) * job->process_count);
+    job->statuses = malloc(sizeof(int) * job->process_count);
+    job->usages = calloc(job->process_count, sizeof(struct rusage));
+    job->finished = malloc(sizeof(struct timespec) * job->process_count);
+    job->names = malloc(names_size);
+    job->text = strdup(pipeline->text);
+    job->argv_json = NULL;
+    if (audit_enabled) {
+        argv_length = 0;
+        argv_capacity = 64;
+        job->argv_json = malloc(argv_capacity);
+        append_text(&job->argv_json, &argv_length, &argv_capacity, "[", 1);
+        for (i = 0; i < job->process_count; i++) {
+            append_text(&job->argv_json, &argv_length, &argv_capacity, i == 0 ? "[" : ",[", i == 0 ? 1 : 2);
+            for (j = 0; j < commands[i].word_count; j++) {
+                if (j > 0) {
+                    append_text(&job->argv_json, &argv_length, &argv_capacity, ",", 1);
+                }
+                append_json_string(&job->argv_json, &argv_length, &argv_capacity, commands[i].command[j]);
+            }
+            append_text(&job->argv_json, &argv_length, &argv_capacity, "]", 1);
+        }
+        append_text(&job->argv_json, &argv_length, &argv_capacity, "]", 1);
+        // If any of it failed to allocate, argv_json is NULL now, and the job is audited without its argv
+        if (job->argv_json != NULL) {
+            job->argv_json[argv_length] = '\0';
+        }
+    }
+    if (job->pids == NULL || job->states == NULL || job->statuses == NULL || job->usages == NULL
+        || job->finished == NULL || job->names == NULL || job->text == NULL) {
+        free_job(job);
+        return new_err(0, "Job failed to allocate");
+    }
+    name_text = (char*)(job->names + job->process_count);
+    for (i = 0; i < job->process_count; i++) {
+        job->pids[i] = -1;
+        job->states[i] = PROCESS_RUNNING;
+        job->statuses[i] = 0;
+        job->finished[i] = job->started;
+        job->names[i] = name_text;
+        strcpy(name_text, commands[i].word_count > 0 ? commands[i].command[0] : "");
+        name_text += strlen(name_text) + 1;
+    }
+    jobs[slot] = job;
+    return new_ok((void*)&job);
+}
+
+// Takes a job out of the job table (if it's in it) and frees it. A finished job gets its line in the audit log first
+void free_job(Job* job) {
+    if (audit_enabled && job_is_done(job)) {
+        audit_job(job);
+    }
+    // A cgroup can only go once nothing is left in it, which a job that's done can still have (like something it
+    // started in the background), in which case it stays
+    if (job->cgroup != NULL) {
+        if (job_is_done(job)) {
+            account_job(job);
+            rmdir(job->cgroup);
+        }
+        free(job->cgroup);
+    }
+    if (job->id > 0 && job->id <= job_slots && jobs[job->id - 1] == job) {
+        jobs[job->id - 1] = NULL;
+    }
+    if (current_job == job->id) {
+        current_job = 0;
+    }
+    free(job->pids);
+    free(job->states);
+    free(job->statuses);
+    free(job->usages);
+    free(job->finished);
+    free(job->names);
+    free(job->argv_json);
+    free(job->text);
+    free(job);
+}
+
+// Finds the job a job spec refers to: "%N" or "N" for job number N, or NULL for the current job.
+// Returns NULL if there is no such job
+Job* find_job(char* job_spec) {
+    int id = current_job;
+    if (job_spec != NULL) {
+        id = atoi(job_spec[0] == '%' ? job_spec + 1 : job_spec);
+    }
+    if (id <= 0 || id > job_slots) {
+        return NULL;
+    }
+    return jobs[id - 1];
+}
+
+// Returns 1 once every process of the job has finished
+int job_is_done(Job* job) {
+    int i;
+    for (i = 0; i < job->process_count; i++) {
+        if (job->states[i] != PROCESS_DONE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Returns 1 if the job has stopped: nothing in it is running, but it isn't done either
+int job_is_stopped(Job* job) {
+    int i, has_stopped = 0;
+    for (i = 0; i < job->process_count; i++) {
+        if (job->states[i] == PROCESS_RUNNING) {
+            return 0;
+        }
+        if (job->states[i] == PROCESS_STOPPED) {
+            has_stopped = 1;
+        }
+    }
+    return has_stopped;
+}
+
+// Records what the wait family said about pid in whichever job it belongs to, along with what it used if it's done.
+// Children that don't belong to a job (there shouldn't be any) are simply forgotten
+void record_child_status(pid_t pid, int wait_status, struct rusage* usage) {
+    int slot, i;
+    for (slot = 0; slot < job_slots; slot++) {
+        if (jobs[slot] == NULL) {
+            continue;
+        }
+        for (i = 0; i < jobs[slot]->process_count; i++) {
+            if (jobs[slot]->pids[i] != pid) {
+                continue;
+            }
+            if (WIFSTOPPED(wait_status)) {
+                jobs[slot]->states[i] = PROCESS_STOPPED;
+            } else
+            if (WIFCONTINUED(wait_status)) {
+                jobs[slot]->states[i] = PROCESS_RUNNING;
+            } else {
+                jobs[slot]->states[i] = PROCESS_DONE;
+                jobs[slot]->statuses[i] = decode_wait_status(wait_status);
+                if (WIFSIGNALED(wait_status) && WTERMSIG(wait_status) == SIGINT) {
+                    jobs[slot]->is_interrupted = 1;
+                }
+                jobs[slot]->usages[i] = *usage;
+                clock_gettime(CLOCK_MONOTONIC, &jobs[slot]->finished[i]);
+            }
+            return;
+        }
+    }
+}
+
+// Lets the main loop know there are children to reap. Only does async-signal-safe things
+void handle_sigchld(int signal_number) {
+    int saved_errno = errno;
+    char byte = 0;
+    write(sigchld_pipe[1], &byte, 1);
+    errno = saved_errno;
+}
+
+// Reaps every child that has finished, stopped or continued, without blocking.
+// Does nothing (not even a system call past the first read) unless SIGCHLD has arrived since last time
+void reap_children() {
+    char drain[64];
+    struct rusage usage;
+    int wait_status, has_signal = 0;
+    pid_t pid;
+
+    while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+        has_signal = 1;
+    }
+    if (!has_signal) {
+        return;
+    }
+    while ((pid = wait4(-1, &wait_status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        record_child_status(pid, wait_status, &usage);
+    }
+}
+
+// Waits for a job in the foreground, until it's done or (with job control) stopped, see await_job
+void wait_for_job(Job* job) {
+    await_job(job, 1);
+}
+
+// Waits for a job until it's done or (with job control) stopped.
+// A job that finishes is taken out of the table and its last stage's status becomes last_exit_status.
+// A job that stops is kept as a background job, and last_exit_status becomes 128 + SIGTSTP like other shells report.
+// In the foreground, the job gets the terminal (and with it ^C and ^Z) while it's waited for. Otherwise it stays
+// a background job, and ^C just stops the waiting, like wait in other shells: the job is left running,
+// last_exit_status becomes 128 + SIGINT, and -1 is returned
+int await_job(Job* job, int in_foreground) {
+    struct rusage usage;
+    struct sigaction saved_action;
+    int wait_status, i;
+    pid_t pid;
+    long long started = now_ns();
+
+    if (in_foreground) {
+        job->is_background = 0;
+        if (job_control && job->pgid != 0) {
+            tcsetpgrp(STDIN_FILENO, job->pgid);
+        }
+    } else
+    if (is_interactive) {
+        catch_interrupts(&saved_action);
+    }
+    while (!job_is_done(job) && !job_is_stopped(job)) {
+        if (!in_foreground && wait_interrupted) {
+            break;
+        }
+        // Children of other jobs can come back first. They're recorded all the same
+        pid = wait4(-1, &wait_status, job_control ? WUNTRACED : 0, &usage);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // There are no children left at all, so whatever we were waiting for is gone
+            for (i = 0; i < job->process_count; i++) {
+                if (job->states[i] != PROCESS_DONE) {
+                    job->states[i] = PROCESS_DONE;
+                    job->statuses[i] = 255;
+                }
+            }
+            break;
+        }
+        record_child_status(pid, wait_status, &usage);
+    }
+    if (in_foreground && job_control && job->pgid != 0) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+    if (!in_foreground && is_interactive) {
+        sigaction(SIGINT, &saved_action, NULL);
+    }
+    record_latency(PHASE_WAIT, now_ns() - started);
+    if (!job_is_done(job) && !job_is_stopped(job)) {
+        printf("\n");
+        last_exit_status = 128 + SIGINT;
+        last_job_interrupted = 1;
+        return -1;
+    }
+    if (job_is_stopped(job)) {
+        job->is_background = 1;
+        current_job = job->id;
+        printf("\n[%d]+  Stopped                 %s\n", job->id, job->text);
+        last_exit_status = 128 + SIGTSTP;
+        last_job_interrupted = 0;
+        return 0;
+    }
+    last_exit_status = job->statuses[job->process_count - 1];
+    last_job_interrupted = job->is_interrupted;
+    // The ^C ended up on the same line as the prompt would, so move the prompt down
+    if (is_interactive && job->is_interrupted) {
+        printf("\n");
+    }
+    if (job_wants_report(job)) {
+        report_job(job);
+    }
+    free_job(job);
+    return 0;
+}
+
+// An interactive shell ignores ^C, since it's meant for whatever has the terminal. While the shell waits on something
+// without handing the terminal over (the governor's queue, or wait), it catches it instead, with no SA_RESTART so the
+// wait ends with EINTR. wait_interrupted says whether it came. saved_action is what to put back once the wait is over
+void catch_interrupts(struct sigaction* saved_action) {
+    struct sigaction action;
+
+    wait_interrupted = 0;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_interrupt;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, saved_action);
+}
+
+// Lets whatever's waiting know ^C was pressed, see catch_interrupts
+void handle_interrupt(int signal_number) {
+    wait_interrupted = 1;
+}
+
+// Sends a signal to every process of a job: to its process group with job control, or one by one without it
+void signal_job(Job* job, int signal_number) {
+    int i;
+    if (job->pgid != 0) {
+        kill(-job->pgid, signal_number);
+        return;
+    }
+    for (i = 0; i < job->process_count; i++) {
+        if (job->pids[i] != -1 && job->states[i] != PROCESS_DONE) {
+            kill(job->pids[i], signal_number);
+        }
+    }
+}
+
+// Tells an interactive user about background jobs that have finished, and takes them out of the job table
+void notify_jobs() {
+    int slot;
+    for (slot = 0; slot < job_slots; slot++) {
+        if (jobs[slot] == NULL || !jobs[slot]->is_background || !job_is_done(jobs[slot])) {
+            continue;
+        }
+        if (is_interactive) {
+            printf("[%d]+  Done                    %s\n", jobs[slot]->id, jobs[slot]->text);
+        }
+        if (job_wants_report(jobs[slot])) {
+            report_job(jobs[slot]);
+        }
+        free_job(jobs[slot]);
+    }
+}
+
+// Returns 1 if a finished job should say what it used: it was run with time, or took longer than report_threshold
+int job_wants_report(Job* job) {
+    return job->is_timed || (report_threshold >= 0 && job_real_seconds(job) >= report_threshold);
+}
+
+// Returns how long a job ran for, from when it started to when its last stage was reaped
+double job_real_seconds(Job* job) {
+    double real = 0, stage_real;
+    int i;
+    for (i = 0; i < job->process_count; i++) {
+        stage_real = elapsed_seconds(&job->started, &job->finished[i]);
+        if (stage_real > real) {
+            real = stage_real;
+        }
+    }
+    return real;
+}
+
+// Prints what a finished job used, to stderr like time does: the real, user and system time and the peak memory
+// for the whole pipeline, then the same for each stage if there's more than one. A job reported for taking longer than
+// report_threshold (instead of being timed) is named first, since its report can come after other output
+void report_job(Job* job) {
+    struct rusage total;
+    int i;
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < job->process_count; i++) {
+        timeradd(&total.ru_utime, &job->usages[i].ru_utime, &total.ru_utime);
+        timeradd(&total.ru_stime, &job->usages[i].ru_stime, &total.ru_stime);
+        total.ru_nvcsw += job->usages[i].ru_nvcsw;
+        total.ru_nivcsw += job->usages[i].ru_nivcsw;
+        // The stages run side by side, so the pipeline's peak is (at most) the biggest of theirs
+        if (job->usages[i].ru_maxrss > total.ru_maxrss) {
+            total.ru_maxrss = job->usages[i].ru_maxrss;
+        }
+    }
+    fflush(stdout);
+    if (!job->is_timed) {
+        fprintf(stderr, "%s\n", job->text);
+    }
+    print_usage_times("", job_real_seconds(job), &total);
+    if (job->process_count > 1) {
+        for (i = 0; i < job->process_count; i++) {
+            fprintf(stderr, "stage %d: %s\n", i + 1, job->names[i]);
+            print_usage_times("  ", elapsed_seconds(&job->started, &job->finished[i]), &job->usages[i]);
+        }
+    }
+}
+
+// Prints one block of a time report, each line starting with indent
+void print_usage_times(char* indent, double real, struct rusage* usage) {
+    double user = timeval_seconds(&usage->ru_utime);
+    double sys = timeval_seconds(&usage->ru_stime);
+
+    fprintf(stderr, "%sreal\t%dm%.3fs\n", indent, (int)(real / 60), real - 60 * (int)(real / 60));
+    fprintf(stderr, "%suser\t%dm%.3fs\n", indent, (int)(user / 60), user - 60 * (int)(user / 60));
+    fprintf(stderr, "%ssys\t%dm%.3fs\n", indent, (int)(sys / 60), sys - 60 * (int)(sys / 60));
+    fprintf(stderr, "%smaxrss\t%ld KiB\n", indent, usage->ru_maxrss);
+    fprintf(stderr, "%sctxsw\t%ld voluntary, %ld involuntary\n", indent, usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+// Returns the seconds between two times from the same clock
+double elapsed_seconds(struct timespec* from, struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Returns a timeval as seconds
+double timeval_seconds(struct timeval* time) {
+    return time->tv_sec + time->tv_usec / 1e6;
+}
+
+// Returns the time on the monotonic clock in nanoseconds. It's read through the vDSO, so it costs no system call
+long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Adds one latency to the histogram of a phase
+void record_latency(Phase phase, long long nanoseconds) {
+    Histogram* histogram = &phase_histograms[phase];
+    if (nanoseconds < 0) {
+        nanoseconds = 0;
+    }
+    histogram->counts[histogram_bucket(nanoseconds)]++;
+    if (histogram->count == 0 || nanoseconds < histogram->min) {
+        histogram->min = nanoseconds;
+    }
+    if (nanoseconds > histogram->max) {
+        histogram->max = nanoseconds;
+    }
+    histogram->count++;
+    histogram->sum += nanoseconds;
+}
+
+// Returns which bucket of a histogram a value goes in
+int histogram_bucket(unsigned long long value) {
+    int top_bit;
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+    top_bit = 63 - __builtin_clzll(value);
+    return (top_bit - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+        + (int)((value >> (top_bit - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// Returns the smallest value that goes in a bucket
+long long histogram_bucket_value(int bucket) {
+    int top_bit;
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    top_bit = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    return (long long)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << (top_bit - HISTOGRAM_SUB_BITS);
+}
+
+// Returns the value that percentile percent of the recorded values are at or below, to within its bucket
+long long histogram_percentile(Histogram* histogram, double percentile) {
+    long long rank = (long long)(histogram->count * percentile / 100.0 + 0.999999), seen = 0, value;
+    int bucket;
+
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += histogram->counts[bucket];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    value = histogram_bucket_value(bucket);
+    // The exact smallest and biggest values are known, so a bucket never claims anything outside them
+    if (value < histogram->min) {
+        return histogram->min;
+    }
+    if (value > histogram->max) {
+        return histogram->max;
+    }
+    return value;
+}
+
+// Prints a table of each phase's latencies to out. As JSON, it's one object per phase with every latency in nanoseconds
+void display_stats(FILE* out, int as_json) {
+    char buffers[7][16];
+    Histogram* histogram;
+    int phase;
+
+    fflush(stdout);
+    if (as_json) {
+        for (phase = 0; phase < PHASE_COUNT; phase++) {
+            histogram = &phase_histograms[phase];
+            fprintf(out, "{\"phase\": \"%s\", \"count\": %lld, \"min_ns\": %lld, \"p50_ns\": %lld, \"p90_ns\": %lld, "
+                "\"p99_ns\": %lld, \"p999_ns\": %lld, \"max_ns\": %lld, \"mean_ns\": %.0f}\n",
+                phase_names[phase], histogram->count, histogram->min,
+                histogram_percentile(histogram, 50), histogram_percentile(histogram, 90),
+                histogram_percentile(histogram, 99), histogram_percentile(histogram, 99.9), histogram->max,
+                histogram->count == 0 ? 0 : histogram->sum / histogram->count);
+        }
+        display_parse_cache(out, 1);
+        display_directory_cache(out, 1);
+        display_output_cache(out, 1);
+        fflush(out);
+        return;
+    }
+    fprintf(out, "%-9s %8s %9s %9s %9s %9s %9s %9s %9s\n", "phase", "count", "min", "p50", "p90", "p99", "p99.9", "max", "mean");
+    for (phase = 0; phase < PHASE_COUNT; phase++) {
+        histogram = &phase_histograms[phase];
+        if (histogram->count == 0) {
+            fprintf(out, "%-9s %8d\n", phase_names[phase], 0);
+            continue;
+        }
+        fprintf(out, "%-9s %8lld %9s %9s %9s %9s %9s %9s %9s\n", phase_names[phase], histogram->count,
+            format_ns(histogram->min, buffers[0]),
+            format_ns(histogram_percentile(histogram, 50), buffers[1]),
+            format_ns(histogram_percentile(histogram, 90), buffers[2]),
+            format_ns(histogram_percentile(histogram, 99), buffers[3]),
+            format_ns(histogram_percentile(histogram, 99.9), buffers[4]),
+            format_ns(histogram->max, buffers[5]),
+            format_ns((long long)(histogram->sum / histogram->count), buffers[6]));
+    }
+    display_parse_cache(out, 0);
+    display_directory_cache(out, 0);
+    display_output_cache(out, 0);
+    fflush(out);
+}
+
+// Writes a number of nanoseconds to buffer in whichever unit reads best, and returns buffer
+char* format_ns(long long nanoseconds, char* buffer) {
+    if (nanoseconds < 1000) {
+        sprintf(buffer, "%lldns", nanoseconds);
+    } else
+    if (nanoseconds < 1000000) {
+        sprintf(buffer, "%.1fus", nanoseconds / 1e3);
+    } else
+    if (nanoseconds < 1000000000) {
+        sprintf(buffer, "%.2fms", nanoseconds / 1e6);
+    } else {
+        sprintf(buffer, "%.2fs", nanoseconds / 1e9);
+    }
+    return buffer;
+}
+
+// Converts a status from the wait family into the exit status a POSIX shell reports: the exit code, or 128 + signal
+int decode_wait_status(int wait_status) {
+    if (WIFEXITED(wait_status)) {
+        return WEXITSTATUS(wait_status);
+    }
+    if (WIFSIGNALED(wait_status)) {
+        return 128 + WTERMSIG(wait_status);
+    }
+    return 255;
+}
+
+// FNV-1a hash of a string, used to pick buckets in the shell's hash tables
+unsigned long hash_string(char* str) {
+    unsigned long hash = 14695981039346656037UL;
+    for (; *str != '\0'; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+// FNV-1a hash of length bytes, for names that aren't NUL terminated where they end (like those in a pattern)
+unsigned long hash_bytes(char* bytes, size_t length) {
+    unsigned long hash = 14695981039346656037UL;
+    size_t i;
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)bytes[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+// Fills the symbol table with the environment sish was started with, all of it exported.
+// Entries without an '=' or without a valid name can't be variables, so they're left out
+void init_variables() {
+    Variable* variable;
+    size_t length;
+    char** entry;
+
+    shell_variables.capacity = VARIABLE_TABLE_START;
+    shell_variables.slots = calloc(shell_variables.capacity, sizeof(Variable));
+    shell_variables.used = 0;
+    shell_variables.count = 0;
+    shell_variables.environment = NULL;
+    shell_variables.environment_is_stale = 1;
+    if (shell_variables.slots == NULL) {
+        shell_variables.capacity = 0;
+        return;
+    }
+    for (entry = environ; *entry != NULL; entry++) {
+        length = name_length(*entry);
+        if (length == 0 || (*entry)[length] != '=') {
+            continue;
+        }
+        variable = set_variable(*entry, length, *entry + length + 1);
+        if (variable != NULL) {
+            variable->is_exported = 1;
+        }
+    }
+}
+
+// Finds the variable whose name is the first length bytes of name, or returns NULL if it isn't set
+Variable* find_variable(char* name, size_t length) {
+    unsigned long hash = hash_bytes(name, length);
+    Variable* slot;
+    int i;
+
+    if (shell_variables.capacity == 0) {
+        return NULL;
+    }
+    // Probing stops at the first slot that has never been used. Tombstones are skipped over
+    for (i = hash & (shell_variables.capacity - 1); shell_variables.slots[i].is_used; i = (i + 1) & (shell_variables.capacity - 1)) {
+        slot = &shell_variables.slots[i];
+        if (slot->entry != NULL && slot->hash == hash && slot->name_length == length && memcmp(slot->entry, name, length) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+// Sets the variable whose name is the first length bytes of name to value, creating it if it isn't set yet.
+// A new variable isn't exported. Returns the variable, or NULL if there wasn't memory for it
+Variable* set_variable(char* name, size_t length, char* value) {
+    Variable* variable = find_variable(name, length);
+    unsigned long hash;
+    size_t value_length = strlen(value);
+    char* entry;
+    int i;
+
+    entry = malloc(length + value_length + 2);
+    if (entry == NULL) {
+        return NULL;
+    }
+    memcpy(entry, name, length);
+    entry[length] = '=';
+    memcpy(entry + length + 1, value, value_length + 1);
+    if (variable != NULL) {
+        free(variable->entry);
+        variable->entry = entry;
+        variable->value = entry + length + 1;
+        shell_variables.environment_is_stale |= variable->is_exported;
+        return variable;
+    }
+    if ((shell_variables.used + 1) * 4 > shell_variables.capacity * 3 && !grow_variables()) {
+        free(entry);
+        return NULL;
+    }
+    // A new variable goes in the first free slot, tombstone or not
+    hash = hash_bytes(name, length);
+    for (i = hash & (shell_variables.capacity - 1); shell_variables.slots[i].entry != NULL; i = (i + 1) & (shell_variables.capacity - 1));
+    variable = &shell_variables.slots[i];
+    shell_variables.used += !variable->is_used;
+    shell_variables.count++;
+    variable->entry = entry;
+    variable->value = entry + length + 1;
+    variable->name_length = length;
+    variable->hash = hash;
+    variable->is_exported = 0;
+    variable->is_used = 1;
+    return variable;
+}
+
+// Removes a variable, if it's set, leaving a tombstone in its slot
+void unset_variable(char* name) {
+    Variable* variable = find_variable(name, strlen(name));
+    if (variable == NULL) {
+        return;
+    }
+    shell_variables.environment_is_stale |= variable->is_exported;
+    free(variable->entry);
+    variable->entry = NULL;
+    variable->is_exported = 0;
+    shell_variables.count--;
+}
+
+// Moves every variable into a table twice the size (or the same size, if most of the used slots are tombstones),
+// which gets rid of the tombstones too. Returns 0 if the new table couldn't be allocated
+int grow_variables() {
+    Variable* old_slots = shell_variables.slots;
+    int old_capacity = shell_variables.capacity;
+    int capacity = old_capacity, i, j;
+
+    if (shell_variables.count * 2 >= old_capacity) {
+        capacity *= 2;
+    }
+    if (capacity == 0) {
+        capacity = VARIABLE_TABLE_START;
+    }
+    shell_variables.slots = calloc(capacity, sizeof(Variable));
+    if (shell_variables.slots == NULL) {
+        shell_variables.slots = old_slots;
+        return 0;
+    }
+    shell_variables.capacity = capacity;
+    shell_variables.used = shell_variables.count;
+    for (i = 0; i < old_capacity; i++) {
+        if (old_slots[i].entry == NULL) {
+            continue;
+        }
+        for (j = old_slots[i].hash & (capacity - 1); shell_variables.slots[j].is_used; j = (j + 1) & (capacity - 1));
+        shell_variables.slots[j] = old_slots[i];
+    }
+    free(old_slots);
+    return 1;
+}
+
+// The value of a variable, or NULL if it isn't set. The shell's own lookups (PATH, HOME) go through this
+// rather than getenv, so they see what the user set, exported or not
+char* get_variable(char* name) {
+    Variable* variable = find_variable(name, strlen(name));
+    return variable != NULL ? variable->value : NULL;
+}
+
+// Returns the envp of the exported variables, building it again first if any of them have changed since last time.
+// Entries point straight at the variables' own, so the array is all that's allocated. Returns NULL if that fails
+char** build_environment() {
+    char** environment;
+    int i, count = 0;
+
+    if (!shell_variables.environment_is_stale) {
+        return shell_variables.environment;
+    }
+    environment = malloc(sizeof(char*) * (shell_variables.count + 1));
+    if (environment == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < shell_variables.capacity; i++) {
+        if (shell_variables.slots[i].entry != NULL && shell_variables.slots[i].is_exported) {
+            environment[count++] = shell_variables.slots[i].entry;
+        }
+    }
+    environment[count] = NULL;
+    free(shell_variables.environment);
+    shell_variables.environment = environment;
+    shell_variables.environment_is_stale = 0;
+    return environment;
+}
+
+// Error<char*>
+// Finds the full path of the program a command name refers to, the same way execvp would, but remembers the answer.
+// Names containing a slash are used as they are. Fails with error code 254 (the same as a failed exec) if there is no such program
+Error resolve_command(char* name) {
+    static char* resolved;
+    char* path_variable = get_variable("PATH");
+    CachedCommand* entry, **link;
+    struct timespec mtime;
+    Error find_result;
+
+    if (strchr(name, '/') != NULL) {
+        resolved = name;
+        return new_ok((void*)&resolved);
+    }
+    if (path_variable == NULL) {
+        path_variable = "/usr/local/bin:/usr/bin:/bin";
+    }
+    // A different PATH can change the answer for every name, so nothing in the cache can be trusted anymore
+    if (command_cache_path == NULL || strcmp(command_cache_path, path_variable) != 0) {
+        clear_command_cache();
+        command_cache_path = strdup(path_variable);
+    }
+    link = &command_cache[hash_string(name) % COMMAND_CACHE_BUCKETS];
+    for (entry = *link; entry != NULL; link = &entry->next, entry = entry->next) {
+        if (strcmp(entry->name, name) != 0) {
+            continue;
+        }
+        // Something was added to or removed from the directory since we looked, so the entry may be stale
+        if (!directory_mtime(entry->path, &mtime) || mtime.tv_sec != entry->directory_mtime.tv_sec
+            || mtime.tv_nsec != entry->directory_mtime.tv_nsec) {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            break;
+        }
+        entry->hits++;
+        return new_ok((void*)&entry->path);
+    }
+
+    find_result = find_on_path(name, path_variable);
+    if (!find_result.is_ok) {
+        return find_result;
+    }
+    entry = malloc(sizeof(CachedCommand));
+    if (entry == NULL) {
+        return new_err(0, "Command cache entry failed to allocate");
+    }
+    entry->name = strdup(name);
+    entry->path = *(char**)find_result.value_ptr;
+    entry->hits = 1;
+    directory_mtime(entry->path, &entry->directory_mtime);
+    link = &command_cache[hash_string(name) % COMMAND_CACHE_BUCKETS];
+    entry->next = *link;
+    *link = entry;
+    return new_ok((void*)&entry->path);
+}
+
+// Error<char*>
+// Searches each directory of path_variable in order for an executable called name. The returned path is malloc'd
+Error find_on_path(char* name, char* path_variable) {
+    static char* found;
+    char* directory_start, *directory_end;
+    size_t directory_length, name_length = strlen(name);
+    struct stat file_info;
+
+    for (directory_start = path_variable; ; directory_start = directory_end + 1) {
+        directory_end = strchr(directory_start, ':');
+        if (directory_end == NULL) {
+            directory_end = directory_start + strlen(directory_start);
+        }
+        directory_length = directory_end - directory_start;
+        // An empty PATH entry means the current directory
+        found = malloc(directory_length + name_length + 3);
+        if (found == NULL) {
+            return new_err(0, "Path failed to allocate");
+        }
+        if (directory_length == 0) {
+            strcpy(found, ".");
+        } else {
+            memcpy(found, directory_start, directory_length);
+            found[directory_length] = '\0';
+        }
+        strcat(found, "/");
+        strcat(found, name);
+        if (stat(found, &file_info) == 0 && S_ISREG(file_info.st_mode) && access(found, X_OK) == 0) {
+            return new_ok((void*)&found);
+        }
+        free(found);
+        if (*directory_end == '\0') {
+            break;
+        }
+    }
+    return new_err(254, "Command not found");
+}
+
+// Reads the modification time of the directory a file lives in. Returns 0 if it can't be read
+int directory_mtime(char* file_path, struct timespec* mtime) {
+    struct stat directory_info;
+    char* last_slash = strrchr(file_path, '/');
+    int stat_result;
+
+    if (last_slash == NULL) {
+        stat_result = stat(".", &directory_info);
+    } else
+    if (last_slash == file_path) {
+        stat_result = stat("/", &directory_info);
+    } else {
+        *last_slash = '\0';
+        stat_result = stat(file_path, &directory_info);
+        *last_slash = '/';
+    }
+    if (stat_result == -1) {
+        return 0;
+    }
+    *mtime = directory_info.st_mtim;
+    return 1;
+}
+
+// Forgets every remembered command location
+void clear_command_cache() {
+    int i;
+    CachedCommand* entry, *next;
+    for (i = 0; i < COMMAND_CACHE_BUCKETS; i++) {
+        for (entry = command_cache[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+        command_cache[i] = NULL;
+    }
+    free(command_cache_path);
+    command_cache_path = NULL;
+}
+
+// Lists every remembered command location, along with how many times it has been used
+void display_command_cache() {
+    int i, is_empty = 1;
+    CachedCommand* entry;
+    for (i = 0; i < COMMAND_CACHE_BUCKETS; i++) {
+        for (entry = command_cache[i]; entry != NULL; entry = entry->next) {
+            if (is_empty) {
+                printf("hits\tcommand\n");
+                is_empty = 0;
+            }
+            printf("%4d\t%s\n", entry->hits, entry->path);
+        }
+    }
+    if (is_empty) {
+        printf("hash: hash table empty\n");
+    }
+}
+
+// Brings the command index up to date before it's used: builds it the first time, rebuilds it if PATH changed or
+// inotify lost track, and otherwise only applies whatever inotify saw happen to the PATH directories since last time
+void update_command_index() {
+    char* path_variable = get_variable("PATH");
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event* event;
+    struct stat directory_info;
+    ssize_t read_result;
+    char* p;
+    int i;
+
+    if (path_variable == NULL) {
+        path_variable = "/usr/local/bin:/usr/bin:/bin";
+    }
+    if (!command_index.is_built || strcmp(command_index.path, path_variable) != 0) {
+        build_command_index(path_variable);
+        return;
+    }
+    // Directories that couldn't be watched are checked the old fashioned way. Most often they don't exist at all,
+    // which counts as an mtime of 0
+    for (i = 0; i < command_index.directory_count; i++) {
+        if (command_index.watches[i] != -1) {
+            continue;
+        }
+        if (stat(command_index.directories[i], &directory_info) == -1) {
+            memset(&directory_info.st_mtim, 0, sizeof(directory_info.st_mtim));
+        }
+        if (directory_info.st_mtim.tv_sec != command_index.mtimes[i].tv_sec
+            || directory_info.st_mtim.tv_nsec != command_index.mtimes[i].tv_nsec) {
+            command_index.is_stale = 1;
+        }
+    }
+    while (command_index.inotify_fd != -1 && !command_index.is_stale
+        && (read_result = read(command_index.inotify_fd, events, sizeof(events))) > 0) {
+        for (p = events; p < events + read_result; p += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event*)p;
+            // Events were lost, or a whole directory went away (or was moved, or unmounted), so start over
+            if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                command_index.is_stale = 1;
+                continue;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+            // The same directory can be on PATH twice (or through a symlink), and then both share one watch
+            for (i = 0; i < command_index.directory_count; i++) {
+                if (command_index.watches[i] == event->wd) {
+                    index_command(i, event->name);
+                }
+            }
+        }
+    }
+    if (command_index.is_stale) {
+        build_command_index(path_variable);
+    }
+}
+
+// Throws away the command index and reads every directory of path_variable into a new one
+void build_command_index(char* path_variable) {
+    char* directory_start, *directory_end, *directory;
+    size_t directory_length;
+    struct stat directory_info;
+    struct dirent* entry;
+    DIR* dir;
+    int i;
+
+    free_command_index();
+    command_index.path = strdup(path_variable);
+    if (command_index.path == NULL) {
+        return;
+    }
+    command_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    command_index.is_built = 1;
+    for (directory_start = path_variable; ; directory_start = directory_end + 1) {
+        directory_end = strchr(directory_start, ':');
+        if (directory_end == NULL) {
+            directory_end = directory_start + strlen(directory_start);
+        }
+        directory_length = directory_end - directory_start;
+        // Relative directories (including the empty one, which means the current directory) change with cd,
+        // so they're left out
+        if (directory_length > 0 && *directory_start == '/' && command_index.directory_count < COMMAND_INDEX_DIRECTORIES
+            && (directory = strndup(directory_start, directory_length)) != NULL) {
+            i = command_index.directory_count++;
+            command_index.directories[i] = directory;
+            // The watch goes on before the directory is read, so nothing that turns up in between is missed
+            command_index.watches[i] = -1;
+            if (command_index.inotify_fd != -1) {
+                command_index.watches[i] = inotify_add_watch(command_index.inotify_fd, directory,
+                    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+            }
+            if (stat(directory, &directory_info) == -1) {
+                memset(&directory_info.st_mtim, 0, sizeof(directory_info.st_mtim));
+            }
+            command_index.mtimes[i] = directory_info.st_mtim;
+            dir = opendir(directory);
+            while (dir != NULL && (entry = readdir(dir)) != NULL) {
+                if (entry->d_type != DT_DIR) {
+                    index_command(i, entry->d_name);
+                }
+            }
+            if (dir != NULL) {
+                closedir(dir);
+            }
+        }
+        if (*directory_end == '\0') {
+            break;
+        }
+    }
+}
+
+// Forgets the command index, so the next completion builds it again
+void free_command_index() {
+    int i;
+    if (!command_index.is_built) {
+        return;
+    }
+    free_trie(command_index.root);
+    for (i = 0; i < command_index.directory_count; i++) {
+        free(command_index.directories[i]);
+    }
+    if (command_index.inotify_fd != -1) {
+        close(command_index.inotify_fd);
+    }
+    free(command_index.path);
+    memset(&command_index, 0, sizeof(command_index));
+}
+
+// Looks at name in the index's directory number directory, and records in the trie whether it's a program that can be run
+// from there, the same way find_on_path would decide
+void index_command(int directory, char* name) {
+    char file_path[PATH_MAX];
+    struct stat file_info;
+    CommandTrieNode* node;
+    int is_program;
+
+    if (snprintf(file_path, sizeof(file_path), "%s/%s", command_index.directories[directory], name) >= (int)sizeof(file_path)) {
+        return;
+    }
+    is_program = stat(file_path, &file_info) == 0 && S_ISREG(file_info.st_mode) && access(file_path, X_OK) == 0;
+    node = find_trie_node(&command_index.root, name, is_program);
+    if (node == NULL) {
+        return;
+    }
+    if (is_program) {
+        node->directories |= 1ULL << directory;
+    } else {
+        node->directories &= ~(1ULL << directory);
+    }
+}
+
+// Walks down the trie from level, one letter of name at a time, and returns the node for the whole of name.
+// Missing nodes are made along the way if should_create is set, otherwise NULL is returned
+CommandTrieNode* find_trie_node(CommandTrieNode** level, char* name, int should_create) {
+    CommandTrieNode* node = NULL, **link;
+
+    for (; *name != '\0'; name++) {
+        link = level;
+        while (*link != NULL && (unsigned char)(*link)->letter < (unsigned char)*name) {
+            link = &(*link)->sibling;
+        }
+        if (*link == NULL || (*link)->letter != *name) {
+            if (!should_create) {
+                return NULL;
+            }
+            node = malloc(sizeof(CommandTrieNode));
+            if (node == NULL) {
+                return NULL;
+            }
+            node->letter = *name;
+            node->directories = 0;
+            node->child = NULL;
+            node->sibling = *link;
+            *link = node;
+        }
+        node = *link;
+        level = &node->child;
+    }
+    return node;
+}
+
+// Adds every program at or below node and its siblings to completions. name holds the depth letters above node
+void collect_commands(CommandTrieNode* node, char* name, int depth, NameList* completions) {
+    for (; node != NULL && depth < NAME_MAX; node = node->sibling) {
+        name[depth] = node->letter;
+        name[depth + 1] = '\0';
+        if (node->directories != 0) {
+            add_name(completions, name);
+        }
+        collect_commands(node->child, name, depth + 1, completions);
+    }
+}
+
+// Frees a trie node, everything below it and all of its later siblings
+void free_trie(CommandTrieNode* node) {
+    CommandTrieNode* next;
+    for (; node != NULL; node = next) {
+        next = node->sibling;
+        free_trie(node->child);
+        free(node);
+    }
+}
+
+// Error<BLANK>
+// Expands a stage's words for this run of it: every word with a pattern has its expansions substituted and its globs
+// replaced by every path they match, in sorted order (a glob that matches nothing stays as it is). The stage's new words
+// come from arena, and the parsed line the old ones belong to is left alone. The expanded command name can turn it into
+// a builtin (or out of one), so that's checked again. This is also where the stage gets its environment: the shell's,
+// or a copy of it with the stage's assignments on top
+Error expand_words(ShellCommand* shcmd, Arena* arena) {
+    NameList words = {NULL, 0, 0};
+    char** expanded, **environment, **assignment_patterns;
+    char* assignment;
+    size_t length;
+    int i, j, environment_count, is_copied;
+
+    if (shcmd->patterns != NULL) {
+        // ASSIGN's words are all NAME=VALUE, and values are never split or globbed
+        for (i = 0; i < shcmd->word_count; i++) {
+            if (shcmd->patterns[i] == NULL) {
+                add_name(&words, shcmd->command[i]);
+            } else {
+                expand_word(shcmd->patterns[i], &words, shcmd->builtin != ASSIGN);
+            }
+        }
+        expanded = arena_alloc(arena, sizeof(char*) * (words.count + 1));
+        for (i = 0; expanded != NULL && i < words.count; i++) {
+            length = strlen(words.matches[i]) + 1;
+            expanded[i] = arena_alloc(arena, length);
+            if (expanded[i] == NULL) {
+                expanded = NULL;
+                break;
+            }
+            memcpy(expanded[i], words.matches[i], length);
+        }
+        if (expanded == NULL) {
+            free_names(&words);
+            return new_err(0, "Word expansion failed to allocate");
+        }
+        expanded[words.count] = NULL;
+        if (shcmd->builtin != ASSIGN && words.count > 0 && shcmd->patterns[0] != NULL) {
+            shcmd->builtin = parse(expanded[0]);
+        }
+        // A command whose words all expanded to nothing does nothing, like a command of nothing but redirects
+        if (words.count == 0 && shcmd->builtin != ASSIGN) {
+            shcmd->builtin = TRUE;
+        }
+        free_names(&words);
+        // The assignments' patterns are right before the command's
+        assignment_patterns = shcmd->patterns - shcmd->assignment_count;
+        shcmd->command = expanded;
+        shcmd->word_count = words.count;
+        shcmd->patterns = NULL;
+        // The assignments are only copied if one of them has something to expand
+        for (i = 0, is_copied = 0; i < shcmd->assignment_count; i++) {
+            if (assignment_patterns[i] != NULL) {
+                if (!is_copied) {
+                    is_copied = 1;
+                    expanded = arena_alloc(arena, sizeof(char*) * shcmd->assignment_count);
+                    if (expanded == NULL) {
+                        return new_err(0, "Word expansion failed to allocate");
+                    }
+                    memcpy(expanded, shcmd->assignments, sizeof(char*) * shcmd->assignment_count);
+                    shcmd->assignments = expanded;
+                }
+                shcmd->assignments[i] = expand_single_word(assignment_patterns[i], arena);
+                if (shcmd->assignments[i] == NULL) {
+                    return new_err(0, "Word expansion failed to allocate");
+                }
+            }
+        }
+    }
+    if ((shcmd->input_pattern != NULL && (shcmd->input_file = expand_single_word(shcmd->input_pattern, arena)) == NULL)
+        || (shcmd->output_pattern != NULL && (shcmd->output_file = expand_single_word(shcmd->output_pattern, arena)) == NULL)
+        || (shcmd->error_pattern != NULL && (shcmd->error_file = expand_single_word(shcmd->error_pattern, arena)) == NULL)) {
+        return new_err(0, "Word expansion failed to allocate");
+    }
+    shcmd->environment = build_environment();
+    if (shcmd->environment == NULL) {
+        return new_err(0, "Environment failed to allocate");
+    }
+    if (shcmd->assignment_count == 0) {
+        return new_ok(BLANK);
+    }
+    // Each assignment either takes the place of the variable it names or goes on the end
+    for (environment_count = 0; shcmd->environment[environment_count] != NULL; environment_count++);
+    environment = arena_alloc(arena, sizeof(char*) * (environment_count + shcmd->assignment_count + 1));
+    if (environment == NULL) {
+        return new_err(0, "Environment failed to allocate");
+    }
+    memcpy(environment, shcmd->environment, sizeof(char*) * environment_count);
+    for (i = 0; i < shcmd->assignment_count; i++) {
+        assignment = shcmd->assignments[i];
+        length = strchr(assignment, '=') - assignment + 1;
+        for (j = 0; j < environment_count && strncmp(environment[j], assignment, length) != 0; j++);
+        environment[j] = assignment;
+        environment_count += (j == environment_count);
+    }
+    environment[environment_count] = NULL;
+    shcmd->environment = environment;
+    return new_ok(BLANK);
+}
+
+// Expands one word's pattern (see append_pattern and lex_expansion) into fields. An expansion in double quotes becomes
+// part of the word as it is. One that isn't is split into more words wherever it has blanks, and can have globs in it,
+// like in other shells. Every field with globs in it is globbed, and everything else just has its escapes taken out.
+// With is_split 0, nothing is split or globbed, and the word always becomes exactly one field
+void expand_word(char* pattern, NameList* fields, int is_split) {
+    static char* field = NULL;
+    static size_t capacity = 0;
+    size_t length = 0;
+    int has_field = 0, is_quoted;
+    char number[24];
+    char* p, *name, *value, *end;
+    char escaped[2] = {'\\', '\0'};
+
+    if (field == NULL) {
+        capacity = 256;
+        field = malloc(capacity);
+        if (field == NULL) {
+            return;
+        }
+    }
+    for (p = pattern; *p != '\0'; ) {
+        if (*p != '$') {
+            // An escape goes along with the character it escapes
+            append_text(&field, &length, &capacity, p, (*p == '\\' && p[1] != '\0') ? 2 : 1);
+            p += (*p == '\\' && p[1] != '\0') ? 2 : 1;
+            has_field = 1;
+            continue;
+        }
+        is_quoted = (p[1] == 'q');
+        name = p + 2;
+        end = strchr(name, '}');
+        value = variable_value(name, end - name, number);
+        p = end + 1;
+        has_field |= is_quoted;
+        for (; *value != '\0'; value++) {
+            if (is_split && !is_quoted && (*value == ' ' || *value == '\t' || *value == '\n')) {
+                if (has_field) {
+                    append_text(&field, &length, &capacity, "", 1);
+                    add_field(fields, field, 1);
+                    length = 0;
+                    has_field = 0;
+                }
+                continue;
+            }
+            // Only unquoted expansions in words that get globbed can add glob characters
+            if (*value == '\\' || *value == '$' || ((is_quoted || !is_split) && strchr("*?[]", *value) != NULL)) {
+                append_text(&field, &length, &capacity, escaped, 1);
+            }
+            append_text(&field, &length, &capacity, value, 1);
+            has_field = 1;
+        }
+    }
+    if (has_field || !is_split) {
+        append_text(&field, &length, &capacity, "", 1);
+        add_field(fields, field, is_split);
+    }
+}
+
+// Adds one field of an expanded word to fields: every path it matches if it's a glob that matches anything,
+// and otherwise the field itself, without its escapes. field is the field's pattern, and gets written over
+void add_field(NameList* fields, char* field, int should_glob) {
+    NameList matches = {NULL, 0, 0};
+    char* from, *to;
+    int i;
+
+    if (should_glob && has_glob_characters(field)) {
+        glob_pattern(field, &matches);
+        for (i = 0; i < matches.count; i++) {
+            add_name(fields, matches.matches[i]);
+        }
+        free_names(&matches);
+        if (i > 0) {
+            return;
+        }
+    }
+    for (from = field, to = field; *from != '\0'; from++) {
+        if (*from == '\\' && from[1] != '\0') {
+            from++;
+        }
+        *to++ = *from;
+    }
+    *to = '\0';
+    add_name(fields, field);
+}
+
+// Expands a word that can only ever be one word (a redirect's file name, or an assignment) into arena.
+// Returns NULL if arena runs out
+char* expand_single_word(char* pattern, Arena* arena) {
+    NameList fields = {NULL, 0, 0};
+    char* word = NULL;
+    size_t length;
+
+    expand_word(pattern, &fields, 0);
+    if (fields.count == 1) {
+        length = strlen(fields.matches[0]) + 1;
+        word = arena_alloc(arena, length);
+        if (word != NULL) {
+            memcpy(word, fields.matches[0], length);
+        }
+    }
+    free_names(&fields);
+    return word;
+}
+
+// The value of the variable whose name is the first length bytes of name. $? and $$ are written into number,
+// and anything that isn't set is empty
+char* variable_value(char* name, size_t length, char* number) {
+    Variable* variable;
+
+    if (length == 1 && name[0] == '?') {
+        sprintf(number, "%d", last_exit_status);
+        return number;
+    }
+    if (length == 1 && name[0] == '$') {
+        sprintf(number, "%d", (int)getpid());
+        return number;
+    }
+    variable = find_variable(name, length);
+    return variable != NULL ? variable->value : "";
+}
+
+// Adds every path matching pattern to matches, sorted. A pattern is a path whose parts can have *, ? and [...] in them,
+// with \ escaping any of those. A part that's just ** matches any number of directories, including none.
+// Like other shells, hidden files are only matched by a part starting with a dot
+void glob_pattern(char* pattern, NameList* matches) {
+    char path[PATH_MAX];
+    size_t path_length = 0;
+
+    if (*pattern == '/') {
+        path[path_length++] = '/';
+    }
+    glob_directory(path, path_length, pattern, matches);
+    if (matches->count > 1) {
+        qsort(matches->matches, matches->count, sizeof(char*), compare_strings);
+    }
+}
+
+// Matches pattern against what's in the directory at path, which is path_length bytes long (empty for the current
+// directory) and ends in a slash. Every match goes in matches, and every directory that matches a part before the last
+// has the rest of the pattern matched against it the same way. path has room for PATH_MAX bytes
+void glob_directory(char* path, size_t path_length, char* pattern, NameList* matches) {
+    char part[PATH_MAX];
+    char* slash, *rest, *entry, *name, *p;
+    size_t part_length, name_length;
+    DirectoryListing* listing;
+    struct stat file_info;
+    int is_directory;
+
+    while (*pattern == '/') {
+        pattern++;
+    }
+    // The pattern ended in a slash, so what got us here has to be a directory, and it is one
+    if (*pattern == '\0') {
+        path[path_length] = '\0';
+        add_name(matches, path);
+        return;
+    }
+    slash = strchr(pattern, '/');
+    rest = slash == NULL ? NULL : slash + 1;
+    part_length = slash == NULL ? strlen(pattern) : (size_t)(slash - pattern);
+    if (part_length >= sizeof(part)) {
+        return;
+    }
+    memcpy(part, pattern, part_length);
+    part[part_length] = '\0';
+
+    // A part without glob characters only needs checking, not listing
+    if (!has_glob_characters(part)) {
+        for (p = part; *p != '\0' && path_length < PATH_MAX - 2; p++) {
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+            }
+            path[path_length++] = *p;
+        }
+        path[path_length] = '\0';
+        if (rest == NULL) {
+            if (lstat(path, &file_info) == 0) {
+                add_name(matches, path);
+            }
+        } else
+        if (stat(path, &file_info) == 0 && S_ISDIR(file_info.st_mode)) {
+            path[path_length] = '/';
+            glob_directory(path, path_length + 1, rest, matches);
+        }
+        return;
+    }
+
+    path[path_length] = '\0';
+    listing = find_directory_listing(path_length == 0 ? "." : path);
+    if (listing == NULL) {
+        return;
+    }
+    // ** matches this directory itself, and then every directory below it gets the whole pattern again.
+    // A ** at the end matches everything below here. Symlinks aren't followed, so links can't send this round in circles
+    if (strcmp(part, "**") == 0) {
+        glob_directory(path, path_length, rest == NULL ? "*" : rest, matches);
+    }
+    for (entry = listing->names; entry < listing->names + listing->size; entry = name + name_length + 1) {
+        name = entry + 1;
+        name_length = strlen(name);
+        if (path_length + name_length + 2 > PATH_MAX) {
+            continue;
+        }
+        if (strcmp(part, "**") == 0) {
+            if (name[0] == '.') {
+                continue;
+            }
+            memcpy(path + path_length, name, name_length + 1);
+            is_directory = (unsigned char)entry[0] == DT_DIR;
+            if ((unsigned char)entry[0] == DT_UNKNOWN && lstat(path, &file_info) == 0) {
+                is_directory = S_ISDIR(file_info.st_mode);
+            }
+            if (is_directory) {
+                path[path_length + name_length] = '/';
+                glob_directory(path, path_length + name_length + 1, pattern, matches);
+            }
+            continue;
+        }
+        if (fnmatch(part, name, FNM_PERIOD) != 0) {
+            continue;
+        }
+        memcpy(path + path_length, name, name_length + 1);
+        if (rest == NULL) {
+            add_name(matches, path);
+            continue;
+        }
+        // Only directories can have the rest of the pattern matched in them. d_type usually says which entries are,
+        // so only symlinks (and file systems that don't fill d_type in) need a stat
+        is_directory = (unsigned char)entry[0] == DT_DIR;
+        if (((unsigned char)entry[0] == DT_LNK || (unsigned char)entry[0] == DT_UNKNOWN) && stat(path, &file_info) == 0) {
+            is_directory = S_ISDIR(file_info.st_mode);
+        }
+        if (is_directory) {
+            path[path_length + name_length] = '/';
+            glob_directory(path, path_length + name_length + 1, rest, matches);
+        }
+    }
+    release_directory_listing(listing);
+}
+
+// Returns 1 if text has a *, ? or [ in it that isn't escaped
+int has_glob_characters(char* text) {
+    for (; *text != '\0'; text++) {
+        if (*text == '\\' && text[1] != '\0') {
+            text++;
+        } else
+        if (*text == '*' || *text == '?' || *text == '[') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns the listing of the directory at path, from the directory cache if the directory hasn't changed since it was
+// cached, or read afresh (and cached) if it has. Returns NULL if it isn't a directory that can be read.
+// The listing has to be given back with release_directory_listing
+DirectoryListing* find_directory_listing(char* path) {
+    DirectoryListing* listing;
+    struct stat directory_info;
+
+    if (stat(path, &directory_info) == -1 || !S_ISDIR(directory_info.st_mode)) {
+        return NULL;
+    }
+    for (listing = directory_cache_newest; listing != NULL; listing = listing->older) {
+        if (listing->device != directory_info.st_dev || listing->inode != directory_info.st_ino) {
+            continue;
+        }
+        if (listing->mtime.tv_sec != directory_info.st_mtim.tv_sec || listing->mtime.tv_nsec != directory_info.st_mtim.tv_nsec) {
+            unlink_directory_listing(listing);
+            break;
+        }
+        directory_cache_hits++;
+        // Move it to the newest end
+        if (listing != directory_cache_newest) {
+            listing->newer->older = listing->older;
+            if (listing->older != NULL) {
+                listing->older->newer = listing->newer;
+            } else {
+                directory_cache_oldest = listing->newer;
+            }
+            listing->newer = NULL;
+            listing->older = directory_cache_newest;
+            directory_cache_newest->newer = listing;
+            directory_cache_newest = listing;
+        }
+        listing->users++;
+        return listing;
+    }
+    directory_cache_misses++;
+    listing = read_directory(path, &directory_info);
+    if (listing == NULL || !listing->is_cached) {
+        return listing;
+    }
+    listing->newer = NULL;
+    listing->older = directory_cache_newest;
+    if (directory_cache_newest != NULL) {
+        directory_cache_newest->newer = listing;
+    } else {
+        directory_cache_oldest = listing;
+    }
+    directory_cache_newest = listing;
+    directory_cache_count++;
+    directory_cache_bytes += listing->size;
+    while (directory_cache_oldest != listing
+        && (directory_cache_count > DIRECTORY_CACHE_SIZE || directory_cache_bytes > DIRECTORY_CACHE_BYTES)) {
+        unlink_directory_listing(directory_cache_oldest);
+    }
+    return listing;
+}
+
+// Reads every entry of the directory at path (which directory_info describes) into a new listing, in use once.
+// getdents64 hands over as many entries as fit in its buffer each call, with their d_types, so even a directory
+// of a hundred thousand files takes a few dozen system calls and no stats.
+// Returns NULL if the directory can't be read in full, since a listing missing entries would be wrong for as long as
+// it was cached
+DirectoryListing* read_directory(char* path, struct stat* directory_info) {
+    static char* buffer = NULL;
+    DirectoryListing* listing;
+    struct dirent64* entry;
+    struct timespec now;
+    size_t capacity = 4096, grown_capacity, name_length;
+    ssize_t read_result, offset;
+    char* grown;
+    int fd;
+
+    if (buffer == NULL) {
+        buffer = malloc(GETDENTS_BUFFER_SIZE);
+        if (buffer == NULL) {
+            return NULL;
+        }
+    }
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    listing = malloc(sizeof(DirectoryListing));
+    if (listing == NULL || (listing->names = malloc(capacity)) == NULL) {
+        free(listing);
+        close(fd);
+        return NULL;
+    }
+    listing->size = 0;
+    listing->count = 0;
+    while ((read_result = getdents64(fd, buffer, GETDENTS_BUFFER_SIZE)) > 0) {
+        for (offset = 0; offset < read_result; offset += entry->d_reclen) {
+            entry = (struct dirent64*)(buffer + offset);
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            name_length = strlen(entry->d_name);
+            if (listing->size + name_length + 2 > capacity) {
+                for (grown_capacity = capacity * 2; listing->size + name_length + 2 > grown_capacity; grown_capacity *= 2) {}
+                grown = realloc(listing->names, grown_capacity);
+                if (grown == NULL) {
+                    read_result = -1;
+                    break;
+                }
+                listing->names = grown;
+                capacity = grown_capacity;
+            }
+            listing->names[listing->size] = entry->d_type;
+            memcpy(listing->names + listing->size + 1, entry->d_name, name_length + 1);
+            listing->size += name_length + 2;
+            listing->count++;
+        }
+        if (read_result == -1) {
+            break;
+        }
+    }
+    close(fd);
+    if (read_result == -1) {
+        free(listing->names);
+        free(listing);
+        return NULL;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    listing->device = directory_info->st_dev;
+    listing->inode = directory_info->st_ino;
+    listing->mtime = directory_info->st_mtim;
+    listing->users = 1;
+    listing->is_cached = now.tv_sec - directory_info->st_mtim.tv_sec > 1;
+    return listing;
+}
+
+// Gives back a listing from find_directory_listing. A listing that's no longer cached goes once nobody's using it
+void release_directory_listing(DirectoryListing* listing) {
+    listing->users--;
+    if (listing->users == 0 && !listing->is_cached) {
+        free(listing->names);
+        free(listing);
+    }
+}
+
+// Takes a listing out of the directory cache. It's freed now if nobody's using it, or otherwise once they're done
+void unlink_directory_listing(DirectoryListing* listing) {
+    if (listing->newer != NULL) {
+        listing->newer->older = listing->older;
+    } else {
+        directory_cache_newest = listing->older;
+    }
+    if (listing->older != NULL) {
+        listing->older->newer = listing->newer;
+    } else {
+        directory_cache_oldest = listing->newer;
+    }
+    directory_cache_count--;
+    directory_cache_bytes -= listing->size;
+    listing->is_cached = 0;
+    if (listing->users == 0) {
+        free(listing->names);
+        free(listing);
+    }
+}
+
+// Shows how well the directory cache is doing, for stats
+void display_directory_cache(FILE* out, int as_json) {
+    if (as_json) {
+        fprintf(out, "{\"cache\": \"directory\", \"hits\": %lld, \"misses\": %lld, \"entries\": %d, \"bytes\": %zu}\n",
+            directory_cache_hits, directory_cache_misses, directory_cache_count, directory_cache_bytes);
+        return;
+    }
+    fprintf(out, "directory cache: %lld hits, %lld misses, %d directories (%zu bytes of names) kept\n",
+        directory_cache_hits, directory_cache_misses, directory_cache_count, directory_cache_bytes);
+}
+
+// uses chdir() system call to execute cd command, if invalid it will return the error
+Error cd(char *dir) {
+    if (chdir(dir) == -1) {
+        return new_err(0, "Directory not found.");
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// exit [N]: stops the shell. "exit N" makes the shell's own exit status N
+Error builtin_exit(int word_count, char** words, int* status, int* should_continue) {
+    // Tell the sish command to stop looping
+    *should_continue = 0;
+    *status = last_exit_status;
+    if (word_count > 1) {
+        *status = atoi(words[1]) & 255;
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// cd [DIR]: changes directory, to the user's home directory if no directory is provided
+Error builtin_cd(int word_count, char** words, int* status, int* should_continue) {
+    Error cd_result;
+    if (word_count == 1) {
+        char *home = get_variable("HOME");
+        cd_result = cd(home);
+    } else {
+        cd_result = cd(words[1]);
+    }
+    if (!cd_result.is_ok) {
+        if (cd_result.error_code != 0) {
+            return cd_result;
+        }
+        // In this case, we know this is a directory not found error, which is recoverable
+        printf("Directory not found.\n");
+        *status = 1;
+    } else
+    if (audit_enabled) {
+        free(audit_cwd);
+        audit_cwd = getcwd(NULL, 0);
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// history [-c | -s PATTERN | N]: lists, clears, searches or reruns the history
+Error builtin_history(int word_count, char** words, int* status, int* should_continue) {
+    Error replay_result;
+    int command_offset;
+    char *endptr;
+
+    if (word_count == 1) {
+        // Occurs if the input is simply "history"
+        // In this case, we list all entries in history
+        display_history();
+    } else
+    if (strcmp(words[1], "-c") == 0) {
+        // Occurs if the input is simply "history -c"
+        // In this case, we clear the history
+        clear_history();
+    } else
+    if (strcmp(words[1], "-s") == 0) {
+        // Occurs if the input is "history -s X", in which case we list every entry containing X
+        if (word_count < 3) {
+            printf("history -s needs something to search for\n");
+            *status = 2;
+        } else {
+            search_history(words[2]);
+        }
+    } else {
+        // Occurs if the input is "history X", but we don't yet know what X is
+        // We need to try and convert the second argument to an integer
+        // Otherwise, there is invalid input and we need to return an error
+        *status = 1;
+        command_offset = strtol(words[1], &endptr, 10);
+        if (*endptr != '\0') {
+            // If this is the case, then the conversion failed
+            printf("Not a valid history index (not a number)\n");
+        } else
+        // Offset is a valid number. We need to do boundary checking
+        if (command_offset < 0) {
+            printf("Not a valid history index (must be greater than 0)\n");
+        } else
+        if (command_offset >= history_length()) {
+            printf("Not a valid history index (must exist in the history)\n");
+        } else {
+            // This is a valid index, so we can just call it
+            replay_result = handle_input(history_entry(command_offset), should_continue);
+            *status = last_exit_status;
+            return replay_result;
+        }
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// launcher [fork | spawn]: says which launcher is in use, or switches to another one
+Error builtin_launcher(int word_count, char** words, int* status, int* should_continue) {
+    if (word_count == 1) {
+        printf("%s\n", launcher_to_string(launcher));
+    } else
+    if (!set_launcher(words[1]).is_ok) {
+        printf("Unknown launcher: %s (expected fork or spawn)\n", words[1]);
+        *status = 2;
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// hash [-r | NAME...]: lists the remembered command locations, forgets them, or looks names up ahead of time
+Error builtin_hash(int word_count, char** words, int* status, int* should_continue) {
+    int i;
+    if (word_count == 1) {
+        display_command_cache();
+    } else
+    if (strcmp(words[1], "-r") == 0) {
+        clear_command_cache();
+    } else {
+        for (i = 1; i < word_count; i++) {
+            if (!resolve_command(words[i]).is_ok) {
+                printf("hash: %s: not found\n", words[i]);
+                *status = 1;
+            }
+        }
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// echo [-n] [WORD...]: prints its words separated by spaces. -n leaves off the newline
+Error builtin_echo(int word_count, char** words, int* status, int* should_continue) {
+    int i = 1, has_newline = 1;
+    if (word_count > 1 && strcmp(words[1], "-n") == 0) {
+        has_newline = 0;
+        i++;
+    }
+    for (; i < word_count; i++) {
+        fputs(words[i], stdout);
+        if (i < word_count - 1) {
+            putchar(' ');
+        }
+    }
+    if (has_newline) {
+        putchar('\n');
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// pwd: prints the current directory
+Error builtin_pwd(int word_count, char** words, int* status, int* should_continue) {
+    char* directory = getcwd(NULL, 0);
+    if (directory == NULL) {
+        printf("pwd: %s\n", strerror(errno));
+        *status = 1;
+        return new_ok(BLANK);
+    }
+    printf("%s\n", directory);
+    free(directory);
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// true: does nothing, successfully
+Error builtin_true(int word_count, char** words, int* status, int* should_continue) {
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// false: does nothing, unsuccessfully
+Error builtin_false(int word_count, char** words, int* status, int* should_continue) {
+    *status = 1;
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// printf FORMAT [ARGUMENT...]: prints the arguments according to FORMAT, like printf(1).
+// Supports the backslash escapes \\n \\t \\r \\a \\\\ and the conversions %s %c %d %i %u %o %x %X %e %f %g with flags, width and precision.
+// Like printf(1), the format is used again for as long as there are arguments left over
+Error builtin_printf(int word_count, char** words, int* status, int* should_continue) {
+    char spec[64];
+    char* p, *argument;
+    size_t spec_length;
+    int next_argument = 2, used_argument;
+
+    if (word_count < 2) {
+        printf("printf: usage: printf format [arguments]\n");
+        *status = 2;
+        return new_ok(BLANK);
+    }
+    do {
+        used_argument = 0;
+        for (p = words[1]; *p != '\0'; p++) {
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+                if (*p == 'n') {
+                    putchar('\n');
+                } else
+                if (*p == 't') {
+                    putchar('\t');
+                } else
+                if (*p == 'r') {
+                    putchar('\r');
+                } else
+                if (*p == 'a') {
+                    putchar('\a');
+                } else
+                if (*p == '\\') {
+                    putchar('\\');
+                } else {
+                    putchar('\\');
+                    putchar(*p);
+                }
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p);
+                continue;
+            }
+            // Copy the conversion (flags, width and precision included) so the real printf can do the work
+            spec_length = 1 + strspn(p + 1, "-+ #0123456789.");
+            if (p[spec_length] == '%') {
+                putchar('%');
+                p += spec_length;
+                continue;
+            }
+            if (p[spec_length] == '\0' || spec_length + 3 >= sizeof(spec)) {
+                fputs(p, stdout);
+                break;
+            }
+            memcpy(spec, p, spec_length);
+            argument = "";
+            if (next_argument < word_count) {
+                argument = words[next_argument++];
+                used_argument = 1;
+            }
+            if (strchr("diouxX", p[spec_length]) != NULL) {
+                // Every integer is printed as a long long, so it needs the ll length modifier
+                spec[spec_length] = 'l';
+                spec[spec_length + 1] = 'l';
+                spec[spec_length + 2] = p[spec_length];
+                spec[spec_length + 3] = '\0';
+                if (p[spec_length] == 'd' || p[spec_length] == 'i') {
+                    printf(spec, strtoll(argument, NULL, 0));
+                } else {
+                    printf(spec, strtoull(argument, NULL, 0));
+                }
+            } else {
+                spec[spec_length] = p[spec_length];
+                spec[spec_length + 1] = '\0';
+                if (strchr("eEfFgG", p[spec_length]) != NULL) {
+                    printf(spec, strtod(argument, NULL));
+                } else
+                if (p[spec_length] == 'c') {
+                    printf(spec, argument[0]);
+                } else
+                if (p[spec_length] == 's') {
+                    printf(spec, argument);
+                } else {
+                    // Not a conversion we know, so it's printed as it is
+                    fputs(spec, stdout);
+                }
+            }
+            p += spec_length;
+        }
+    } while (used_argument && next_argument < word_count);
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// export [NAME[=VALUE]...]: puts variables in the environment of the programs the shell runs, setting them first if
+// given a value. A name that isn't set is left alone. With no names, lists every exported variable
+Error builtin_export(int word_count, char** words, int* status, int* should_continue) {
+    Variable* variable;
+    char** environment;
+    size_t length;
+    int i;
+
+    if (word_count == 1) {
+        environment = build_environment();
+        for (i = 0; environment != NULL && environment[i] != NULL; i++);
+        qsort(environment, i, sizeof(char*), compare_strings);
+        for (i = 0; environment != NULL && environment[i] != NULL; i++) {
+            printf("export %s\n", environment[i]);
+        }
+        return new_ok(BLANK);
+    }
+    for (i = 1; i < word_count; i++) {
+        length = name_length(words[i]);
+        if (length == 0 || (words[i][length] != '=' && words[i][length] != '\0')) {
+            printf("export: '%s': not a valid identifier\n", words[i]);
+            *status = 1;
+            continue;
+        }
+        if (words[i][length] == '=') {
+            variable = set_variable(words[i], length, words[i] + length + 1);
+        } else {
+            variable = find_variable(words[i], length);
+        }
+        if (variable != NULL) {
+            shell_variables.environment_is_stale |= !variable->is_exported;
+            variable->is_exported = 1;
+        }
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// type NAME...: says whether each name is a builtin, and if not, which program it runs
+Error builtin_type(int word_count, char** words, int* status, int* should_continue) {
+    Error resolve_result;
+    int i;
+    for (i = 1; i < word_count; i++) {
+        if (parse(words[i]) != CONSOLE) {
+            printf("%s is a shell builtin\n", words[i]);
+            continue;
+        }
+        resolve_result = resolve_command(words[i]);
+        if (resolve_result.is_ok) {
+            printf("%s is %s\n", words[i], *(char**)resolve_result.value_ptr);
+        } else {
+            printf("type: %s: not found\n", words[i]);
+            *status = 1;
+        }
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// jobs: lists the background jobs and whether they're running, stopped or done
+Error builtin_jobs(int word_count, char** words, int* status, int* should_continue) {
+    int slot;
+    char* state;
+
+    reap_children();
+    for (slot = 0; slot < job_slots; slot++) {
+        if (jobs[slot] == NULL || !jobs[slot]->is_background) {
+            continue;
+        }
+        state = "Running";
+        if (job_is_done(jobs[slot])) {
+            state = "Done";
+        } else
+        if (job_is_stopped(jobs[slot])) {
+            state = "Stopped";
+        }
+        printf("[%d]%c  %-24s%s\n", jobs[slot]->id, jobs[slot]->id == current_job ? '+' : ' ', state, jobs[slot]->text);
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// fg [%N]: brings a background job (the current one by default) to the foreground, continuing it if it was stopped
+Error builtin_fg(int word_count, char** words, int* status, int* should_continue) {
+    Job* job = find_job(word_count > 1 ? words[1] : NULL);
+    int i;
+
+    if (job == NULL || !job->is_background) {
+        printf("fg: no such job\n");
+        *status = 1;
+        return new_ok(BLANK);
+    }
+    printf("%s\n", job->text);
+    fflush(stdout);
+    for (i = 0; i < job->process_count; i++) {
+        if (job->states[i] == PROCESS_STOPPED) {
+            job->states[i] = PROCESS_RUNNING;
+        }
+    }
+    if (job_control && job->pgid != 0) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    signal_job(job, SIGCONT);
+    wait_for_job(job);
+    *status = last_exit_status;
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// bg [%N]: lets a stopped job (the current one by default) carry on running in the background
+Error builtin_bg(int word_count, char** words, int* status, int* should_continue) {
+    Job* job = find_job(word_count > 1 ? words[1] : NULL);
+    int i;
+
+    if (job == NULL || !job->is_background) {
+        printf("bg: no such job\n");
+        *status = 1;
+        return new_ok(BLANK);
+    }
+    for (i = 0; i < job->process_count; i++) {
+        if (job->states[i] == PROCESS_STOPPED) {
+            job->states[i] = PROCESS_RUNNING;
+        }
+    }
+    signal_job(job, SIGCONT);
+    printf("[%d]+ %s &\n", job->id, job->text);
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// wait [%N...]: waits for the given background jobs, or all of them, to finish. The status is the last one waited for.
+// The jobs stay in the background while they're waited for, so they never get the terminal, and ^C stops the waiting
+Error builtin_wait(int word_count, char** words, int* status, int* should_continue) {
+    Job* job;
+    int i, slot;
+
+    if (word_count == 1) {
+        *status = 0;
+        for (slot = 0; slot < job_slots; slot++) {
+            if (jobs[slot] != NULL && jobs[slot]->is_background && !job_is_stopped(jobs[slot])
+                && await_job(jobs[slot], 0) == -1) {
+                *status = last_exit_status;
+                break;
+            }
+        }
+        return new_ok(BLANK);
+    }
+    for (i = 1; i < word_count; i++) {
+        job = find_job(words[i]);
+        if (job == NULL || !job->is_background) {
+            printf("wait: %s: no such job\n", words[i]);
+            *status = 127;
+            continue;
+        }
+        if (await_job(job, 0) == -1) {
+            *status = last_exit_status;
+            break;
+        }
+        *status = last_exit_status;
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// parallel [-j N] command... [::: arg...]: runs command once per arg, at most N at a time (as many as there are cores by default).
+// The args come after :::, or one per line from stdin without it. Every {} in the command is replaced by the arg, which is
+// otherwise added on the end. The command is shell text, so a quoted command can be a whole pipeline, or even a list
+// (which runs in a sish -c of its own).
+// Each run's output is held back and printed in the order of the args, so runs never interleave. A summary of how the runs
+// went goes to stderr (keeping it out of the output), and the status is 0 only if every run succeeded
+Error builtin_parallel(int word_count, char** words, int* status, int* should_continue) {
+    ParallelTask* tasks;
+    LineReader reader;
+    Option next_line;
+    Error start_result = new_ok(BLANK);
+    struct timespec started, ended;
+    struct rusage usage;
+    char** args, **grown;
+    char* separator;
+    int exit_counts[256];
+    int max_jobs = 0, command_start = 1, command_end, arg_count = 0, arg_capacity = 0, read_args = 0;
+    int task_count, next_start = 0, next_flush = 0, running = 0, failed = 0;
+    int null_fd, saved_job_control, wait_status, i;
+    pid_t pid;
+
+    if (command_start < word_count && strncmp(words[command_start], "-j", 2) == 0) {
+        if (words[command_start][2] != '\0') {
+            max_jobs = atoi(words[command_start] + 2);
+            command_start++;
+        } else
+        if (command_start + 1 < word_count) {
+            max_jobs = atoi(words[command_start + 1]);
+            command_start += 2;
+        }
+        if (max_jobs <= 0) {
+            printf("parallel: -j needs a number of jobs above 0\n");
+            *status = 2;
+            return new_ok(BLANK);
+        }
+    }
+    for (command_end = command_start; command_end < word_count && strcmp(words[command_end], ":::") != 0; command_end++) {}
+    if (command_end == command_start) {
+        printf("parallel: usage: parallel [-j N] command... [::: arg...]\n");
+        *status = 2;
+        return new_ok(BLANK);
+    }
+    if (max_jobs == 0) {
+        max_jobs = count_cores();
+    }
+    // The args are either the words after :::, which outlive this builtin, or lines of stdin, which have to be copied
+    if (command_end < word_count) {
+        args = words + command_end + 1;
+        arg_count = word_count - command_end - 1;
+    } else {
+        args = NULL;
+        read_args = 1;
+        start_result = init_file_reader(&reader, STDIN_FILENO);
+        if (!start_result.is_ok) {
+            return start_result;
+        }
+        while ((next_line = read_line(&reader)).is_some) {
+            if (arg_count == arg_capacity) {
+                arg_capacity = arg_capacity == 0 ? 64 : arg_capacity * 2;
+                grown = realloc(args, sizeof(char*) * arg_capacity);
+                if (grown == NULL) {
+                    break;
+                }
+                args = grown;
+            }
+            args[arg_count] = strdup((char*)next_line.value_ptr);
+            if (args[arg_count] == NULL) {
+                break;
+            }
+            arg_count++;
+        }
+        free(reader.buffer);
+        if (next_line.is_some) {
+            for (i = 0; i < arg_count; i++) {
+                free(args[i]);
+            }
+            free(args);
+            return new_err(0, "Parallel args failed to allocate");
+        }
+    }
+    tasks = malloc(sizeof(ParallelTask) * (arg_count + 1));
+    null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (tasks == NULL || null_fd == -1) {
+        start_result = new_err(0, "Parallel failed to start");
+        arg_count = 0;
+    }
+    for (i = 0; i < arg_count; i++) {
+        tasks[i].arg = args[i];
+        tasks[i].job = NULL;
+        tasks[i].output_fd = -1;
+        tasks[i].error_fd = -1;
+        tasks[i].status = 0;
+        tasks[i].is_finished = 0;
+    }
+    // The runs have to stay in the shell's process group. Otherwise a ^C would only reach the shell's foreground
+    // job (if any), and not the runs the shell is waiting on
+    saved_job_control = job_control;
+    job_control = 0;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    task_count = arg_count;
+    while (next_flush < task_count) {
+        while (running < max_jobs && next_start < task_count) {
+            start_result = start_parallel_task(&tasks[next_start], words + command_start, command_end - command_start, null_fd);
+            if (!start_result.is_ok) {
+                // Nothing new gets started, but whatever is already running still has to finish and be printed
+                task_count = next_start;
+                break;
+            }
+            if (!tasks[next_start].is_finished) {
+                running++;
+            }
+            next_start++;
+        }
+        // Output goes out in order, as soon as everything before it has gone out
+        while (next_flush < next_start && tasks[next_flush].is_finished) {
+            flush_parallel_task(&tasks[next_flush]);
+            next_flush++;
+        }
+        if (running == 0) {
+            continue;
+        }
+        // Children of background jobs can come back too. They're recorded like reap_children would
+        pid = wait4(-1, &wait_status, 0, &usage);
+        if (pid == -1 && errno == EINTR) {
+            continue;
+        }
+        if (pid != -1) {
+            record_child_status(pid, wait_status, &usage);
+        }
+        for (i = next_flush; i < next_start; i++) {
+            if (tasks[i].is_finished) {
+                continue;
+            }
+            // With no children left at all, whatever was still running is gone
+            if (pid == -1) {
+                tasks[i].job->states[tasks[i].job->process_count - 1] = PROCESS_DONE;
+                tasks[i].job->statuses[tasks[i].job->process_count - 1] = 255;
+                finish_parallel_task(&tasks[i]);
+                running--;
+            } else
+            if (job_is_done(tasks[i].job)) {
+                finish_parallel_task(&tasks[i]);
+                running--;
+            }
+            // A run killed by ^C means the user wants the whole thing stopped, so nothing new gets started
+            if (tasks[i].is_finished && tasks[i].status == 128 + SIGINT) {
+                task_count = next_start;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+    job_control = saved_job_control;
+    // Summarise how the runs went, with a count of each exit status that came back
+    memset(exit_counts, 0, sizeof(exit_counts));
+    for (i = 0; i < task_count; i++) {
+        exit_counts[tasks[i].status & 255]++;
+        if (tasks[i].status != 0) {
+            failed++;
+        }
+    }
+    if (task_count > 0) {
+        fflush(stdout);
+        fprintf(stderr, "parallel: %d job%s in %.3fs, %d succeeded, %d failed (",
+            task_count, task_count == 1 ? "" : "s",
+            (ended.tv_sec - started.tv_sec) + (ended.tv_nsec - started.tv_nsec) / 1e9, task_count - failed, failed);
+        separator = "";
+        for (i = 0; i < 256; i++) {
+            if (exit_counts[i] > 0) {
+                fprintf(stderr, "%sexit %d: %d", separator, i, exit_counts[i]);
+                separator = ", ";
+            }
+        }
+        fprintf(stderr, ")\n");
+    }
+    if (read_args) {
+        for (i = 0; i < arg_count; i++) {
+            free(args[i]);
+        }
+        free(args);
+    }
+    free(tasks);
+    if (null_fd != -1) {
+        close(null_fd);
+    }
+    *status = failed > 0 ? 1 : 0;
+    return start_result;
+}
+
+// Error<BLANK>
+// Starts the run of parallel's command for one task. A run that can't start at all (its line doesn't lex, or none of
+// its commands exist) is finished straight away. If starting it goes wrong some other way, the task's memory files
+// are closed again, since a task that was never started is never flushed
+Error start_parallel_task(ParallelTask* task, char** command_words, int command_count, int null_fd) {
+    Error build_result, line_result, start_result;
+    PipelineIO io;
+    ParsedLine* line;
+    Pipeline pipeline;
+    char* text;
+    int should_continue = 1;
+
+    build_result = build_parallel_line(command_words, command_count, task->arg);
+    if (!build_result.is_ok) {
+        return build_result;
+    }
+    text = *(char**)build_result.value_ptr;
+    // The run's output builds up in memory files, which are only ever as big as what was written to them
+    task->output_fd = memfd_create("parallel-output", MFD_CLOEXEC);
+    task->error_fd = memfd_create("parallel-errors", MFD_CLOEXEC);
+    if (task->output_fd == -1 || task->error_fd == -1) {
+        close_parallel_output(task);
+        free(text);
+        return new_err(0, "Parallel output failed to be created");
+    }
+    line_result = lex_line(text);
+    // A list has to run its pipelines one after another, which a task can only do in a shell of its own
+    if (line_result.is_ok && (*(ParsedLine**)line_result.value_ptr)->pipeline_count > 1) {
+        free_line(*(ParsedLine**)line_result.value_ptr);
+        build_result = build_subshell_line(text);
+        free(text);
+        if (!build_result.is_ok) {
+            close_parallel_output(task);
+            return build_result;
+        }
+        text = *(char**)build_result.value_ptr;
+        line_result = lex_line(text);
+    }
+    free(text);
+    if (!line_result.is_ok) {
+        if (line_result.error_code != 1) {
+            close_parallel_output(task);
+            return line_result;
+        }
+        dprintf(task->error_fd, "%s\n", line_result.error_string);
+        task->status = 1;
+        task->is_finished = 1;
+        return new_ok(BLANK);
+    }
+    line = *(ParsedLine**)line_result.value_ptr;
+    // Every stage, builtins included, runs in its own process so that the runs really do happen at the same time
+    pipeline = line->pipelines[0];
+    pipeline.is_background = 1;
+    io.stdin = null_fd;
+    io.stdout = task->output_fd;
+    io.stderr = task->error_fd;
+    start_result = start_pipeline(&pipeline, &io, &should_continue);
+    free_line(line);
+    if (!start_result.is_ok) {
+        close_parallel_output(task);
+        return start_result;
+    }
+    task->job = *(Job**)start_result.value_ptr;
+    if (job_is_done(task->job)) {
+        finish_parallel_task(task);
+    }
+    return new_ok(BLANK);
+}
+
+// Takes the status of a task whose job is done, and frees the job
+void finish_parallel_task(ParallelTask* task) {
+    task->status = task->job->statuses[task->job->process_count - 1];
+    if (task->status == 254) {
+        dprintf(task->error_fd, "%s: command not found\n", task->job->text);
+    }
+    free_job(task->job);
+    task->job = NULL;
+    task->is_finished = 1;
+}
+
+// Prints what a finished task wrote, and lets go of it
+void flush_parallel_task(ParallelTask* task) {
+    fflush(stdout);
+    fflush(stderr);
+    lseek(task->output_fd, 0, SEEK_SET);
+    lseek(task->error_fd, 0, SEEK_SET);
+    transfer_fd(task->output_fd, STDOUT_FILENO);
+    transfer_fd(task->error_fd, STDERR_FILENO);
+    close_parallel_output(task);
+}
+
+// Closes a task's memory files, whichever of them are open
+void close_parallel_output(ParallelTask* task) {
+    if (task->output_fd != -1) {
+        close(task->output_fd);
+        task->output_fd = -1;
+    }
+    if (task->error_fd != -1) {
+        close(task->error_fd);
+        task->error_fd = -1;
+    }
+}
+
+// Error<char*>
+// Builds the line parallel runs for one arg, with every {} in the command replaced by the arg (or the arg added on the end
+// if there's no {}). A command given as one word is shell text, which the arg is quoted into as a single word.
+// A command given as several words is run as exactly those words, so each of them is quoted after the {}s are replaced.
+// The line is malloc'd, and the caller frees it
+Error build_parallel_line(char** command_words, int command_count, char* arg) {
+    static char* buffer;
+    char* word_buffer;
+    size_t length = 0, capacity = 64, word_length, word_capacity = 64;
+    char* word, *placeholder;
+    int i, has_placeholder = 0;
+
+    buffer = malloc(capacity);
+    word_buffer = malloc(word_capacity);
+    for (i = 0; i < command_count; i++) {
+        word = command_words[i];
+        word_length = 0;
+        while ((placeholder = strstr(word, "{}")) != NULL) {
+            append_text(&word_buffer, &word_length, &word_capacity, word, placeholder - word);
+            if (command_count == 1) {
+                append_quoted(&word_buffer, &word_length, &word_capacity, arg);
+            } else {
+                append_text(&word_buffer, &word_length, &word_capacity, arg, strlen(arg));
+            }
+            has_placeholder = 1;
+            word = placeholder + 2;
+        }
+        append_text(&word_buffer, &word_length, &word_capacity, word, strlen(word) + 1);
+        if (word_buffer == NULL) {
+            break;
+        }
+        if (i > 0) {
+            append_text(&buffer, &length, &capacity, " ", 1);
+        }
+        if (command_count == 1) {
+            append_text(&buffer, &length, &capacity, word_buffer, word_length - 1);
+        } else {
+            append_quoted(&buffer, &length, &capacity, word_buffer);
+        }
+    }
+    if (!has_placeholder) {
+        append_text(&buffer, &length, &capacity, " ", 1);
+        append_quoted(&buffer, &length, &capacity, arg);
+    }
+    if (word_buffer == NULL || buffer == NULL) {
+        free(word_buffer);
+        free(buffer);
+        return new_err(0, "Parallel line failed to allocate");
+    }
+    free(word_buffer);
+    buffer[length] = '\0';
+    return new_ok((void*)&buffer);
+}
+
+// Error<char*>
+// Builds a line that runs text in a new sish, as sish -c would. The line is malloc'd, and the caller frees it
+Error build_subshell_line(char* text) {
+    static char* buffer;
+    char self[PATH_MAX];
+    ssize_t self_length;
+    size_t length = 0, capacity = 64;
+
+    self_length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (self_length == -1) {
+        return new_err(0, "Can't find the shell to run a list in");
+    }
+    self[self_length] = '\0';
+    buffer = malloc(capacity);
+    append_quoted(&buffer, &length, &capacity, self);
+    append_text(&buffer, &length, &capacity, " -c ", 4);
+    append_quoted(&buffer, &length, &capacity, text);
+    if (buffer == NULL) {
+        return new_err(0, "Subshell line failed to allocate");
+    }
+    buffer[length] = '\0';
+    return new_ok((void*)&buffer);
+}
+
+// Adds text_length bytes of text to the end of a malloc'd buffer, growing it as needed and always leaving room for a NUL.
+// If the buffer can't grow it's freed and set to NULL, which every later append quietly does nothing for
+void append_text(char** buffer, size_t* length, size_t* capacity, char* text, size_t text_length) {
+    char* grown;
+
+    if (*buffer == NULL) {
+        return;
+    }
+    if (*length + text_length + 1 > *capacity) {
+        while (*length + text_length + 1 > *capacity) {
+            *capacity *= 2;
+        }
+        grown = realloc(*buffer, *capacity);
+        if (grown == NULL) {
+            free(*buffer);
+            *buffer = NULL;
+            return;
+        }
+        *buffer = grown;
+    }
+    memcpy(*buffer + *length, text, text_length);
+    *length += text_length;
+}
+
+// Adds text to a buffer in single quotes, so the lexer reads it back as exactly one word.
+// A single quote inside text ends the quotes, is escaped, and starts them again
+void append_quoted(char** buffer, size_t* length, size_t* capacity, char* text) {
+    char* quote;
+
+    append_text(buffer, length, capacity, "'", 1);
+    while ((quote = strchr(text, '\'')) != NULL) {
+        append_text(buffer, length, capacity, text, quote - text);
+        append_text(buffer, length, capacity, "'\\''", 4);
+        text = quote + 1;
+    }
+    append_text(buffer, length, capacity, text, strlen(text));
+    append_text(buffer, length, capacity, "'", 1);
+}
+
+// Returns how many cores sish is allowed to run on, or 1 if that can't be found out
+int count_cores() {
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1 || CPU_COUNT(&cpus) < 1) {
+        return 1;
+    }
+    return CPU_COUNT(&cpus);
+}
+
+// Error<BLANK>
+// placement [-p SIZE | default] [-c off | spread | nodeN | LIST]: shows or changes how pipelines are laid out.
+// -p makes the pipes between stages SIZE bytes (it can end in K or M), as far as the kernel allows.
+// -c pins each stage the shell starts to a CPU of its own: off leaves them to the scheduler, spread goes round every
+// CPU the shell may use, nodeN goes round the CPUs of NUMA node N, and a list like 0,2,4-7 goes round those
+Error builtin_placement(int word_count, char** words, int* status, int* should_continue) {
+    Error set_result;
+    int i;
+
+    *status = 0;
+    if (word_count == 1) {
+        display_placement();
+        return new_ok(BLANK);
+    }
+    for (i = 1; i < word_count; i += 2) {
+        if (i + 1 == word_count || (strcmp(words[i], "-p") != 0 && strcmp(words[i], "-c") != 0)) {
+            printf("placement: usage: placement [-p size | default] [-c off | spread | nodeN | cpu list]\n");
+            *status = 2;
+            return new_ok(BLANK);
+        }
+        set_result = words[i][1] == 'p' ? set_pipe_size(words[i + 1]) : set_cpu_policy(words[i + 1]);
+        if (!set_result.is_ok) {
+            printf("placement: %s: %s\n", words[i + 1], set_result.error_string);
+            *status = 1;
+        }
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// Sets how big the pipes between stages are made: a size (see parse_size) or default.
+// The kernel rounds sizes up to a power of two pages and won't go past /proc/sys/fs/pipe-max-size for anyone but root,
+// so the size is tried out on a pipe first, and what the kernel actually gave it is what's kept
+Error set_pipe_size(char* text) {
+    long long size;
+    int test_pipe[2], actual;
+
+    if (strcmp(text, "default") == 0) {
+        placement.pipe_size = 0;
+        return new_ok(BLANK);
+    }
+    size = parse_size(text);
+    if (size <= 0 || size > INT_MAX) {
+        return new_err(1, "not a pipe size");
+    }
+    if (pipe2(test_pipe, O_CLOEXEC) == -1) {
+        return new_err(errno, "pipes can't be made");
+    }
+    actual = fcntl(test_pipe[1], F_SETPIPE_SZ, (int)size);
+    close(test_pipe[0]);
+    close(test_pipe[1]);
+    if (actual == -1) {
+        return new_err(errno, errno == EPERM ? "bigger than pipes are allowed to be" : "pipes can't be that size");
+    }
+    placement.pipe_size = actual;
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// Sets which CPUs stages are pinned to (see AffinityPolicy). Whatever the policy, only the CPUs the shell itself may run on
+// are used, in case sish was started under taskset or in a cpuset. Except for a list, which is used in the order given,
+// the first hyperthread of every core comes before any of the others
+Error set_cpu_policy(char* text) {
+    cpu_set_t allowed, chosen, siblings;
+    AffinityPolicy policy;
+    char path[PATH_MAX];
+    char* end;
+    int* cpus;
+    int cpu, sibling, pass, count = 0, node = -1, is_first;
+
+    if (strcmp(text, "off") == 0) {
+        free(placement.cpus);
+        placement.cpus = NULL;
+        placement.cpu_count = 0;
+        placement.policy = AFFINITY_OFF;
+        return new_ok(BLANK);
+    }
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        return new_err(errno, "the shell's own CPUs can't be found out");
+    }
+    if (strcmp(text, "spread") == 0) {
+        policy = AFFINITY_SPREAD;
+        chosen = allowed;
+    } else
+    if (strncmp(text, "node", 4) == 0) {
+        policy = AFFINITY_NODE;
+        node = strtol(text + 4, &end, 10);
+        if (end == text + 4 || *end != '\0' || node < 0) {
+            return new_err(1, "not a NUMA node");
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (read_cpu_list(path, &chosen) == -1) {
+            return new_err(1, "no such NUMA node");
+        }
+    } else {
+        policy = AFFINITY_LIST;
+        if (parse_cpu_list(text, &chosen) == -1) {
+            return new_err(1, "not a list of CPUs");
+        }
+    }
+    CPU_AND(&chosen, &chosen, &allowed);
+    if (CPU_COUNT(&chosen) == 0) {
+        return new_err(1, "none of those CPUs can be used");
+    }
+    cpus = malloc(sizeof(int) * CPU_COUNT(&chosen));
+    if (cpus == NULL) {
+        return new_err(0, "Placement failed to allocate");
+    }
+    for (pass = 0; pass < 2; pass++) {
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &chosen)) {
+                continue;
+            }
+            // A CPU is a core's first hyperthread if no sibling of it comes before it
+            is_first = 1;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+            if (policy != AFFINITY_LIST && read_cpu_list(path, &siblings) == 0) {
+                for (sibling = 0; sibling < cpu && !CPU_ISSET(sibling, &siblings); sibling++) {}
+                is_first = (sibling == cpu);
+            }
+            if (is_first == (pass == 0)) {
+                cpus[count++] = cpu;
+            }
+        }
+    }
+    free(placement.cpus);
+    placement.cpus = cpus;
+    placement.cpu_count = count;
+    placement.policy = policy;
+    placement.node = node;
+    placement.next_cpu = 0;
+    return new_ok(BLANK);
+}
+
+// Reads a CPU list the way the kernel writes them ("0-3,8,10-11") into cpus. Returns -1 if it isn't one
+int parse_cpu_list(char* text, cpu_set_t* cpus) {
+    long first, last, cpu;
+    char* end;
+
+    CPU_ZERO(cpus);
+    while (*text != '\0' && *text != '\n') {
+        first = strtol(text, &end, 10);
+        if (end == text || first < 0) {
+            return -1;
+        }
+        last = first;
+        if (*end == '-') {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if (end == text || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        text = end;
+        if (*text == ',') {
+            text++;
+        } else
+        if (*text != '\0' && *text != '\n') {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Reads a CPU list out of a file in sysfs. Returns -1 if there's no such file, or it doesn't hold one
+int read_cpu_list(char* path, cpu_set_t* cpus) {
+    char buffer[4096];
+    ssize_t length;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0) {
+        return -1;
+    }
+    buffer[length] = '\0';
+    return parse_cpu_list(buffer, cpus);
+}
+
+// Pins a stage that's just been started to the next of placement's CPUs. The shell does it rather than the stage,
+// since posix_spawn has no way to, and a stage that's only just started hasn't had time to settle anywhere else
+void place_stage(pid_t pid) {
+    cpu_set_t cpu;
+
+    CPU_ZERO(&cpu);
+    CPU_SET(placement.cpus[placement.next_cpu], &cpu);
+    placement.next_cpu = (placement.next_cpu + 1) % placement.cpu_count;
+    sched_setaffinity(pid, sizeof(cpu), &cpu);
+}
+
+// Shows how pipelines are laid out, for placement
+void display_placement() {
+    int i;
+
+    if (placement.pipe_size == 0) {
+        printf("pipes: default size\n");
+    } else {
+        printf("pipes: %d bytes\n", placement.pipe_size);
+    }
+    if (placement.policy == AFFINITY_OFF) {
+        printf("cpus: off\n");
+        return;
+    }
+    if (placement.policy == AFFINITY_NODE) {
+        printf("cpus: node%d,", placement.node);
+    } else {
+        printf("cpus: %s,", placement.policy == AFFINITY_SPREAD ? "spread" : "list");
+    }
+    printf(" stages go on");
+    for (i = 0; i < placement.cpu_count; i++) {
+        printf(" %d", placement.cpus[i]);
+    }
+    printf(" in turn\n");
+}
+
+// Reads a size like 64K, 512M or 2G, or a plain number of bytes. Returns -1 if it isn't one, or is too big to hold
+long long parse_size(char* text) {
+    long long size, multiplier = 1;
+    char* end;
+
+    errno = 0;
+    size = strtoll(text, &end, 10);
+    if (end == text || size < 0 || errno == ERANGE) {
+        return -1;
+    }
+    if (*end == 'K' || *end == 'k') {
+        multiplier = 1024;
+        end++;
+    } else
+    if (*end == 'M' || *end == 'm') {
+        multiplier = 1024 * 1024;
+        end++;
+    } else
+    if (*end == 'G' || *end == 'g') {
+        multiplier = 1024 * 1024 * 1024;
+        end++;
+    }
+    // Sizes too big to count in bytes aren't sizes either
+    if (*end != '\0' || size > LLONG_MAX / multiplier) {
+        return -1;
+    }
+    return size * multiplier;
+}
+
+// Error<BLANK>
+// governor [-j N] [-t SECONDS] [-v SIZE] [-n N] [-g on] [-m SIZE] [-c PERCENT]: shows or changes what the spawn governor
+// does to the pipelines the shell starts. Any of them can be off instead.
+// -j caps how many children run at once. A pipeline that would go over the cap waits for others to finish first.
+// -t, -v and -n are the CPU seconds, address space and open files rlimits of every program a stage runs.
+// -g gives every pipeline a cgroup v2 group of its own, which -m and -c (either of which turns -g on) limit to SIZE bytes
+// of memory and PERCENT of a CPU. The cgroups go in SISH_CGROUP, or else in the shell's own, which has to be writable.
+// governor -a: shows what the last jobs with cgroups used, and what the running ones have used so far
+Error builtin_governor(int word_count, char** words, int* status, int* should_continue) {
+    Error set_result;
+    int i;
+
+    *status = 0;
+    if (word_count == 1) {
+        display_governor();
+        return new_ok(BLANK);
+    }
+    if (word_count == 2 && strcmp(words[1], "-a") == 0) {
+        display_job_accounts();
+        return new_ok(BLANK);
+    }
+    for (i = 1; i < word_count; i += 2) {
+        if (i + 1 == word_count || words[i][0] != '-' || words[i][1] == '\0' || words[i][2] != '\0'
+            || strchr("jtvngmc", words[i][1]) == NULL) {
+            printf("governor: usage: governor [-j n] [-t seconds] [-v size] [-n n] [-g on] [-m size] [-c percent], "
+                "or governor -a\n");
+            *status = 2;
+            return new_ok(BLANK);
+        }
+        set_result = set_governor_option(words[i][1], words[i + 1]);
+        if (!set_result.is_ok) {
+            printf("governor: %s %s: %s\n", words[i], words[i + 1], set_result.error_string);
+            *status = 1;
+        }
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// Sets one of governor's options: off, or a number (a size for -v and -m, and only on for -g)
+Error set_governor_option(char option, char* value) {
+    long long number = 0;
+    char* end, *controller;
+    int turned_on = 0, saved_errno;
+    Error enable_result;
+
+    if (strcmp(value, "off") != 0) {
+        if (option == 'g') {
+            number = strcmp(value, "on") == 0 ? 1 : -1;
+        } else
+        if (option == 'v' || option == 'm') {
+            number = parse_size(value);
+        } else {
+            number = strtoll(value, &end, 10);
+            if (end == value || *end != '\0' || number > INT_MAX) {
+                number = -1;
+            }
+        }
+        if (number <= 0) {
+            return new_err(1, option == 'g' ? "expected on or off" : "expected a number above 0, or off");
+        }
+    }
+    if (option == 'j') {
+        governor.max_running = number;
+    } else
+    if (option == 't') {
+        governor.cpu_seconds = number;
+    } else
+    if (option == 'v') {
+        governor.address_space = number;
+    } else
+    if (option == 'n') {
+        governor.open_files = number;
+    } else
+    if (option == 'g' && number == 0) {
+        free(governor.cgroup_base);
+        governor.cgroup_base = NULL;
+    } else {
+        if (option == 'c' && number > 100 * count_cores()) {
+            return new_err(1, "that's more CPUs than there are");
+        }
+        if (number > 0 && governor.cgroup_base == NULL) {
+            enable_result = enable_cgroups();
+            if (!enable_result.is_ok) {
+                return enable_result;
+            }
+            turned_on = 1;
+        }
+        // The cgroups under the base can only be limited by controllers the base lets them use.
+        // Turning on one that's on already does nothing
+        controller = option == 'm' ? "+memory" : option == 'c' ? "+cpu" : NULL;
+        if (number > 0 && controller != NULL && write_cgroup_file(governor.cgroup_base, "cgroup.subtree_control", controller) == -1) {
+            // A limit that couldn't be set leaves cgroups the way they were
+            if (turned_on) {
+                saved_errno = errno;
+                free(governor.cgroup_base);
+                governor.cgroup_base = NULL;
+                errno = saved_errno;
+            }
+            if (option == 'm') {
+                return new_err(errno, "the memory controller can't be used there, it needs a delegated empty cgroup");
+            }
+            return new_err(errno, "the cpu controller can't be used there, it needs a delegated empty cgroup");
+        }
+        if (option == 'm') {
+            governor.memory_max = number;
+        } else
+        if (option == 'c') {
+            governor.cpu_percent = number;
+        }
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// Finds where pipelines' cgroups go: SISH_CGROUP, or the cgroup v2 group the shell itself is in (from /proc/self/cgroup,
+// under wherever cgroup2 is mounted). Either way it has to be there and writable
+Error enable_cgroups() {
+    char line[PATH_MAX + 256], mount_point[PATH_MAX], path[PATH_MAX];
+    char* base = get_variable("SISH_CGROUP"), *group = NULL;
+    FILE* file;
+
+    if (base == NULL || base[0] == '\0') {
+        mount_point[0] = '\0';
+        file = fopen("/proc/self/mountinfo", "re");
+        while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+            if (strstr(line, " - cgroup2 ") != NULL && sscanf(line, "%*s %*s %*s %*s %4095s", mount_point) == 1) {
+                break;
+            }
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+        file = fopen("/proc/self/cgroup", "re");
+        while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                group = line + 3;
+                break;
+            }
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+        if (mount_point[0] == '\0' || group == NULL) {
+            return new_err(1, "there's no cgroup v2 hierarchy here (SISH_CGROUP can name one)");
+        }
+        if (snprintf(path, sizeof(path), "%s%s", mount_point, strcmp(group, "/") == 0 ? "" : group) >= (int)sizeof(path)) {
+            return new_err(ENAMETOOLONG, "the shell's cgroup has too long a path (SISH_CGROUP can name another)");
+        }
+        base = path;
+    }
+    if (access(base, W_OK) == -1) {
+        return new_err(errno, "the cgroup isn't writable (SISH_CGROUP can name one that is)");
+    }
+    governor.cgroup_base = strdup(base);
+    if (governor.cgroup_base == NULL) {
+        return new_err(0, "Governor failed to allocate");
+    }
+    return new_ok(BLANK);
+}
+
+// Writes text to one of a cgroup's files. Returns -1 if the kernel wouldn't have it
+int write_cgroup_file(char* directory, char* file, char* text) {
+    char path[PATH_MAX];
+    int fd, saved_errno;
+
+    snprintf(path, sizeof(path), "%s/%s", directory, file);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (write_all(fd, text, strlen(text)) == -1) {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Reads a number out of one of a cgroup's files: the whole file if key is NULL, or else the value on the line that
+// starts with key. Returns -1 if there's no such file or line
+long long read_cgroup_value(char* directory, char* file, char* key) {
+    char path[PATH_MAX], buffer[4096];
+    char* line;
+    ssize_t length;
+    size_t key_length;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", directory, file);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0) {
+        return -1;
+    }
+    buffer[length] = '\0';
+    if (key == NULL) {
+        return atoll(buffer);
+    }
+    key_length = strlen(key);
+    for (line = buffer; line != NULL; line = strchr(line, '\n') != NULL ? strchr(line, '\n') + 1 : NULL) {
+        if (strncmp(line, key, key_length) == 0 && line[key_length] == ' ') {
+            return atoll(line + key_length + 1);
+        }
+    }
+    return -1;
+}
+
+// Counts the shell's children that are running right now. Stopped ones don't count, so a stopped job can never hold
+// everything else up, and neither do helpers
+int count_running_children() {
+    int slot, i, count = 0;
+
+    for (slot = 0; slot < job_slots; slot++) {
+        if (jobs[slot] == NULL || jobs[slot]->is_helper) {
+            continue;
+        }
+        for (i = 0; i < jobs[slot]->process_count; i++) {
+            if (jobs[slot]->pids[i] != -1 && jobs[slot]->states[i] == PROCESS_RUNNING) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+// Holds a pipeline of needed stages back until it can start without going over the governor's cap, reaping children
+// as they finish in the meantime. A pipeline is let through whole, since some of its stages started without the rest
+// could block forever on pipes nobody reads yet, and one that's bigger than the cap is let through once nothing else runs.
+// An interactive shell ignores ^C, so while it waits it catches it instead, and gives up on the pipeline then.
+// Returns -1 if it was given up on that way
+int wait_for_children(int needed) {
+    struct rusage usage;
+    struct sigaction saved_action;
+    long long started = 0;
+    int running, wait_status, result = 0;
+    pid_t pid;
+
+    while ((running = count_running_children()) > 0 && running + needed > governor.max_running) {
+        if (started == 0) {
+            started = now_ns();
+            governor.queued++;
+            if (is_interactive) {
+                catch_interrupts(&saved_action);
+            }
+        }
+        if (wait_interrupted) {
+            result = -1;
+            break;
+        }
+        pid = wait4(-1, &wait_status, job_control ? WUNTRACED : 0, &usage);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        record_child_status(pid, wait_status, &usage);
+    }
+    if (started != 0) {
+        governor.queued_ns += now_ns() - started;
+        if (is_interactive) {
+            sigaction(SIGINT, &saved_action, NULL);
+        }
+    }
+    return result;
+}
+
+
+// Makes a job's cgroup, with the governor's limits on it, and returns its cgroup.procs for the job's stages to move
+// themselves into. Returns -1, having said why, if the job has to do without one
+int create_job_cgroup(Job* job) {
+    char path[PATH_MAX], procs[PATH_MAX + 16], text[64];
+    int fd = -1;
+
+    if (snprintf(path, sizeof(path), "%s/sish-%d-%lld", governor.cgroup_base, (int)getpid(), ++governor.cgroup_serial)
+        >= (int)sizeof(path)) {
+        printf("governor: %s: %s\n", governor.cgroup_base, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    if (mkdir(path, 0755) == -1) {
+        printf("governor: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    snprintf(text, sizeof(text), "%lld", governor.memory_max);
+    if (governor.memory_max == 0 || write_cgroup_file(path, "memory.max", text) == 0) {
+        snprintf(text, sizeof(text), "%lld 100000", governor.cpu_percent * 1000LL);
+        if (governor.cpu_percent == 0 || write_cgroup_file(path, "cpu.max", text) == 0) {
+            snprintf(procs, sizeof(procs), "%s/cgroup.procs", path);
+            fd = open(procs, O_WRONLY | O_CLOEXEC);
+        }
+    }
+    if (fd != -1) {
+        job->cgroup = strdup(path);
+    }
+    if (fd == -1 || job->cgroup == NULL) {
+        printf("governor: %s: %s\n", path, fd == -1 ? strerror(errno) : "failed to allocate");
+        if (fd != -1) {
+            close(fd);
+        }
+        rmdir(path);
+        return -1;
+    }
+    return fd;
+}
+
+// Gives the calling process (a stage about to exec) the governor's rlimits. Nothing can go above the hard limits the
+// shell was given, so the limits are capped there. The CPU one's hard limit is a second past the soft one, so a program
+// gets a SIGXCPU it can clean up after before it's killed
+void apply_rlimits() {
+    long long values[3];
+    int resources[3] = {RLIMIT_CPU, RLIMIT_AS, RLIMIT_NOFILE};
+    struct rlimit limit;
+    int i;
+
+    values[0] = governor.cpu_seconds;
+    values[1] = governor.address_space;
+    values[2] = governor.open_files;
+    for (i = 0; i < 3; i++) {
+        if (values[i] == 0 || getrlimit(resources[i], &limit) == -1) {
+            continue;
+        }
+        if ((rlim_t)values[i] < limit.rlim_max) {
+            limit.rlim_cur = values[i];
+        } else {
+            limit.rlim_cur = limit.rlim_max;
+        }
+        if (resources[i] != RLIMIT_CPU || limit.rlim_cur == limit.rlim_max) {
+            limit.rlim_max = limit.rlim_cur;
+        } else {
+            limit.rlim_max = limit.rlim_cur + 1;
+        }
+        setrlimit(resources[i], &limit);
+    }
+}
+
+// Reads what a cgroup's processes have used into account. Anything its controllers don't report is left as -1
+void read_job_account(char* cgroup, JobAccount* account) {
+    account->usage_usec = read_cgroup_value(cgroup, "cpu.stat", "usage_usec");
+    account->user_usec = read_cgroup_value(cgroup, "cpu.stat", "user_usec");
+    account->system_usec = read_cgroup_value(cgroup, "cpu.stat", "system_usec");
+    account->throttled_usec = read_cgroup_value(cgroup, "cpu.stat", "throttled_usec");
+    account->memory_peak = read_cgroup_value(cgroup, "memory.peak", NULL);
+    account->oom_kills = read_cgroup_value(cgroup, "memory.events", "oom_kill");
+}
+
+// Keeps what a finished job's cgroup used, before the cgroup goes away. Only the last ACCOUNT_HISTORY jobs are kept
+void account_job(Job* job) {
+    JobAccount* account = &governor.accounts[governor.next_account];
+
+    free(account->text);
+    account->text = strdup(job->text);
+    account->status = job->statuses[job->process_count - 1];
+    read_job_account(job->cgroup, account);
+    governor.next_account = (governor.next_account + 1) % ACCOUNT_HISTORY;
+}
+
+// Prints one row of governor -a. Times are in whichever unit reads best, and - is anything that wasn't reported
+void print_job_account(char* label, JobAccount* account) {
+    char buffers[4][32], peak[32], status[16], oom[32];
+    long long times[4];
+    int i;
+
+    times[0] = account->usage_usec;
+    times[1] = account->user_usec;
+    times[2] = account->system_usec;
+    times[3] = account->throttled_usec;
+    for (i = 0; i < 4; i++) {
+        if (times[i] < 0) {
+            strcpy(buffers[i], "-");
+        } else {
+            format_ns(times[i] * 1000, buffers[i]);
+        }
+    }
+    if (account->memory_peak < 0) {
+        strcpy(peak, "-");
+    } else {
+        snprintf(peak, sizeof(peak), "%lldK", account->memory_peak / 1024);
+    }
+    if (account->status < 0) {
+        strcpy(status, "-");
+    } else {
+        snprintf(status, sizeof(status), "%d", account->status);
+    }
+    if (account->oom_kills < 0) {
+        strcpy(oom, "-");
+    } else {
+        snprintf(oom, sizeof(oom), "%lld", account->oom_kills);
+    }
+    printf("%-8s %6s %9s %9s %9s %9s %11s %4s  %s\n", label, status, buffers[0], buffers[1], buffers[2], buffers[3],
+        peak, oom, account->text);
+}
+
+// Shows what the governor does, for governor
+void display_governor() {
+    char buffers[3][32];
+    long long values[3];
+    int i;
+
+    if (governor.max_running > 0) {
+        printf("children: %d running, at most %d\n", count_running_children(), governor.max_running);
+    } else {
+        printf("children: %d running, no cap\n", count_running_children());
+    }
+    printf("queued: %lld pipelines, for %s in all\n", governor.queued, format_ns(governor.queued_ns, buffers[0]));
+    values[0] = governor.cpu_seconds;
+    values[1] = governor.address_space;
+    values[2] = governor.open_files;
+    for (i = 0; i < 3; i++) {
+        if (values[i] == 0) {
+            strcpy(buffers[i], "off");
+        } else {
+            snprintf(buffers[i], sizeof(buffers[i]), "%lld", values[i]);
+        }
+    }
+    printf("rlimits: cpu seconds %s, address space %s, open files %s\n", buffers[0], buffers[1], buffers[2]);
+    if (governor.cgroup_base == NULL) {
+        printf("cgroups: off\n");
+        return;
+    }
+    if (governor.memory_max == 0) {
+        strcpy(buffers[0], "max");
+    } else {
+        snprintf(buffers[0], sizeof(buffers[0]), "%lld", governor.memory_max);
+    }
+    if (governor.cpu_percent == 0) {
+        strcpy(buffers[1], "max");
+    } else {
+        snprintf(buffers[1], sizeof(buffers[1]), "%d%%", governor.cpu_percent);
+    }
+    printf("cgroups: one per pipeline in %s, memory %s, cpu %s\n", governor.cgroup_base, buffers[0], buffers[1]);
+}
+
+// Shows what jobs with cgroups used, for governor -a: the finished ones oldest first, then the ones still going
+void display_job_accounts() {
+    JobAccount live;
+    char label[32];
+    int slot, i;
+
+    printf("%-8s %6s %9s %9s %9s %9s %11s %4s  %s\n", "job", "status", "cpu", "user", "system", "throttled",
+        "peak memory", "oom", "command");
+    for (i = 0; i < ACCOUNT_HISTORY; i++) {
+        if (governor.accounts[(governor.next_account + i) % ACCOUNT_HISTORY].text != NULL) {
+            print_job_account("done", &governor.accounts[(governor.next_account + i) % ACCOUNT_HISTORY]);
+        }
+    }
+    for (slot = 0; slot < job_slots; slot++) {
+        if (jobs[slot] == NULL || jobs[slot]->cgroup == NULL) {
+            continue;
+        }
+        read_job_account(jobs[slot]->cgroup, &live);
+        live.text = jobs[slot]->text;
+        live.status = -1;
+        snprintf(label, sizeof(label), "[%d]", jobs[slot]->id);
+        print_job_account(label, &live);
+    }
+}
+
+// Error<BLANK>
+// cat [FILE...]: prints each file (stdin for - or no files at all) one after the other.
+// The data is moved by the kernel wherever it can be, see transfer_fd
+Error builtin_cat(int word_count, char** words, int* status, int* should_continue) {
+    int i, fd;
+
+    *status = 0;
+    if (word_count <= 1) {
+        if (transfer_fd(STDIN_FILENO, STDOUT_FILENO) == -1) {
+            fprintf(stderr, "cat: %s\n", strerror(errno));
+            *status = 1;
+        }
+        return new_ok(BLANK);
+    }
+    for (i = 1; i < word_count; i++) {
+        fd = strcmp(words[i], "-") == 0 ? STDIN_FILENO : open(words[i], O_RDONLY | O_CLOEXEC);
+        // Errors go to stderr, since stdout is the data
+        if (fd == -1 || transfer_fd(fd, STDOUT_FILENO) == -1) {
+            fprintf(stderr, "cat: %s: %s\n", words[i], strerror(errno));
+            *status = 1;
+        }
+        if (fd > STDIN_FILENO) {
+            close(fd);
+        }
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// tee [-a] [FILE...]: copies stdin to stdout and to every file, appending to them with -a.
+// When stdin is a pipe, the data is duplicated and moved by the kernel without ever being read into the shell
+Error builtin_tee(int word_count, char** words, int* status, int* should_continue) {
+    static char buffer[65536];
+    int* fds;
+    int i, fd_count = 1, append = 0, flags;
+    ssize_t read_result;
+
+    *status = 0;
+    if (word_count > 1 && strcmp(words[1], "-a") == 0) {
+        append = 1;
+    }
+    fds = malloc(sizeof(int) * word_count);
+    if (fds == NULL) {
+        return new_err(0, "tee failed to allocate");
+    }
+    fds[0] = STDOUT_FILENO;
+    for (i = 1 + append; i < word_count; i++) {
+        fds[fd_count] = open(words[i], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+        if (fds[fd_count] == -1) {
+            fprintf(stderr, "tee: %s: %s\n", words[i], strerror(errno));
+            *status = 1;
+            continue;
+        }
+        fd_count++;
+    }
+    // splice refuses files opened for appending, so those always take the slow way
+    flags = append ? O_APPEND : 0;
+    for (i = 0; i < fd_count; i++) {
+        flags |= fcntl(fds[i], F_GETFL);
+    }
+    if ((flags & O_APPEND) || tee_by_splice(STDIN_FILENO, fds, fd_count) == -1) {
+        while ((read_result = read(STDIN_FILENO, buffer, sizeof(buffer))) != 0) {
+            if (read_result == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "tee: %s\n", strerror(errno));
+                *status = 1;
+                break;
+            }
+            for (i = 0; i < fd_count; i++) {
+                if (write_all(fds[i], buffer, read_result) == -1) {
+                    *status = 1;
+                }
+            }
+        }
+    }
+    for (i = 1; i < fd_count; i++) {
+        close(fds[i]);
+    }
+    free(fds);
+    return new_ok(BLANK);
+}
+
+// Copies everything from_fd has left to to_fd, from and to the current position of each, without the data passing through
+// the shell when the kernel can manage it: copy_file_range between two files, splice when either end is a pipe, and
+// sendfile out of a file. Anything else (a terminal, say) falls back to a read/write loop.
+// Returns -1 if the copy couldn't be finished
+int transfer_fd(int from_fd, int to_fd) {
+    static char buffer[65536];
+    struct stat from_info, to_info;
+    ssize_t moved = -1;
+
+    if (fstat(from_fd, &from_info) == -1 || fstat(to_fd, &to_info) == -1) {
+        return -1;
+    }
+    // Each of these stops at the end of the input (moved is 0), or gives up (moved is -1) and leaves the rest to the next
+    if (S_ISREG(from_info.st_mode) && S_ISREG(to_info.st_mode)) {
+        while ((moved = copy_file_range(from_fd, NULL, to_fd, NULL, TRANSFER_CHUNK, 0)) > 0 || (moved == -1 && errno == EINTR)) {}
+    } else
+    if (S_ISFIFO(from_info.st_mode) || S_ISFIFO(to_info.st_mode)) {
+        while ((moved = splice(from_fd, NULL, to_fd, NULL, TRANSFER_CHUNK, SPLICE_F_MOVE)) > 0 || (moved == -1 && errno == EINTR)) {}
+    }
+    if (moved == -1 && S_ISREG(from_info.st_mode)) {
+        while ((moved = sendfile(to_fd, from_fd, NULL, TRANSFER_CHUNK)) > 0 || (moved == -1 && errno == EINTR)) {}
+    }
+    if (moved == 0) {
+        return 0;
+    }
+    while ((moved = read(from_fd, buffer, sizeof(buffer))) != 0) {
+        if (moved == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (write_all(to_fd, buffer, moved) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Copies everything from the pipe from_fd to every one of to_fds (pipes or files) without reading any of it.
+// Each round, tee duplicates what's waiting in from_fd into a spare pipe once for every fd but the last, and that copy is
+// spliced out to the fd. The last fd gets the data spliced straight out of from_fd, which takes it out of the pipe.
+// Returns -1 straight away if the fds aren't ones this works for, so the caller can do the copy itself
+int tee_by_splice(int from_fd, int* to_fds, int to_count) {
+    struct stat file_info;
+    int spare[2];
+    ssize_t chunk, duplicated;
+    int i, result = 0;
+
+    if (fstat(from_fd, &file_info) == -1 || !S_ISFIFO(file_info.st_mode)) {
+        return -1;
+    }
+    for (i = 0; i < to_count; i++) {
+        if (fstat(to_fds[i], &file_info) == -1 || !(S_ISFIFO(file_info.st_mode) || S_ISREG(file_info.st_mode))) {
+            return -1;
+        }
+    }
+    if (to_count == 1) {
+        return transfer_fd(from_fd, to_fds[0]);
+    }
+    if (pipe2(spare, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    while (result == 0) {
+        // The first tee decides how much this round moves. That's never more than the spare pipe holds,
+        // so every tee after it gets the same amount
+        do {
+            chunk = tee(from_fd, spare[1], TRANSFER_CHUNK, 0);
+        } while (chunk == -1 && errno == EINTR);
+        if (chunk <= 0) {
+            result = chunk;
+            break;
+        }
+        for (i = 0; i < to_count - 1 && result == 0; i++) {
+            if (i > 0) {
+                do {
+                    duplicated = tee(from_fd, spare[1], chunk, 0);
+                } while (duplicated == -1 && errno == EINTR);
+                if (duplicated != chunk) {
+                    result = -1;
+                    break;
+                }
+            }
+            result = splice_all(spare[0], to_fds[i], chunk);
+        }
+        if (result == 0) {
+            result = splice_all(from_fd, to_fds[to_count - 1], chunk);
+        }
+    }
+    close(spare[0]);
+    close(spare[1]);
+    return result;
+}
+
+// Splices exactly length bytes from from_fd to to_fd, one of which is a pipe. Returns -1 if it can't
+int splice_all(int from_fd, int to_fd, size_t length) {
+    ssize_t moved;
+
+    while (length > 0) {
+        moved = splice(from_fd, NULL, to_fd, NULL, length, SPLICE_F_MOVE);
+        if (moved == -1 && errno == EINTR) {
+            continue;
+        }
+        if (moved <= 0) {
+            return -1;
+        }
+        length -= moved;
+    }
+    return 0;
+}
+
+// Writes all of buffer to fd, however many writes it takes. Returns -1 if it can't
+int write_all(int fd, char* buffer, size_t length) {
+    ssize_t written;
+
+    while (length > 0) {
+        written = write(fd, buffer, length);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Error<BLANK>
+// time PIPELINE: runs the pipeline, then reports what it used on stderr (see report_job). The lexer takes care of this
+// one, so only the other forms get here:
+// time -a [SECONDS | off]: reports every foreground job that takes at least SECONDS, or shows when that happens.
+// time on its own times nothing, which takes no time
+Error builtin_time(int word_count, char** words, int* status, int* should_continue) {
+    struct rusage nothing;
+    double threshold;
+    char* end;
+
+    *status = 0;
+    if (word_count == 1) {
+        memset(&nothing, 0, sizeof(nothing));
+        print_usage_times("", 0, &nothing);
+        return new_ok(BLANK);
+    }
+    if (strcmp(words[1], "-a") != 0) {
+        printf("time: usage: time pipeline, or time -a [seconds | off]\n");
+        *status = 2;
+        return new_ok(BLANK);
+    }
+    if (word_count == 2) {
+        if (report_threshold < 0) {
+            printf("Jobs are not reported automatically\n");
+        } else {
+            printf("Jobs taking %gs or more are reported\n", report_threshold);
+        }
+        return new_ok(BLANK);
+    }
+    if (strcmp(words[2], "off") == 0) {
+        report_threshold = -1;
+        return new_ok(BLANK);
+    }
+    // Written this way round so that nan doesn't get through either
+    threshold = strtod(words[2], &end);
+    if (end == words[2] || *end != '\0' || !(threshold >= 0)) {
+        printf("time: usage: time pipeline, or time -a [seconds | off]\n");
+        *status = 2;
+        return new_ok(BLANK);
+    }
+    report_threshold = threshold;
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// stats [-r | -j]: shows how long each phase of running a line has taken (see Phase), as JSON with -j.
+// With -r it forgets all of it instead
+Error builtin_stats(int word_count, char** words, int* status, int* should_continue) {
+    *status = 0;
+    if (word_count > 1 && strcmp(words[1], "-r") == 0) {
+        memset(phase_histograms, 0, sizeof(phase_histograms));
+        return new_ok(BLANK);
+    }
+    display_stats(stdout, word_count > 1 && strcmp(words[1], "-j") == 0);
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// unset NAME...: removes shell variables, taking them out of the environment too if they were exported
+Error builtin_unset(int word_count, char** words, int* status, int* should_continue) {
+    int i;
+    for (i = 1; i < word_count; i++) {
+        unset_variable(words[i]);
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// NAME=VALUE...: sets shell variables. The lexer only picks this for commands made of nothing but those,
+// so every word has a valid name and an '=' in it. Exported variables stay exported
+Error builtin_assign(int word_count, char** words, int* status, int* should_continue) {
+    size_t length;
+    int i;
+    for (i = 0; i < word_count; i++) {
+        length = name_length(words[i]);
+        if (set_variable(words[i], length, words[i] + length + 1) == NULL) {
+            return new_err(0, "Variable failed to allocate");
+        }
+    }
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// cached [-n] [-f FILE]... [-m FILE]... [-e NAME]... [--] PIPELINE: runs the pipeline through the output cache,
+// see run_cached. -n runs it with nothing on stdin, which a pipeline needs to be cached unless it reads a file.
+// The lexer takes care of that one, so only the other forms get here:
+// cached [--clear]: shows how the output cache is doing, or empties it
+Error builtin_cached(int word_count, char** words, int* status, int* should_continue) {
+    *status = 0;
+    if (word_count > 2 || (word_count == 2 && strcmp(words[1], "--clear") != 0)) {
+        printf("cached: usage: cached [-n] [-f file]... [-m file]... [-e name]... [--] pipeline, or cached [--clear]\n");
+        *status = 2;
+        return new_ok(BLANK);
+    }
+    if (open_output_cache() == -1) {
+        *status = 1;
+        return new_ok(BLANK);
+    }
+    if (word_count == 2) {
+        clear_output_cache();
+        return new_ok(BLANK);
+    }
+    display_output_cache(stdout, 0);
+    return new_ok(BLANK);
+}
+
+// Error<BLANK>
+// The relay between a cached pipeline and the shell's stdout and stderr, see run_cached and CacheRelay.
+// It exits with 1 if it couldn't record everything, so run_cached knows not to keep what it did record.
+// If the shell's stdout or stderr goes away, so does the relay's end of that pipe, so the pipeline finds out too
+Error builtin_cache_relay(int word_count, char** words, int* status, int* should_continue) {
+    static char buffer[65536];
+    struct pollfd sources[2];
+    int targets[2] = {STDOUT_FILENO, STDERR_FILENO};
+    int records[2] = {cache_relay.output_record, cache_relay.error_record};
+    long long recorded = 0;
+    ssize_t read_result;
+    int i, open_count = 2;
+
+    *status = 0;
+    close(cache_relay.output_read);
+    close(cache_relay.output_write);
+    close(cache_relay.error_write);
+    sources[0].fd = STDIN_FILENO;
+    sources[1].fd = cache_relay.error_read;
+    sources[0].events = sources[1].events = POLLIN;
+    while (open_count > 0) {
+        if (poll(sources, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            *status = 1;
+            break;
+        }
+        for (i = 0; i < 2; i++) {
+            if (sources[i].fd == -1 || sources[i].revents == 0) {
+                continue;
+            }
+            read_result = read(sources[i].fd, buffer, sizeof(buffer));
+            if (read_result == -1 && errno == EINTR) {
+                continue;
+            }
+            if (read_result > 0 && write_all(targets[i], buffer, read_result) == -1) {
+                *status = 1;
+                read_result = 0;
+            }
+            if (read_result <= 0) {
+                close(sources[i].fd);
+                sources[i].fd = -1;
+                open_count--;
+                continue;
+            }
+            recorded += read_result;
+            if (*status == 0 && (recorded > cache_relay.limit || write_all(records[i], buffer, read_result) == -1)) {
+                *status = 1;
+            }
+        }
+    }
+    return new_ok(BLANK);
+}
+
+// Error<int>
+// Runs a cached pipeline. Its key (see make_cache_key) is looked up in the output cache, and if it's there, what the
+// pipeline printed and its exit status are replayed from the entry without running anything at all.
+// Otherwise the pipeline runs as usual, except its stdout and stderr are pipes to a relay (see builtin_cache_relay)
+// that passes everything on to the shell's as it comes and records it in memory files on the way through.
+// The recording only becomes an entry if the pipeline exited by itself (not from a signal) and all of it fit.
+// Only what the pipeline printed comes back on a hit, so cached is for commands that are run for their output.
+// Without a cache to use, or a key for this run, the pipeline just runs uncached
+Error run_cached(Pipeline* pipeline, int* should_continue) {
+    Pipeline uncached = *pipeline, relay_pipeline;
+    ShellCommand relay;
+    static char* relay_words[] = {"cached", NULL};
+    PipelineIO io = {-1, -1, -1};
+    unsigned long long key[2];
+    int output_pipe[2] = {-1, -1}, error_pipe[2] = {-1, -1};
+    int status, job_id;
+    Error start_result;
+    Job* relay_job, *job;
+    long long waited;
+
+    uncached.is_cached = 0;
+    if (open_output_cache() == -1 || make_cache_key(pipeline, key) == -1) {
+        return command(&uncached, should_continue);
+    }
+    if (replay_cache_entry(key) == 0) {
+        output_cache.hits++;
+        return new_ok((void*)&last_exit_status);
+    }
+    output_cache.misses++;
+    cache_relay.output_record = memfd_create("cached-output", MFD_CLOEXEC);
+    cache_relay.error_record = memfd_create("cached-errors", MFD_CLOEXEC);
+    cache_relay.limit = output_cache.limit - (long long)sizeof(CacheEntryHeader);
+    if (cache_relay.output_record == -1 || cache_relay.error_record == -1
+        || pipe2(output_pipe, O_CLOEXEC) == -1 || pipe2(error_pipe, O_CLOEXEC) == -1) {
+        cache_relay.output_read = output_pipe[0];
+        cache_relay.output_write = output_pipe[1];
+        close_cache_relay();
+        return command(&uncached, should_continue);
+    }
+    cache_relay.output_read = output_pipe[0];
+    cache_relay.output_write = output_pipe[1];
+    cache_relay.error_read = error_pipe[0];
+    cache_relay.error_write = error_pipe[1];
+    // The relay is started first, in the background, so it's already there to drain the pipes when the pipeline
+    // (or a builtin at the end of it, which runs in the shell) starts writing
+    memset(&relay, 0, sizeof(relay));
+    relay.command = relay_words;
+    relay.word_count = 1;
+    relay.builtin = CACHE_RELAY;
+    relay_pipeline = uncached;
+    relay_pipeline.commands = &relay;
+    relay_pipeline.command_count = 1;
+    relay_pipeline.is_background = 1;
+    relay_pipeline.is_timed = 0;
+    io.stdin = cache_relay.output_read;
+    start_result = start_pipeline(&relay_pipeline, &io, should_continue);
+    close(cache_relay.output_read);
+    close(cache_relay.error_read);
+    cache_relay.output_read = cache_relay.error_read = -1;
+    if (!start_result.is_ok) {
+        close_cache_relay();
+        return start_result;
+    }
+    relay_job = *(Job**)start_result.value_ptr;
+    io.stdin = -1;
+    io.stdout = cache_relay.output_write;
+    io.stderr = cache_relay.error_write;
+    start_result = start_pipeline(&uncached, &io, should_continue);
+    close(cache_relay.output_write);
+    close(cache_relay.error_write);
+    cache_relay.output_write = cache_relay.error_write = -1;
+    if (!start_result.is_ok) {
+        wait_for_job(relay_job);
+        close_cache_relay();
+        return start_result;
+    }
+    job = *(Job**)start_result.value_ptr;
+    job_id = job->id;
+    waited = now_ns();
+    wait_for_job(job);
+    // A stopped pipeline is still in the job table. It carries on whenever it's resumed, and its relay with it,
+    // so neither is waited for now and what it prints is never stored
+    if (jobs[job_id - 1] != NULL) {
+        line_work_ns += now_ns() - waited;
+        close_cache_relay();
+        return new_ok((void*)&last_exit_status);
+    }
+    status = last_exit_status;
+    wait_for_job(relay_job);
+    line_work_ns += now_ns() - waited;
+    if (status < 128 && last_exit_status == 0) {
+        store_cache_entry(key, status, cache_relay.output_record, cache_relay.error_record);
+    }
+    last_exit_status = status;
+    close_cache_relay();
+    return new_ok((void*)&last_exit_status);
+}
+
+// Closes whatever the shell still holds of a cached pipeline's pipes and recordings
+void close_cache_relay() {
+    int* fds[6] = {&cache_relay.output_read, &cache_relay.error_read, &cache_relay.output_write,
+        &cache_relay.error_write, &cache_relay.output_record, &cache_relay.error_record};
+    int i;
+    for (i = 0; i < 6; i++) {
+        if (*fds[i] != -1) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+// Returns 1 if any stage of a pipeline writes to a file of its own, which a cache hit couldn't bring back
+int pipeline_redirects_output(Pipeline* pipeline) {
+    int i;
+    for (i = 0; i < pipeline->command_count; i++) {
+        if (pipeline->commands[i].output_file != NULL || pipeline->commands[i].error_file != NULL
+            || pipeline->commands[i].output_pattern != NULL || pipeline->commands[i].error_pattern != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Works out the key of a cached pipeline run: every stage's words, assignments and input file as they expand right now,
+// the directory it runs in, and whatever its options say it depends on. -e NAME adds a variable's value, -f FILE
+// a file's contents, and -m FILE just a file's size, mtime and inode (which is much cheaper for big files).
+// Input files are keyed like -m ones, so a file that changes gets a new entry. Whatever the shell's stdin holds
+// can't be keyed at all, so a first stage that would read it (because it has no input file, and no -n) gets no key.
+// Returns -1, having said why, if there's no key this time, like when a file it depends on can't be read
+int make_cache_key(Pipeline* pipeline, unsigned long long* key) {
+    ShellCommand stage;
+    struct stat info;
+    Arena arena;
+    char* option, *value, *cwd;
+    int i, j, result = 0;
+
+    key[0] = 14695981039346656037ULL;
+    key[1] = 0x9e3779b97f4a7c15ULL;
+    hash_cache_string(key, 'v', "sish cached 1");
+    arena.head = NULL;
+    for (i = 0; i < pipeline->command_count && result == 0; i++) {
+        stage = pipeline->commands[i];
+        if (!expand_words(&stage, &arena).is_ok) {
+            printf("cached: word expansion failed to allocate\n");
+            result = -1;
+            break;
+        }
+        hash_cache_string(key, '|', "");
+        for (j = 0; j < stage.assignment_count; j++) {
+            hash_cache_string(key, 'a', stage.assignments[j]);
+        }
+        for (j = 0; j < stage.word_count; j++) {
+            hash_cache_string(key, 'w', stage.command[j]);
+        }
+        if (stage.input_file == NULL) {
+            if (i == 0) {
+                printf("cached: the pipeline reads the shell's stdin, so it runs uncached (-n gives it /dev/null)\n");
+                result = -1;
+            }
+            continue;
+        }
+        hash_cache_string(key, '<', "");
+        // Pipes and devices aren't the same from one read to the next, whatever their inodes say
+        if (strcmp(stage.input_file, "/dev/null") == 0) {
+            hash_cache_string(key, '<', stage.input_file);
+        } else
+        if (stat(stage.input_file, &info) == 0 && !S_ISREG(info.st_mode)) {
+            printf("cached: %s: only regular files can be cached from\n", stage.input_file);
+            result = -1;
+        } else
+        if (hash_cache_file(key, stage.input_file, 0) == -1) {
+            printf("cached: %s: %s\n", stage.input_file, strerror(errno));
+            result = -1;
+        }
+    }
+    cwd = getcwd(NULL, 0);
+    if (result == 0 && cwd == NULL) {
+        printf("cached: %s\n", strerror(errno));
+        result = -1;
+    }
+    if (result == 0) {
+        hash_cache_string(key, 'd', cwd);
+    }
+    free(cwd);
+    for (i = 0; i + 1 < pipeline->cache_word_count && result == 0; i += 2) {
+        option = pipeline->cache_words[i];
+        // -n is already in the key, as the first stage's input file
+        if (strcmp(option, "-n") == 0) {
+            i--;
+            continue;
+        }
+        value = pipeline->cache_words[i + 1];
+        if (pipeline->cache_patterns != NULL && pipeline->cache_patterns[i + 1] != NULL) {
+            value = expand_single_word(pipeline->cache_patterns[i + 1], &arena);
+            if (value == NULL) {
+                printf("cached: word expansion failed to allocate\n");
+                result = -1;
+                break;
+            }
+        }
+        if (strcmp(option, "-e") == 0) {
+            hash_cache_string(key, 'e', value);
+            if (get_variable(value) != NULL) {
+                hash_cache_string(key, '=', get_variable(value));
+            }
+        } else
+        if (hash_cache_file(key, value, strcmp(option, "-f") == 0) == -1) {
+            printf("cached: %s: %s\n", value, strerror(errno));
+            result = -1;
+        }
+    }
+    free_arena(&arena);
+    return result;
+}
+
+// Adds bytes to a cache key. A key is two 64-bit hashes of the same bytes, an FNV-1a and a multiply and xorshift one,
+// so two different runs only get the same key if both of them collide at once
+void hash_cache_bytes(unsigned long long* key, char* bytes, size_t length) {
+    unsigned long long first = key[0], second = key[1];
+    size_t i;
+    for (i = 0; i < length; i++) {
+        first = (first ^ (unsigned char)bytes[i]) * 1099511628211ULL;
+        second = (second + (unsigned char)bytes[i]) * 0x9e3779b97f4a7c15ULL;
+        second ^= second >> 29;
+    }
+    key[0] = first;
+    key[1] = second;
+}
+
+// Adds a string to a cache key, with its NUL and a byte in front saying what it is, so no two different runs
+// can add up to the same bytes
+void hash_cache_string(unsigned long long* key, char kind, char* text) {
+    hash_cache_bytes(key, &kind, 1);
+    hash_cache_bytes(key, text, strlen(text) + 1);
+}
+
+// Adds a file a cached pipeline depends on to its key: the whole of its contents, or with is_content unset, just its
+// size, mtime and inode. Only regular files have contents that can be counted on. Returns -1 if the file can't be read
+int hash_cache_file(unsigned long long* key, char* path, int is_content) {
+    struct stat info;
+    long long identity[5];
+    char* contents;
+    int fd;
+
+    hash_cache_string(key, is_content ? 'f' : 'm', path);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (!is_content) {
+        close(fd);
+        identity[0] = info.st_size;
+        identity[1] = info.st_mtim.tv_sec;
+        identity[2] = info.st_mtim.tv_nsec;
+        identity[3] = info.st_ino;
+        identity[4] = info.st_dev;
+        hash_cache_bytes(key, (char*)identity, sizeof(identity));
+        return 0;
+    }
+    if (!S_ISREG(info.st_mode)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    hash_cache_bytes(key, (char*)&info.st_size, sizeof(info.st_size));
+    if (info.st_size > 0) {
+        contents = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (contents == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(contents, info.st_size, MADV_SEQUENTIAL);
+        hash_cache_bytes(key, contents, info.st_size);
+        munmap(contents, info.st_size);
+    }
+    close(fd);
+    return 0;
+}
+
+// Opens the output cache the first time it's needed. It lives in SISH_CACHE_DIR, or in sish under XDG_CACHE_HOME
+// or ~/.cache, which is made if it isn't there yet. SISH_CACHE_SIZE is how many bytes of entries it keeps.
+// An index that isn't one this shell knows how to read is started over, along with the entries it had.
+// Returns -1, having said why, if there's no cache to be had
+int open_output_cache() {
+    struct stat info;
+    char path[PATH_MAX];
+    char* base;
+    int fd;
+
+    if (output_cache.index != NULL) {
+        return 0;
+    }
+    if ((base = get_variable("SISH_CACHE_DIR")) != NULL && base[0] != '\0') {
+        snprintf(path, sizeof(path), "%s", base);
+    } else
+    if ((base = get_variable("XDG_CACHE_HOME")) != NULL && base[0] == '/') {
+        snprintf(path, sizeof(path), "%s/sish", base);
+    } else
+    if ((base = get_variable("HOME")) != NULL && base[0] != '\0') {
+        snprintf(path, sizeof(path), "%s/.cache/sish", base);
+    } else {
+        printf("cached: nowhere to keep the cache, set SISH_CACHE_DIR\n");
+        return -1;
     }
+    if (make_directories(path) == -1) {
+        printf("cached: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    free(output_cache.directory);
+    output_cache.directory = strdup(path);
+    if (output_cache.directory == NULL) {
+        return -1;
+    }
+    base = get_variable("SISH_CACHE_SIZE");
+    if (base != NULL && atoll(base) > 0) {
+        output_cache.limit = atoll(base);
+    }
+    snprintf(path, sizeof(path), "%s/index", output_cache.directory);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        printf("cached: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &info) == -1
+        || (info.st_size != sizeof(OutputCacheIndex) && ftruncate(fd, sizeof(OutputCacheIndex)) == -1)) {
+        printf("cached: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    output_cache.index = mmap(NULL, sizeof(OutputCacheIndex), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    flock(fd, LOCK_UN);
+    if (output_cache.index == MAP_FAILED) {
+        printf("cached: %s: %s\n", path, strerror(errno));
+        output_cache.index = NULL;
+        close(fd);
+        return -1;
+    }
+    output_cache.index_fd = fd;
+    if (output_cache.index->magic != OUTPUT_CACHE_MAGIC) {
+        clear_output_cache();
+    }
+    return 0;
+}
+
+// Makes a directory, and any of the directories it's in that aren't there yet, like mkdir -p. Returns -1 if it can't
+int make_directories(char* path) {
+    char* slash;
+
+    for (slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+            *slash = '/';
+            return -1;
+        }
+        *slash = '/';
+    }
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+// Finds a key's slot in the output cache's index, or NULL if it isn't there. With should_create, a key that isn't there
+// gets the first tombstone or free slot along its probe sequence instead, and a size of 0 for the caller to fill in.
+// Eviction always leaves a quarter of the slots free, so a probe sequence always ends. The caller holds the index's lock
+OutputCacheEntry* find_cache_entry(unsigned long long* key, int should_create) {
+    OutputCacheIndex* index = output_cache.index;
+    OutputCacheEntry* entry = NULL, *reusable = NULL;
+    int slot, probes;
+
+    for (slot = key[0] % OUTPUT_CACHE_SLOTS, probes = 0; probes < OUTPUT_CACHE_SLOTS;
+        slot = (slot + 1) % OUTPUT_CACHE_SLOTS, probes++) {
+        entry = &index->entries[slot];
+        if (entry->size == 0) {
+            break;
+        }
+        if (entry->size == -1) {
+            if (reusable == NULL) {
+                reusable = entry;
+            }
+            continue;
+        }
+        if (entry->key[0] == key[0] && entry->key[1] == key[1]) {
+            return entry;
+        }
+    }
+    if (!should_create) {
+        return NULL;
+    }
+    if (reusable != NULL) {
+        index->tombstones--;
+    } else
+    if (probes < OUTPUT_CACHE_SLOTS) {
+        reusable = entry;
+    } else {
+        return NULL;
+    }
+    reusable->key[0] = key[0];
+    reusable->key[1] = key[1];
+    reusable->size = 0;
+    reusable->last_used = 0;
+    index->count++;
+    return reusable;
+}
+
+// Writes the path of a key's entry in the output cache to path, which has room for PATH_MAX bytes
+void cache_entry_path(unsigned long long* key, char* path) {
+    snprintf(path, PATH_MAX, "%s/%016llx%016llx", output_cache.directory, key[0], key[1]);
+}
+
+// Replays a key's entry of the output cache, if it has a whole one. Its output goes to stdout and its errors to stderr,
+// straight from the page cache wherever the kernel can manage it, and its exit status becomes last_exit_status.
+// An entry whose file has gone missing, or isn't whole, is dropped. Returns -1 (counting a miss) if there's no entry,
+// or 0 (counting a hit) once it's been replayed
+int replay_cache_entry(unsigned long long* key) {
+    OutputCacheIndex* index = output_cache.index;
+    OutputCacheEntry* entry;
+    CacheEntryHeader* header = NULL;
+    struct stat info;
+    char path[PATH_MAX];
+    char* mapping = MAP_FAILED;
+    int fd = -1;
+
+    flock(output_cache.index_fd, LOCK_EX);
+    entry = find_cache_entry(key, 0);
+    if (entry != NULL) {
+        cache_entry_path(key, path);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd != -1 && fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(CacheEntryHeader)) {
+            mapping = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        header = (CacheEntryHeader*)mapping;
+        if (mapping == MAP_FAILED || header->magic != CACHE_ENTRY_MAGIC || header->output_length < 0
+            || header->error_length < 0
+            || (long long)sizeof(CacheEntryHeader) + header->output_length + header->error_length != info.st_size) {
+            if (mapping != MAP_FAILED) {
+                munmap(mapping, info.st_size);
+            }
+            if (fd != -1) {
+                close(fd);
+                fd = -1;
+            }
+            unlink(path);
+            index->bytes -= entry->size;
+            entry->size = -1;
+            index->count--;
+            index->tombstones++;
+        } else {
+            entry->last_used = ++index->clock;
+        }
+    }
+    if (fd == -1) {
+        index->misses++;
+    } else {
+        index->hits++;
+    }
+    flock(output_cache.index_fd, LOCK_UN);
+    if (fd == -1) {
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    send_cache_region(fd, STDOUT_FILENO, mapping, sizeof(CacheEntryHeader), header->output_length);
+    send_cache_region(fd, STDERR_FILENO, mapping, sizeof(CacheEntryHeader) + header->output_length,
+        header->error_length);
+    last_exit_status = header->status;
+    munmap(mapping, info.st_size);
+    close(fd);
+    return 0;
+}
+
+// Sends length bytes of an entry, starting at offset, to to_fd. sendfile moves them from the page cache to wherever
+// to_fd is without them passing through the shell, and anywhere sendfile can't go gets them written from the entry's
+// mapping instead. Returns -1 if they couldn't all be sent
+int send_cache_region(int from_fd, int to_fd, char* mapping, off_t offset, size_t length) {
+    off_t end = offset + length;
+    ssize_t sent;
+
+    while (offset < end) {
+        sent = sendfile(to_fd, from_fd, &offset, end - offset > TRANSFER_CHUNK ? TRANSFER_CHUNK : end - offset);
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            break;
+        }
+    }
+    if (offset < end) {
+        return write_all(to_fd, mapping + offset, end - offset);
+    }
+    return 0;
+}
+
+// Makes an entry of what a pipeline printed (recorded in output_fd and error_fd) and its exit status, unless it's more
+// than the whole cache can hold. It's written under a temporary name and renamed into place, so no shell ever sees
+// half of one. Then the index gets it, and whatever no longer fits is evicted
+void store_cache_entry(unsigned long long* key, int status, int output_fd, int error_fd) {
+    CacheEntryHeader header;
+    struct stat output_info, error_info;
+    OutputCacheIndex* index = output_cache.index;
+    OutputCacheEntry* entry;
+    char path[PATH_MAX], entry_path[PATH_MAX];
+    long long size;
+    int fd;
+
+    if (fstat(output_fd, &output_info) == -1 || fstat(error_fd, &error_info) == -1) {
+        return;
+    }
+    size = sizeof(header) + output_info.st_size + error_info.st_size;
+    if (size > output_cache.limit) {
+        return;
+    }
+    header.magic = CACHE_ENTRY_MAGIC;
+    header.status = status;
+    header.output_length = output_info.st_size;
+    header.error_length = error_info.st_size;
+    snprintf(path, sizeof(path), "%s/.entry-XXXXXX", output_cache.directory);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    lseek(output_fd, 0, SEEK_SET);
+    lseek(error_fd, 0, SEEK_SET);
+    if (write_all(fd, (char*)&header, sizeof(header)) == -1 || transfer_fd(output_fd, fd) == -1
+        || transfer_fd(error_fd, fd) == -1) {
+        close(fd);
+        unlink(path);
+        return;
+    }
+    close(fd);
+    cache_entry_path(key, entry_path);
+    if (rename(path, entry_path) == -1) {
+        unlink(path);
+        return;
+    }
+    flock(output_cache.index_fd, LOCK_EX);
+    entry = find_cache_entry(key, 1);
+    if (entry != NULL) {
+        index->bytes += size - entry->size;
+        entry->size = size;
+        entry->last_used = ++index->clock;
+    }
+    evict_cache_entries();
+    flock(output_cache.index_fd, LOCK_UN);
+}
+
+// Evicts the least recently used entries of the output cache until the rest fit within its limit and three quarters
+// of the index's slots, then gets rid of the tombstones if they've taken up too many of the slots that are left.
+// Finding the oldest entry is a scan of the index, which is nothing next to writing out the entry that needed the room.
+// The caller holds the index's lock
+void evict_cache_entries() {
+    OutputCacheIndex* index = output_cache.index;
+    OutputCacheEntry* oldest;
+    char path[PATH_MAX];
+    int slot;
+
+    while (index->count > 0 && (index->bytes > output_cache.limit || index->count > OUTPUT_CACHE_SLOTS * 3 / 4)) {
+        oldest = NULL;
+        for (slot = 0; slot < OUTPUT_CACHE_SLOTS; slot++) {
+            if (index->entries[slot].size > 0
+                && (oldest == NULL || index->entries[slot].last_used < oldest->last_used)) {
+                oldest = &index->entries[slot];
+            }
+        }
+        if (oldest == NULL) {
+            break;
+        }
+        cache_entry_path(oldest->key, path);
+        unlink(path);
+        index->bytes -= oldest->size;
+        oldest->size = -1;
+        index->count--;
+        index->tombstones++;
+    }
+    if (index->count + index->tombstones > OUTPUT_CACHE_SLOTS * 3 / 4) {
+        compact_cache_index();
+    }
+}
+
+// Puts every entry of the output cache's index back in the slot it would get if it were added now, which leaves
+// no tombstones behind. The caller holds the index's lock
+void compact_cache_index() {
+    OutputCacheIndex* index = output_cache.index;
+    OutputCacheEntry* live, *entry;
+    int slot, count = 0;
+
+    live = malloc(sizeof(OutputCacheEntry) * (index->count + 1));
+    if (live == NULL) {
+        return;
+    }
+    for (slot = 0; slot < OUTPUT_CACHE_SLOTS; slot++) {
+        if (index->entries[slot].size > 0) {
+            live[count++] = index->entries[slot];
+        }
+    }
+    memset(index->entries, 0, sizeof(index->entries));
+    index->count = 0;
+    index->tombstones = 0;
+    for (slot = 0; slot < count; slot++) {
+        entry = find_cache_entry(live[slot].key, 1);
+        *entry = live[slot];
+    }
+    free(live);
+}
+
+// Empties the output cache: every entry (and any temporary file a shell didn't get to finish) is removed,
+// and the index starts over. Anything else in the directory is left alone
+void clear_output_cache() {
+    OutputCacheIndex* index = output_cache.index;
+    DIR* directory;
+    struct dirent* file;
+    char path[PATH_MAX];
+
+    flock(output_cache.index_fd, LOCK_EX);
+    directory = opendir(output_cache.directory);
+    while (directory != NULL && (file = readdir(directory)) != NULL) {
+        if (strncmp(file->d_name, ".entry-", 7) == 0
+            || (strlen(file->d_name) == 32 && strspn(file->d_name, "0123456789abcdef") == 32)) {
+            snprintf(path, sizeof(path), "%s/%s", output_cache.directory, file->d_name);
+            unlink(path);
+        }
+    }
+    if (directory != NULL) {
+        closedir(directory);
+    }
+    memset(index, 0, sizeof(OutputCacheIndex));
+    index->magic = OUTPUT_CACHE_MAGIC;
+    flock(output_cache.index_fd, LOCK_UN);
+}
+
+// Shows how well the output cache is doing, for stats and cached. Once it's been opened, that includes the totals of
+// every shell using the same cache
+void display_output_cache(FILE* out, int as_json) {
+    OutputCacheIndex* index = output_cache.index;
+
+    if (as_json) {
+        fprintf(out, "{\"cache\": \"output\", \"hits\": %lld, \"misses\": %lld", output_cache.hits, output_cache.misses);
+        if (index != NULL) {
+            fprintf(out, ", \"total_hits\": %lld, \"total_misses\": %lld, \"entries\": %d, \"bytes\": %lld, \"limit\": %lld",
+                index->hits, index->misses, index->count, index->bytes, output_cache.limit);
+        }
+        fprintf(out, "}\n");
+        return;
+    }
+    fprintf(out, "output cache: %lld hits, %lld misses", output_cache.hits, output_cache.misses);
+    if (index != NULL) {
+        fprintf(out, " (%lld hits, %lld misses in all), %d entries (%lld of %lld bytes) kept in %s",
+            index->hits, index->misses, index->count, index->bytes, output_cache.limit, output_cache.directory);
+    }
+    fprintf(out, "\n");
+}
+
+// Error<BLANK>
+// Starts the audit log, appending to the file at path. SISH_AUDIT_FSYNC is how many seconds the writer lets pass
+// between fsyncs (1 by default), and SISH_AUDIT_MAX_SIZE how many bytes the file can grow to (10 MiB by default)
+// before it's moved to path.1 (replacing the one before) and a fresh file is started
+Error init_audit_log(char* path) {
+    char* fsync_interval = getenv("SISH_AUDIT_FSYNC");
+    char* max_size = getenv("SISH_AUDIT_MAX_SIZE");
+    struct stat file_info;
+    sigset_t all_signals, saved_signals;
+
+    audit.path = strdup(path);
+    audit.queue = malloc(AUDIT_QUEUE_SIZE);
+    if (audit.path == NULL || audit.queue == NULL) {
+        free(audit.path);
+        free(audit.queue);
+        return new_err(0, "Audit log failed to allocate");
+    }
+    audit.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (audit.fd == -1 || fstat(audit.fd, &file_info) == -1) {
+        if (audit.fd != -1) {
+            close(audit.fd);
+            audit.fd = -1;
+        }
+        free(audit.path);
+        free(audit.queue);
+        return new_err(0, "Audit log could not be opened");
+    }
+    audit.size = file_info.st_size;
+    audit.max_size = max_size != NULL && atoll(max_size) > 0 ? atoll(max_size) : 10 * 1024 * 1024;
+    audit.fsync_interval = fsync_interval != NULL && *fsync_interval != '\0' ? atof(fsync_interval) : 1;
+    audit.dropped = 0;
+    atomic_init(&audit.head, 0);
+    atomic_init(&audit.tail, 0);
+    atomic_init(&audit.is_stopping, 0);
+    audit.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    // Signals are for the shell. The writer starts with all of them blocked, so they're always handled by the shell's thread
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &saved_signals);
+    if (audit.wake_fd == -1 || pthread_create(&audit.writer, NULL, write_audit_log, NULL) != 0) {
+        pthread_sigmask(SIG_SETMASK, &saved_signals, NULL);
+        close(audit.fd);
+        if (audit.wake_fd != -1) {
+            close(audit.wake_fd);
+        }
+        free(audit.path);
+        free(audit.queue);
+        return new_err(0, "Audit log writer could not be started");
+    }
+    pthread_sigmask(SIG_SETMASK, &saved_signals, NULL);
+    audit_cwd = getcwd(NULL, 0);
+    audit_enabled = 1;
+    return new_ok(BLANK);
+}
+
+// Lets the writer finish off whatever is still queued and waits for it. Does nothing if the audit log isn't on
+void stop_audit_log() {
+    unsigned long long wake = 1;
+
+    if (!audit_enabled) {
+        return;
+    }
+    audit_enabled = 0;
+    atomic_store_explicit(&audit.is_stopping, 1, memory_order_release);
+    write(audit.wake_fd, &wake, sizeof(wake));
+    pthread_join(audit.writer, NULL);
+    close(audit.fd);
+    close(audit.wake_fd);
+    free(audit.queue);
+    free(audit.path);
+}
+
+// Queues the audit log's line for a finished job: when it started, where, the words of every stage, the pids and
+// statuses of every stage, the pipeline's status (the last stage's) and how long it took
+void audit_job(Job* job) {
+    static char* buffer = NULL;
+    static size_t capacity = 0;
+    char number[64];
+    struct timespec now;
+    struct tm started_tm;
+    double real = job_real_seconds(job), started;
+    size_t length = 0;
+    time_t started_seconds;
+    long started_ms;
+    int i;
+
+    if (buffer == NULL) {
+        capacity = 1024;
+        buffer = malloc(capacity);
+    }
+    // The job only knows when it started on the monotonic clock, so the wall clock time is worked back from now
+    clock_gettime(CLOCK_REALTIME, &now);
+    started = now.tv_sec + now.tv_nsec / 1e9 - real;
+    started_seconds = (time_t)started;
+    started_ms = (long)((started - started_seconds) * 1000);
+    gmtime_r(&started_seconds, &started_tm);
+    strftime(number, sizeof(number), "{\"time\":\"%Y-%m-%dT%H:%M:%S", &started_tm);
+    append_text(&buffer, &length, &capacity, number, strlen(number));
+    sprintf(number, ".%03ldZ\",\"cwd\":", started_ms);
+    append_text(&buffer, &length, &capacity, number, strlen(number));
+    append_json_string(&buffer, &length, &capacity, audit_cwd != NULL ? audit_cwd : "");
+    append_text(&buffer, &length, &capacity, ",\"line\":", 8);
+    append_json_string(&buffer, &length, &capacity, job->text);
+    append_text(&buffer, &length, &capacity, ",\"argv\":", 8);
+    if (job->argv_json != NULL) {
+        append_text(&buffer, &length, &capacity, job->argv_json, strlen(job->argv_json));
+    } else {
+        append_text(&buffer, &length, &capacity, "null", 4);
+    }
+    append_text(&buffer, &length, &capacity, ",\"pids\":[", 9);
+    for (i = 0; i < job->process_count; i++) {
+        sprintf(number, i == 0 ? "%d" : ",%d", (int)job->pids[i]);
+        append_text(&buffer, &length, &capacity, number, strlen(number));
+    }
+    append_text(&buffer, &length, &capacity, "],\"statuses\":[", 14);
+    for (i = 0; i < job->process_count; i++) {
+        sprintf(number, i == 0 ? "%d" : ",%d", job->statuses[i]);
+        append_text(&buffer, &length, &capacity, number, strlen(number));
+    }
+    sprintf(number, "],\"status\":%d,\"duration_ms\":%.3f}\n", job->statuses[job->process_count - 1], real * 1000);
+    append_text(&buffer, &length, &capacity, number, strlen(number));
+    if (buffer == NULL) {
+        capacity = 0;
+        return;
+    }
+    push_audit_line(buffer, length);
+}
+
+// Copies a line into the audit log's queue. This is the only part of the audit log the shell ever waits for
+void push_audit_line(char* text, size_t length) {
+    size_t head = atomic_load_explicit(&audit.head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&audit.tail, memory_order_acquire);
+    size_t offset, first_part;
+    unsigned long long wake = 1;
+    char dropped_line[64];
+
+    // Make sure a gap in the log doesn't go unnoticed, as soon as there's room to say so
+    if (audit.dropped > 0 && AUDIT_QUEUE_SIZE - (head - tail) >= length + sizeof(dropped_line)) {
+        sprintf(dropped_line, "{\"dropped\":%lld}\n", audit.dropped);
+        audit.dropped = 0;
+        push_audit_line(dropped_line, strlen(dropped_line));
+        head = atomic_load_explicit(&audit.head, memory_order_relaxed);
+    }
+    if (AUDIT_QUEUE_SIZE - (head - tail) < length) {
+        audit.dropped++;
+        return;
+    }
+    offset = head % AUDIT_QUEUE_SIZE;
+    first_part = length < AUDIT_QUEUE_SIZE - offset ? length : AUDIT_QUEUE_SIZE - offset;
+    memcpy(audit.queue + offset, text, first_part);
+    memcpy(audit.queue, text + first_part, length - first_part);
+    atomic_store_explicit(&audit.head, head + length, memory_order_release);
+    // The writer gets to the queue on its own every AUDIT_WAKE_MS. It's only woken early (a system call) once the queue
+    // is half full, so the usual line costs the shell nothing but the copy
+    if (head + length - tail > AUDIT_QUEUE_SIZE / 2) {
+        write(audit.wake_fd, &wake, sizeof(wake));
+    }
+}
+
+// The audit log's writer thread. Every AUDIT_WAKE_MS (or sooner, if woken), it writes out everything queued in as few
+// writes as it can, and fsyncs once fsync_interval has passed since the last time anything was fsynced
+void* write_audit_log(void* unused) {
+    struct pollfd wake;
+    struct iovec parts[2];
+    unsigned long long wakes;
+    size_t head, tail, offset, length;
+    ssize_t written;
+    long long last_sync = now_ns();
+    int is_stopping, has_unsynced = 0;
+
+    wake.fd = audit.wake_fd;
+    wake.events = POLLIN;
+    while (1) {
+        if (poll(&wake, 1, AUDIT_WAKE_MS) > 0) {
+            read(audit.wake_fd, &wakes, sizeof(wakes));
+        }
+        // Stopping is checked before the queue, so the last look at the queue sees everything the shell ever queued
+        is_stopping = atomic_load_explicit(&audit.is_stopping, memory_order_acquire);
+        head = atomic_load_explicit(&audit.head, memory_order_acquire);
+        tail = atomic_load_explicit(&audit.tail, memory_order_relaxed);
+        while (tail != head) {
+            // Only whole lines go in each file, as many as fit before it has to be rotated
+            length = head - tail;
+            if (audit.size + (off_t)length > audit.max_size) {
+                length = audit_lines_within(tail, length, audit.size < audit.max_size ? audit.max_size - audit.size : 0);
+                if (length == 0 && audit.size > 0) {
+                    rotate_audit_log();
+                    continue;
+                }
+                // A single line bigger than a whole file still has to go somewhere, so it gets a file to itself
+                if (length == 0) {
+                    for (length = 1; audit.queue[(tail + length - 1) % AUDIT_QUEUE_SIZE] != '\n'; length++) {}
+                }
+            }
+            offset = tail % AUDIT_QUEUE_SIZE;
+            parts[0].iov_base = audit.queue + offset;
+            parts[0].iov_len = length < AUDIT_QUEUE_SIZE - offset ? length : AUDIT_QUEUE_SIZE - offset;
+            parts[1].iov_base = audit.queue;
+            parts[1].iov_len = length - parts[0].iov_len;
+            written = writev(audit.fd, parts, parts[1].iov_len > 0 ? 2 : 1);
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            // If the disk won't take it, it's dropped rather than blocking the queue forever
+            if (written <= 0) {
+                written = length;
+            }
+            audit.size += written;
+            tail += written;
+            atomic_store_explicit(&audit.tail, tail, memory_order_release);
+            has_unsynced = 1;
+        }
+        if (has_unsynced && (is_stopping || now_ns() - last_sync >= audit.fsync_interval * 1e9)) {
+            fdatasync(audit.fd);
+            last_sync = now_ns();
+            has_unsynced = 0;
+        }
+        if (is_stopping) {
+            return NULL;
+        }
+    }
+}
+
+// Returns how many bytes of the queue from tail make up whole lines without going over limit.
+// There are available bytes queued, and they always end with a whole line
+size_t audit_lines_within(size_t tail, size_t available, size_t limit) {
+    size_t length;
+    if (available <= limit) {
+        return available;
+    }
+    for (length = limit; length > 0 && audit.queue[(tail + length - 1) % AUDIT_QUEUE_SIZE] != '\n'; length--) {}
+    return length;
+}
+
+// Moves the full audit log to path.1 and starts a new one. If that fails, the log just keeps growing
+void rotate_audit_log() {
+    char* rotated_path = malloc(strlen(audit.path) + 3);
+    int fd;
+
+    if (rotated_path == NULL) {
+        return;
+    }
+    sprintf(rotated_path, "%s.1", audit.path);
+    fdatasync(audit.fd);
+    if (rename(audit.path, rotated_path) == 0) {
+        fd = open(audit.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (fd != -1) {
+            dup2(fd, audit.fd);
+            close(fd);
+            audit.size = 0;
+        }
+    }
+    free(rotated_path);
+}
+
+// Adds text to a buffer as a JSON string, quotes and escapes included
+void append_json_string(char** buffer, size_t* length, size_t* capacity, char* text) {
+    char escape[8];
+    char* run = text;
+
+    append_text(buffer, length, capacity, "\"", 1);
+    for (; *text != '\0'; text++) {
+        if (*text != '"' && *text != '\\' && (unsigned char)*text >= 0x20) {
+            continue;
+        }
+        append_text(buffer, length, capacity, run, text - run);
+        if (*text == '"' || *text == '\\') {
+            sprintf(escape, "\\%c", *text);
+        } else {
+            sprintf(escape, "\\u%04x", (unsigned char)*text);
+        }
+        append_text(buffer, length, capacity, escape, strlen(escape));
+        run = text + 1;
+    }
+    append_text(buffer, length, capacity, run, text - run);
+    append_text(buffer, length, capacity, "\"", 1);
+}
+
+// Error<BLANK>
+// Sets up an empty history with room for capacity entries, backed by the history file at file_path (if it isn't NULL or empty).
+// The history still works without the file if the file can't be opened, in which case the error says why
+Error init_history(History* target, int capacity, char* file_path) {
+    struct stat file_info;
+
+    target->entries = malloc(sizeof(char*) * capacity);
+    if (target->entries == NULL) {
+        return new_err(0, "History failed to allocate");
+    }
+    target->capacity = capacity;
+    target->start = 0;
+    target->count = 0;
+    target->first_seq = 0;
+    target->index = NULL;
+    target->index_slots = 0;
+    target->index_used = 0;
+    target->index_built = 0;
+    target->file_fd = -1;
+    target->file_map = NULL;
+    target->file_size = 0;
+    target->file_loaded = 1;
+    if (file_path == NULL || file_path[0] == '\0') {
+        return new_ok(BLANK);
+    }
+    target->file_fd = open(file_path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (target->file_fd == -1) {
+        return new_err(errno, "History file could not be opened");
+    }
+    if (fstat(target->file_fd, &file_info) == 0 && file_info.st_size > 0) {
+        // Private and writable, so newlines can become NULs without the file itself changing
+        target->file_map = mmap(NULL, file_info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, target->file_fd, 0);
+        if (target->file_map == MAP_FAILED) {
+            target->file_map = NULL;
+        } else {
+            target->file_size = file_info.st_size;
+            target->file_loaded = 0;
+        }
+    }
+    return new_ok(BLANK);
 }
 
-// clears the history when history -c is used
+// Fills whatever room is left in front of the history's entries with the newest entries of the history file.
+// Only looks at as much of the file as it needs to, starting from the end
+void load_history_file(History* target) {
+    char* end, *entry_start;
+    int room;
+
+    if (target->file_loaded) {
+        return;
+    }
+    target->file_loaded = 1;
+    room = target->capacity - target->count;
+    end = target->file_map + target->file_size;
+    // The last entry should end in a newline, unless the shell that wrote it died halfway. Such an entry is skipped
+    while (end > target->file_map && end[-1] != '\n') {
+        end--;
+    }
+    while (room > 0 && end > target->file_map) {
+        // end is just past a newline. Find the start of the entry it ends
+        end--;
+        for (entry_start = end; entry_start > target->file_map && entry_start[-1] != '\n'; entry_start--) {}
+        *end = '\0';
+        // Older entries go in front of the ones we already have
+        target->start = (target->start + target->capacity - 1) % target->capacity;
+        target->entries[target->start] = entry_start;
+        target->count++;
+        target->first_seq--;
+        room--;
+        end = entry_start;
+    }
+}
+
+// Returns how many entries the history currently holds
+int history_length() {
+    load_history_file(history);
+    return history->count;
+}
+
+// Returns the history entry at index, where 0 is the oldest entry. The index has to be less than history_length()
+char* history_entry(int index) {
+    load_history_file(history);
+    return history->entries[(history->start + index) % history->capacity];
+}
+
+// Frees a history entry, unless it points into the history file's mapping and so was never allocated
+void free_history_entry(History* target, char* entry) {
+    if (target->file_map != NULL && entry >= target->file_map && entry < target->file_map + target->file_size) {
+        return;
+    }
+    free(entry);
+}
+
+// appends commands to the ring and, if there is one, the history file
+// if the ring is full, the oldest command is evicted to make room
+void add_history(char* commandInput) {
+    size_t length = strlen(commandInput);
+    char* entry;
+    int slot;
+
+    // Blank lines aren't worth remembering
+    if (strspn(commandInput, " \t") == length) {
+        return;
+    }
+    entry = strdup(commandInput);
+    if (entry == NULL) {
+        return;
+    }
+    if (history->count == history->capacity) {
+        // The ring is full: the oldest entry's slot becomes the newest entry's slot
+        free_history_entry(history, history->entries[history->start]);
+        history->entries[history->start] = entry;
+        history->start = (history->start + 1) % history->capacity;
+        history->first_seq++;
+    } else {
+        slot = (history->start + history->count) % history->capacity;
+        history->entries[slot] = entry;
+        history->count++;
+    }
+    if (history->index_built) {
+        index_history_entry(history, entry, history->first_seq + history->count - 1);
+    }
+    if (history->file_fd != -1) {
+        // The file is append only, so the entry and its newline are written together and land in one piece
+        entry[length] = '\n';
+        write(history->file_fd, entry, length + 1);
+        entry[length] = '\0';
+    }
+}
+
+// displays the history
+void display_history() {
+    int i;
+    for (i = 0; i < history_length(); i++) {
+        printf("(%d): %s\n", i, history_entry(i));
+    }
+}
+
+// clears the history when history -c is used, including the history file
 void clear_history() {
     int i;
-    for (i = 0; i < history_count; i++) {
-        free(history[i]);
+    load_history_file(history);
+    for (i = 0; i < history->count; i++) {
+        free_history_entry(history, history->entries[(history->start + i) % history->capacity]);
+    }
+    history->start = 0;
+    history->count = 0;
+    reset_history_index(history);
+    if (history->file_map != NULL) {
+        munmap(history->file_map, history->file_size);
+        history->file_map = NULL;
+        history->file_size = 0;
+    }
+    if (history->file_fd != -1) {
+        ftruncate(history->file_fd, 0);
+    }
+}
+
+// Frees everything a history holds, for histories that go away before the shell does (like a server session's)
+void free_history(History* target) {
+    int i;
+    for (i = 0; i < target->count; i++) {
+        free_history_entry(target, target->entries[(target->start + i) % target->capacity]);
+    }
+    free(target->entries);
+    reset_history_index(target);
+    if (target->file_map != NULL) {
+        munmap(target->file_map, target->file_size);
+    }
+    if (target->file_fd != -1) {
+        close(target->file_fd);
+    }
+}
+
+// Indexes every entry currently in the history. Afterwards, add_history indexes new entries as they come in
+void build_history_index(History* target) {
+    int i;
+    if (target->index_built) {
+        return;
+    }
+    load_history_file(target);
+    target->index_built = 1;
+    for (i = 0; i < target->count; i++) {
+        index_history_entry(target, target->entries[(target->start + i) % target->capacity], target->first_seq + i);
+    }
+}
+
+// Adds the entry numbered seq to the posting list of each of its trigrams, including the start of line one
+void index_history_entry(History* target, char* entry, long long seq) {
+    char marked[3];
+    size_t length = strlen(entry);
+    size_t i;
+
+    if (length >= 2) {
+        marked[0] = HISTORY_LINE_START;
+        marked[1] = entry[0];
+        marked[2] = entry[1];
+        add_posting(target, make_trigram(marked), seq);
+    }
+    for (i = 0; i + 3 <= length; i++) {
+        add_posting(target, make_trigram(entry + i), seq);
+    }
+}
+
+// Adds the entry numbered seq to one trigram's posting list
+void add_posting(History* target, unsigned int trigram, long long seq) {
+    TrigramPostings* postings = find_postings(target, trigram, 1);
+    long long* grown;
+    int stale;
+
+    if (postings == NULL) {
+        return;
+    }
+    // A trigram appearing more than once in an entry only needs to be listed once
+    if (postings->count > 0 && postings->seqs[postings->count - 1] == seq) {
+        return;
+    }
+    if (postings->count == postings->capacity) {
+        // Before growing, make room by dropping evicted entries off the front of the list
+        for (stale = 0; stale < postings->count && postings->seqs[stale] < target->first_seq; stale++) {}
+        if (stale > 0) {
+            memmove(postings->seqs, postings->seqs + stale, sizeof(long long) * (postings->count - stale));
+            postings->count -= stale;
+        } else {
+            grown = realloc(postings->seqs, sizeof(long long) * (postings->capacity == 0 ? 4 : postings->capacity * 2));
+            if (grown == NULL) {
+                return;
+            }
+            postings->seqs = grown;
+            postings->capacity = postings->capacity == 0 ? 4 : postings->capacity * 2;
+        }
+    }
+    postings->seqs[postings->count++] = seq;
+}
+
+// Finds the posting list for a trigram in the index's open addressing table, or NULL if there isn't one.
+// If should_create is set, a missing list is made (and the table grown if it's getting full) instead
+TrigramPostings* find_postings(History* target, unsigned int trigram, int should_create) {
+    TrigramPostings* old_index, *slot;
+    int old_slots, i;
+    unsigned int position;
+
+    if (should_create && (target->index_used + 1) * 10 > target->index_slots * 7) {
+        old_index = target->index;
+        old_slots = target->index_slots;
+        target->index_slots = old_slots == 0 ? 1024 : old_slots * 2;
+        target->index = calloc(target->index_slots, sizeof(TrigramPostings));
+        if (target->index == NULL) {
+            target->index = old_index;
+            target->index_slots = old_slots;
+            return NULL;
+        }
+        for (i = 0; i < old_slots; i++) {
+            if (old_index[i].trigram != 0) {
+                position = (old_index[i].trigram * 2654435761U) & (target->index_slots - 1);
+                while (target->index[position].trigram != 0) {
+                    position = (position + 1) & (target->index_slots - 1);
+                }
+                target->index[position] = old_index[i];
+            }
+        }
+        free(old_index);
+    }
+    if (target->index_slots == 0) {
+        return NULL;
+    }
+    position = (trigram * 2654435761U) & (target->index_slots - 1);
+    for (slot = &target->index[position]; slot->trigram != 0; slot = &target->index[position]) {
+        if (slot->trigram == trigram) {
+            return slot;
+        }
+        position = (position + 1) & (target->index_slots - 1);
+    }
+    if (!should_create) {
+        return NULL;
+    }
+    slot->trigram = trigram;
+    slot->seqs = NULL;
+    slot->count = 0;
+    slot->capacity = 0;
+    target->index_used++;
+    return slot;
+}
+
+// Throws the whole index away. It's rebuilt the next time it's needed
+void reset_history_index(History* target) {
+    int i;
+    for (i = 0; i < target->index_slots; i++) {
+        free(target->index[i].seqs);
+    }
+    free(target->index);
+    target->index = NULL;
+    target->index_slots = 0;
+    target->index_used = 0;
+    target->index_built = 0;
+}
+
+// Packs the first three characters of text into a trigram
+unsigned int make_trigram(char* text) {
+    return ((unsigned char)text[0] << 16) | ((unsigned char)text[1] << 8) | (unsigned char)text[2];
+}
+
+// Lists every history entry containing pattern, oldest first, numbered the same way display_history numbers them
+void search_history(char* pattern) {
+    TrigramPostings* postings, *shortest = NULL;
+    size_t pattern_length = strlen(pattern), i;
+    int j;
+    char* entry;
+
+    build_history_index(history);
+    if (pattern_length < 3) {
+        // Too short to have a trigram, so every entry has to be checked
+        for (j = 0; j < history->count; j++) {
+            entry = history_entry(j);
+            if (strstr(entry, pattern) != NULL) {
+                printf("(%d): %s\n", j, entry);
+            }
+        }
+        return;
     }
-    history_count = 0;
-}
\ No newline at end of file
+    // Only entries containing every trigram of the pattern can match, so the rarest trigram narrows things down the most
+    for (i = 0; i + 3 <= pattern_length; i++) {
+        postings = find_postings(history, make_trigram(pattern + i), 0);
+        if (postings == NULL) {
+            return;
+        }
+        if (shortest == NULL || postings->count < shortest->count) {
+            shortest = postings;
+        }
+    }
+    for (j = 0; j < shortest->count; j++) {
+        if (shortest->seqs[j] < history->first_seq) {
+            continue;
+        }
+        entry = history_entry(shortest->seqs[j] - history->first_seq);
+        if (strstr(entry, pattern) != NULL) {
+            printf("(%lld): %s\n", shortest->seqs[j] - history->first_seq, entry);
+        }
+    }
+}
+
+// Returns the newest history entry starting with prefix, or NULL if there isn't one
+char* find_history_prefix(char* prefix) {
+    TrigramPostings* postings;
+    size_t prefix_length = strlen(prefix);
+    char marked[3];
+    char* entry;
+    int j;
+
+    build_history_index(history);
+    if (prefix_length < 2) {
+        // Too short for a start of line trigram, so we walk back from the newest entry
+        for (j = history->count - 1; j >= 0; j--) {
+            entry = history_entry(j);
+            if (strncmp(entry, prefix, prefix_length) == 0) {
+                return entry;
+            }
+        }
+        return NULL;
+    }
+    marked[0] = HISTORY_LINE_START;
+    marked[1] = prefix[0];
+    marked[2] = prefix[1];
+    postings = find_postings(history, make_trigram(marked), 0);
+    if (postings == NULL) {
+        return NULL;
+    }
+    for (j = postings->count - 1; j >= 0 && postings->seqs[j] >= history->first_seq; j--) {
+        entry = history_entry(postings->seqs[j] - history->first_seq);
+        if (strncmp(entry, prefix, prefix_length) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}